@@ -6,6 +6,7 @@
 #include <string.h>
 #include <semaphore.h>
 
+#include "message.h"
 #include "log.h"
 
 static struct msgqueue *create_internal_buffer (struct msgqueue *prev)
@@ -24,10 +25,21 @@ static void buffer_push (struct buffer *buff, char *str)
 {
 	int oldstate;
 
+	/* A held buffer keeps the reader waiting, the end always gets through */
+	pthread_mutex_lock(&(buff->mutex));
+	pthread_cleanup_push((void (*)(void*)) pthread_mutex_unlock, &(buff->mutex));
+	while (buff->held && str != NULL)
+		pthread_cond_wait(&(buff->released), &(buff->mutex));
+	pthread_cleanup_pop(1);
+
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 	pthread_mutex_lock(&(buff->mutex));
 
 	buff->current->msgs[buff->endindex] = str;
+	if (str != NULL)
+		buff->bytes_queued += strlen(str);
+	else
+		buff->ended = TRUE;
 	
 	buff->endindex++;
 	if (buff->endindex == REALLOC_SIZE)
@@ -64,6 +76,8 @@ static void buffer_unpop (struct buffer *buff, char *msg)
 	buff->headindex--;
 
 	buff->head->msgs[buff->headindex] = msg;
+	if (msg != NULL)
+		buff->bytes_queued += strlen(msg);
 	
 	pthread_mutex_unlock(&(buff->mutex));
 	
@@ -73,18 +87,18 @@ static void buffer_unpop (struct buffer *buff, char *msg)
 	pthread_testcancel();
 }
 
-static char *buffer_pop (struct buffer *buff)
+static char *buffer_take (struct buffer *buff)
 {
 	int oldstate;
 	char *retval;
 
-	sem_wait(&(buff->semaphore));
-
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
 	pthread_mutex_lock(&(buff->mutex));
 
 	retval = buff->head->msgs[buff->headindex];
 	buff->headindex++;
+	if (retval != NULL)
+		buff->bytes_queued -= strlen(retval);
 
 	if (buff->headindex == REALLOC_SIZE)
 	{
@@ -97,11 +111,95 @@ static char *buffer_pop (struct buffer *buff)
 	pthread_mutex_unlock(&(buff->mutex));
 	pthread_setcancelstate(oldstate, NULL);
 
+	return retval;
+}
+
+static char *buffer_pop (struct buffer *buff)
+{
+	char *retval;
+
+	sem_wait(&(buff->semaphore));
+
+	retval = buffer_take(buff);
+
 	pthread_testcancel();
 
 	return retval;
 }
 
+static int buffer_pop_batch (struct buffer *buff, char **msgs, int max)
+{
+	int count;
+
+	/* Wait for at least one message */
+	msgs[0] = buffer_pop(buff);
+	if (msgs[0] == NULL)
+		return 0;
+
+	/* Take whatever else is queued right now, without waiting */
+	for (count = 1; count < max && sem_trywait(&(buff->semaphore)) == 0; count++)
+	{
+		msgs[count] = buffer_take(buff);
+
+		/* Leave the end of buffer marker for the next pop */
+		if (msgs[count] == NULL)
+		{
+			buffer_unpop(buff, NULL);
+			break;
+		}
+	}
+
+	return count;
+}
+
+static void buffer_hold (struct buffer *buff, int held)
+{
+	pthread_mutex_lock(&(buff->mutex));
+	if (buff->held != held)
+	{
+		buff->held = held;
+		if (! held)
+			pthread_cond_broadcast(&(buff->released));
+	}
+	pthread_mutex_unlock(&(buff->mutex));
+}
+
+static long buffer_bytes (struct buffer *buff)
+{
+	long retval;
+
+	pthread_mutex_lock(&(buff->mutex));
+	retval = buff->bytes_queued;
+	pthread_mutex_unlock(&(buff->mutex));
+
+	return retval;
+}
+
+static int buffer_at_end (struct buffer *buff)
+{
+	int retval;
+
+	pthread_mutex_lock(&(buff->mutex));
+	retval = buff->ended;
+	pthread_mutex_unlock(&(buff->mutex));
+
+	return retval;
+}
+
+static void buffer_release (struct buffer *buff, char *msg)
+{
+	/* Only the consumer moves it on, the producer reads it to truncate its log */
+	if (message_seq(msg) > buff->consumed)
+		__sync_lock_test_and_set(&buff->consumed, message_seq(msg));
+
+	message_free(msg);
+}
+
+static long long buffer_progress (struct buffer *buff)
+{
+	return __sync_add_and_fetch(&buff->consumed, 0);
+}
+
 static int buffer_size (struct buffer *buff)
 {
 	int retval;
@@ -120,7 +218,12 @@ struct buffer*
 	
 	sem_init(&(buff->semaphore), 0, 0);
 	pthread_mutex_init(&(buff->mutex), NULL);
+	pthread_cond_init(&(buff->released), NULL);
 
+	buff->held      = FALSE;
+	buff->bytes_queued = 0;
+	buff->ended     = FALSE;
+	buff->consumed  = 0;
 	buff->headindex = 0;
 	buff->endindex  = 0;
 	buff->head      = create_internal_buffer(NULL);
@@ -128,8 +231,14 @@ struct buffer*
 	
 	buff->push  = buffer_push;
 	buff->pop   = buffer_pop;
+	buff->pop_batch = buffer_pop_batch;
 	buff->unpop = buffer_unpop;
 	buff->size  = buffer_size;
+	buff->hold  = buffer_hold;
+	buff->bytes = buffer_bytes;
+	buff->at_end = buffer_at_end;
+	buff->release  = buffer_release;
+	buff->progress = buffer_progress;
 
 	return buff;
 }
@@ -140,6 +249,7 @@ int buffer_cleanup(struct buffer *buff)
 	struct msgqueue *curr, *next;
 	
 	pthread_mutex_destroy(&(buff->mutex));
+	pthread_cond_destroy(&(buff->released));
 	sem_destroy(&(buff->semaphore));
 
 	/* Cleanup buffers */
@@ -156,7 +266,7 @@ int buffer_cleanup(struct buffer *buff)
 		/* Cleanup remaining messages */
 		while (index < end)
 		{
-			free(curr->msgs[index]);
+			message_free(curr->msgs[index]);
 			index++;
 		}
 		index = REALLOC_SIZE;
@@ -18,6 +18,17 @@ struct buffer {
 	sem_t semaphore;
 	pthread_mutex_t mutex;
 
+	/* Pushing waits while a full backlog holds the input back */
+	pthread_cond_t released;
+	int held;
+
+	/* Payload bytes queued, and whether the end of input was queued */
+	long bytes_queued;
+	int  ended;
+
+	/* Sequence number of the last message the consumer is done with */
+	long long consumed;
+
 	int headindex;
 	int endindex;
 	struct msgqueue *head;
@@ -25,8 +36,14 @@ struct buffer {
 
 	void  (*push)  (struct buffer*, char *str);
 	char *(*pop)   (struct buffer*);
+	int   (*pop_batch) (struct buffer*, char **msgs, int max);
 	void  (*unpop) (struct buffer*, char *str);
 	int   (*size)  (struct buffer*);
+	void  (*hold)  (struct buffer*, int held);
+	long  (*bytes) (struct buffer*);
+	int   (*at_end) (struct buffer*);
+	void  (*release)  (struct buffer*, char *msg);
+	long long (*progress) (struct buffer*);
 };
 
 extern struct buffer*
@@ -0,0 +1,232 @@
+#include "defines.h"
+#include "control.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "options.h"
+#include "log.h"
+
+/* Seconds a client may keep us waiting for its next command */
+#define CONTROL_CLIENT_TIMEOUT	5
+
+struct control {
+	char *path;
+	int   fd;
+	pthread_t thread;
+
+	struct logger **loggers;
+	int count;
+};
+
+static struct logger *control_find (struct control *this, char *name)
+{
+	char *end;
+	int i;
+
+	/* By number, as given on the command line */
+	i = strtol(name, &end, 10);
+	if (end != name && *end == '\0')
+		return (i >= 0 && i < this->count ? this->loggers[i] : NULL);
+
+	/* Or by resource */
+	for (i = 0; i < this->count; i++)
+	{
+		if (strcmp(this->loggers[i]->dest->res, name) == 0)
+			return this->loggers[i];
+	}
+
+	return NULL;
+}
+
+static void control_stats (struct control *this, FILE *out)
+{
+	char line[512];
+	int i, len;
+
+	for (i = 0; i < this->count; i++)
+	{
+		len = ratelimit_describe(this->loggers[i]->limit, line, sizeof(line));
+		if (len < (int) sizeof(line))
+			len += snprintf(line + len, sizeof(line) - len, " queued-bytes=%ld", this->loggers[i]->buffer->bytes(this->loggers[i]->buffer));
+
+		/* The journal only exists once the logger runs */
+		pthread_mutex_lock(&this->loggers[i]->lock);
+		if (this->loggers[i]->journal != NULL && len + 1 < (int) sizeof(line))
+		{
+			line[len++] = ' ';
+			journal_describe(this->loggers[i]->journal, line + len, sizeof(line) - len);
+		}
+		pthread_mutex_unlock(&this->loggers[i]->lock);
+
+		fprintf(out, "%d %s %s\n", i, this->loggers[i]->dest->res, line);
+	}
+}
+
+static void control_rate (struct control *this, FILE *out, char *args)
+{
+	struct logger *logger;
+	struct options *opts;
+	char *name, *spec, *bad;
+
+	if ((name = strsep(&args, " \t")) == NULL || *name == '\0' || (logger = control_find(this, name)) == NULL)
+	{
+		fprintf(out, "error: unknown destination\n");
+		return;
+	}
+
+	opts = options_init();
+	while ((spec = strsep(&args, " \t")) != NULL)
+	{
+		if (*spec != '\0' && ! options_add(opts, spec))
+		{
+			fprintf(out, "error: expected <name>=<value>: %s\n", spec);
+			options_cleanup(opts);
+			return;
+		}
+	}
+
+	/* Anything wrong leaves the limit as it was */
+	if ((bad = ratelimit_set(logger->limit, opts, TRUE)) != NULL)
+		fprintf(out, "error: invalid option %s\n", bad);
+	else
+	{
+		CustomLog(__FILE__, __LINE__, info, "Rate limit of %s changed", logger->dest->res);
+		fprintf(out, "ok\n");
+	}
+
+	options_cleanup(opts);
+}
+
+static void control_serve (struct control *this, int fd)
+{
+	char *line = NULL, *args, *cmd;
+	size_t size = 0;
+	FILE *in, *out;
+	int len;
+
+	in  = fdopen(fd, "r");
+	out = fdopen(dup(fd), "w");
+	if (in == NULL || out == NULL)
+	{
+		SysErr(errno, "While opening control connection");
+		if (in != NULL)
+			fclose(in);
+		else
+			close(fd);
+		return;
+	}
+
+	while ((len = getline(&line, &size, in)) > 0)
+	{
+		/* Strip the line end, and split off the command */
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		args = line;
+		cmd  = strsep(&args, " \t");
+
+		if (strcmp(cmd, "stats") == 0)
+		{
+			control_stats(this, out);
+			fprintf(out, "ok\n");
+		}
+		else if (strcmp(cmd, "rate") == 0)
+			control_rate(this, out, args);
+		else if (*cmd != '\0')
+			fprintf(out, "error: unknown command %s\n", cmd);
+
+		fflush(out);
+	}
+
+	free(line);
+	fclose(out);
+	fclose(in);
+}
+
+static void *control_run (void *arg)
+{
+	struct control *this = (struct control*) arg;
+	struct timeval timeout;
+	int fd;
+
+	while (TRUE)
+	{
+		/* Only stop in between clients */
+		if ((fd = accept(this->fd, NULL, NULL)) == -1)
+		{
+			if (errno != EINTR && errno != ECONNABORTED)
+				SysErr(errno, "While accepting control connection");
+			continue;
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		/* Don't let an idle client block shutdown */
+		timeout.tv_sec  = CONTROL_CLIENT_TIMEOUT;
+		timeout.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		control_serve(this, fd);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+
+	return NULL;
+}
+
+void control_cleanup (struct control *this)
+{
+	if (this == NULL)
+		return;
+
+	pthread_cancel(this->thread);
+	pthread_join(this->thread, NULL);
+
+	close(this->fd);
+	unlink(this->path);
+	free(this->path);
+	free(this);
+}
+
+struct control *control_init (char *path, struct logger **loggers, int count)
+{
+	struct control *this;
+	struct sockaddr_un addr;
+
+	this = (struct control*) calloc (1, sizeof(struct control));
+	SysFatal(this == NULL, errno, "While creating control socket");
+
+	this->path    = strdup(path);
+	this->loggers = loggers;
+	this->count   = count;
+	SysFatal(this->path == NULL, errno, "While creating control socket");
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Control socket path too long: %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* A socket left behind by an earlier run is in the way */
+	unlink(path);
+
+	SysFatal((this->fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1, errno, "On control socket create");
+	SysFatal(bind(this->fd, (struct sockaddr*) &addr, sizeof(addr)) == -1, errno, "On control socket bind");
+	SysFatal(listen(this->fd, 4) == -1, errno, "On control socket listen");
+
+	SysFatal(pthread_create(&this->thread, NULL, control_run, this), errno, "On control thread start");
+
+	return this;
+}
@@ -0,0 +1,20 @@
+#ifndef GENCACHE_CONTROL_H
+#define GENCACHE_CONTROL_H
+
+#include "logger.h"
+
+/** Control socket
+ *
+ * A unix stream socket taking one command per line. Every command is
+ * answered with zero or more lines, followed by "ok" or "error: <why>".
+ *
+ *   stats                           a line of metrics per destination
+ *   rate <dest> <name>=<value> ...  change the rate limit of a destination,
+ *                                   <dest> is its number or its resource
+ */
+struct control;
+
+extern struct control *control_init    (char *path, struct logger **loggers, int count);
+extern void            control_cleanup (struct control *);
+
+#endif /* GENCACHE_CONTROL_H */
@@ -0,0 +1,79 @@
+#include "defines.h"
+#include "deadletter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "log.h"
+
+struct deadletter *deadletter_init (char *res, struct options *opts)
+{
+	struct deadletter *this;
+	char *path;
+
+	this = (struct deadletter*) calloc (1, sizeof(struct deadletter));
+	SysFatal(this == NULL, errno, "While creating dead letters");
+
+	this->res = res;
+	path      = options_get(opts, "dead-letter", NULL);
+
+	/* Appended to, it may be shared with other destinations */
+	if (path != NULL && (this->file = fopen(path, "a")) == NULL)
+	{
+		fprintf(stderr, "Can't open dead-letter file %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	return this;
+}
+
+void deadletter_write (struct deadletter *this, const char *reason, const char *data, int len)
+{
+	const char *end = data + len;
+	const char *eol;
+	char stamp[32];
+	struct tm tm;
+	time_t now;
+	int count;
+
+	time(&now);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", localtime_r(&now, &tm));
+
+	/* A line of its own for every message, in one go for all of them */
+	if (this->file != NULL)
+		flockfile(this->file);
+
+	for (count = 0; data < end; count++, data = eol)
+	{
+		if ((eol = memchr(data, '\n', end - data)) != NULL)
+			eol++;
+		else
+			eol = end;
+
+		if (this->file != NULL)
+			fprintf(this->file, "%s\t%s\t%s\t%.*s%s", stamp, this->res, reason, (int) (eol - data), data, eol[-1] == '\n' ? "" : "\n");
+	}
+
+	if (this->file != NULL)
+	{
+		if (fflush(this->file) != 0)
+			SysErr(errno, "While writing dead letters");
+		funlockfile(this->file);
+	}
+
+	__sync_add_and_fetch(&this->count, count);
+	CustomLog(__FILE__, __LINE__, error, "Gave up on %d messages to %s (%s), %s", count, this->res, reason,
+		this->file != NULL ? "moved them to the dead-letter file" : "dropped them");
+}
+
+void deadletter_cleanup (struct deadletter *this)
+{
+	if (this == NULL)
+		return;
+
+	if (this->file != NULL)
+		fclose(this->file);
+	free(this);
+}
@@ -0,0 +1,35 @@
+#ifndef GENCACHE_DEADLETTER_H
+#define GENCACHE_DEADLETTER_H
+
+#include <stdio.h>
+
+#include "options.h"
+
+/** Dead letters of a destination
+ *
+ * Messages a destination won't take, however often they're tried, are
+ * moved out of the way so they don't hold up everything behind them.
+ * With a dead-letter file each of them is appended to it as one line of
+ * tab separated fields, so 'cut -f4-' gets the messages back:
+ *
+ *   time    when it was given up on
+ *   res     the destination
+ *   reason  why it was given up on
+ *   message the message itself
+ *
+ * Without a file they're only counted and logged. When to give up on a
+ * message is up to the destination.
+ */
+struct deadletter {
+	char *res;
+	FILE *file;
+
+	long long count;	/* Messages given up on */
+};
+
+extern struct deadletter *deadletter_init (char *res, struct options *opts);
+
+extern void deadletter_write   (struct deadletter *, const char *reason, const char *data, int len);	/* Data may hold several messages */
+extern void deadletter_cleanup (struct deadletter *);
+
+#endif /* GENCACHE_DEADLETTER_H */
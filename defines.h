@@ -12,5 +12,6 @@
 
 #define GENCACHE_MAX_MSG_SIZE       1000000
 #define GENCACHE_MAX_INPUT_HANDLERS 16
+#define GENCACHE_MAX_OUTPUT_HANDLERS 16
 
 #endif /* GENCACHE_DEFINES_H */
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <errno.h>
 
+#include "message.h"
 #include "log.h"
 
 #undef fprintf
@@ -256,7 +257,7 @@ char *input_buffer_getline (struct input_buffer *buffer)
 	}
 
 	/* Allocate memory for line */
-	line = (char*) malloc (len + 1);
+	line = message_alloc (len + 1);
 	SysFatal(line == NULL, errno, "While trying to allocate string for lineinput");
 	
 	if (buffer->border + len > buffer->end)
@@ -302,6 +303,21 @@ char *input_buffer_getline (struct input_buffer *buffer)
 	return line;
 }
 
+int input_buffer_copy (struct input_buffer *buffer, char *out)
+{
+	int size, len, taillen;
+
+	/* What was read but not taken yet, a partial line */
+	size = buffer->end - buffer->start;
+	len  = size - buffer->available;
+
+	taillen = MIN(len, buffer->end - buffer->border);
+	memcpy(out, buffer->border, taillen);
+	memcpy(out + taillen, buffer->start, len - taillen);
+
+	return len;
+}
+
 void input_buffer_free (struct input_buffer *buffer)
 {
 	/* Validate buffer integrity */
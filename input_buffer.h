@@ -17,6 +17,7 @@ extern  int  input_buffer_find      (struct input_buffer *buffer, int c);
 extern  int  input_buffer_validate  (struct input_buffer *buffer);
 extern  int  input_buffer_purgeline (struct input_buffer *buffer);
 extern char *input_buffer_getline   (struct input_buffer *buffer);
+extern  int  input_buffer_copy      (struct input_buffer *buffer, char *out);
 
 extern void  input_buffer_free      (struct input_buffer *buffer);
 
@@ -15,7 +15,7 @@
 #include "input_tools.h"
 #include "log.h"
 
-struct input_handler *input_handler_file_init (char *res)
+struct input_handler *input_handler_file_init (char *res, struct options *opts)
 {
 	int fd;
 	
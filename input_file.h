@@ -2,7 +2,8 @@
 #define GENCACHE_INPUT_FILE_H
 
 #include "input.h"
+#include "options.h"
 
-extern struct input_handler *input_handler_file_init (char*);
+extern struct input_handler *input_handler_file_init (char *, struct options *);
 
 #endif /* GENCACHE_INPUT_FILE_H */
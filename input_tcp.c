@@ -8,6 +8,7 @@
 
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
@@ -16,6 +17,7 @@
 #include "net_tools.h"
 #include "input_tcp_connection.h"
 #include "input_tools.h"
+#include "upgrade.h"
 #include "log.h"
 
 /* Input handler private data */
@@ -26,6 +28,8 @@
 #define	DATA	((struct ih_tcp_priv*) this->priv)
 struct ih_tcp_priv {
     int  fd;
+    int  compress;	/* Connections carry a zlib stream */
+    int  relay;		/* Connections speak the acked relay protocol */
 };
 
 static int input_handler_tcp_read (struct input_handler *this, struct reader *report)
@@ -46,7 +50,7 @@ static int input_handler_tcp_read (struct input_handler *this, struct reader *re
 		{
 			/* Got a connection, create a new connection input handler */
 //			shutdown(fd, 1);
-			handler = input_handler_tcp_connection_init("<slave>", fd);
+			handler = input_handler_tcp_connection_init("<slave>", fd, DATA->compress, DATA->relay);
 
 			Fatal(handler == NULL, "NULL", "[TCP input handler] On connection handler creation");
 
@@ -103,8 +107,9 @@ static int input_handler_tcp_cleanup (struct input_handler *this)
 	return 1;
 }
 
-struct input_handler *input_handler_tcp_init (char *res)
+struct input_handler *input_handler_tcp_init (char *res, struct options *opts)
 {
+	char *compress, *protocol;
 	int proto;
 	
 	/* Declare and create basic input_handler structure */
@@ -131,10 +136,37 @@ struct input_handler *input_handler_tcp_init (char *res)
 	this->getfd   = input_handler_tcp_getfd;
 	this->cleanup = input_handler_tcp_cleanup;
 
-	/* Open the input stream */
-	proto = net_get_protocol("tcp");
-	DATA->fd = net_create_listening_socket(res, "tcp", proto);
-	SysFatal(listen(DATA->fd, 5) == -1, errno, "[TCP input handler] When trying to listen to socket");
+	/* Check if the peers compress their stream */
+	compress = options_get(opts, "compress", "none");
+	if (strcasecmp(compress, "zlib") == 0)
+		DATA->compress = TRUE;
+	else if (strcasecmp(compress, "none") == 0)
+		DATA->compress = FALSE;
+	else
+	{
+		fprintf(stderr, "Unknown compression: %s\n", compress);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Check if the peers frame their batches */
+	protocol = options_get(opts, "protocol", "plain");
+	if (strcasecmp(protocol, "relay") == 0)
+		DATA->relay = TRUE;
+	else if (strcasecmp(protocol, "plain") == 0)
+		DATA->relay = FALSE;
+	else
+	{
+		fprintf(stderr, "Unknown protocol: %s\n", protocol);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Open the input stream, unless the process we upgrade from hands it over */
+	if ((DATA->fd = upgrade_socket("tcp-server", res)) == -1)
+	{
+		proto = net_get_protocol("tcp");
+		DATA->fd = net_create_listening_socket(res, "tcp", proto);
+		SysFatal(listen(DATA->fd, 5) == -1, errno, "[TCP input handler] When trying to listen to socket");
+	}
 
 	return this;
 }
@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 
 #include <unistd.h>
@@ -11,12 +12,302 @@
 #include <stdio.h>
 #include <errno.h>
 #include <err.h>
+#include <arpa/inet.h>
+#include <zlib.h>
 
+#include "relay.h"
 #include "net_tools.h"
 #include "input_tools.h"
+#include "message.h"
 #include "log.h"
 
-struct input_handler *input_handler_tcp_connection_init (char *res, int fd)
+/* Bytes taken from the socket (or out of inflate) in one go */
+#define TCP_CONN_RAW_SIZE	65536
+
+/* Connection private data, the common part has to go first */
+#define ZDATA	((struct ih_tcp_conn_priv*) this->priv)
+struct ih_tcp_conn_priv {
+	struct ih_common_priv common;
+	int      compress;
+	int      relay;
+	z_stream stream;
+	char    *raw;
+	char    *chunk;
+
+	/* Relay frames being put together, and what to ack */
+	char    *frame;
+	int      framesize;
+	int      framelen;
+	unsigned int acked;
+	int      ackdue;
+};
+
+static void input_handler_tcp_connection_lines (struct input_handler *this, struct reader *report, char *data, int len)
+{
+	int n;
+
+	/* Copy into the line buffer, emptying it as we go */
+	while (len > 0)
+	{
+		Require(DATA->inbuf->write > 0);
+
+		n = MIN(len, DATA->inbuf->write);
+		memcpy(DATA->inbuf->current, data, n);
+		input_buffer_update(DATA->inbuf, n);
+		data += n;
+		len  -= n;
+
+		input_handler_common_lines(this, report);
+	}
+}
+
+static void input_handler_tcp_connection_report (struct reader *report, char *line, int len)
+{
+	char *msg;
+	int newline;
+
+	/* Every line ends with a newline, even a stray last one */
+	newline = (line[len - 1] != '\n');
+
+	msg = message_alloc(len + newline + 1);
+	SysFatal(msg == NULL, errno, "While trying to allocate string for relay input");
+	memcpy(msg, line, len);
+	if (newline)
+		msg[len] = '\n';
+	msg[len + newline] = '\0';
+
+	report->report_data(report, msg);
+}
+
+static int input_handler_tcp_connection_frames (struct input_handler *this, struct reader *report, char *data, int len)
+{
+	unsigned int header[RELAY_HEADER_SIZE / 4];
+	char *payload, *line, *end, *next;
+	int used, length;
+
+	/* Add to what we've got of the current frame(s) */
+	if (ZDATA->framelen + len > ZDATA->framesize)
+	{
+		ZDATA->framesize = MAX(ZDATA->framesize * 2, ZDATA->framelen + len);
+		ZDATA->frame = (char*) realloc (ZDATA->frame, ZDATA->framesize);
+		SysFatal(ZDATA->frame == NULL, errno, "While growing relay frame buffer");
+	}
+	memcpy(ZDATA->frame + ZDATA->framelen, data, len);
+	ZDATA->framelen += len;
+
+	/* Take out every complete frame */
+	used = 0;
+	while (ZDATA->framelen - used >= RELAY_HEADER_SIZE)
+	{
+		memcpy(header, ZDATA->frame + used, RELAY_HEADER_SIZE);
+		length = ntohl(header[3]);
+		if (ntohl(header[0]) != RELAY_FRAME_MAGIC || length < 0 || length > RELAY_MAX_PAYLOAD)
+		{
+			Log2(error, "Garbage on relay stream", "[TCP connection input handler]");
+			return FALSE;
+		}
+
+		if (ZDATA->framelen - used < RELAY_HEADER_SIZE + length)
+			break;
+
+		/* Report the lines in the frame */
+		payload = ZDATA->frame + used + RELAY_HEADER_SIZE;
+		end     = payload + length;
+		for (line = payload; line < end; line = next)
+		{
+			next = memchr(line, '\n', end - line);
+			next = (next == NULL ? end : next + 1);
+			input_handler_tcp_connection_report(report, line, next - line);
+		}
+
+		ZDATA->acked  = ntohl(header[1]);
+		ZDATA->ackdue = TRUE;
+		used += RELAY_HEADER_SIZE + length;
+	}
+
+	/* Keep the start of the next frame */
+	if (used > 0)
+	{
+		memmove(ZDATA->frame, ZDATA->frame + used, ZDATA->framelen - used);
+		ZDATA->framelen -= used;
+	}
+
+	return TRUE;
+}
+
+static int input_handler_tcp_connection_ack (struct input_handler *this)
+{
+	unsigned int ack[RELAY_ACK_SIZE / 4];
+	int sent, n;
+
+	/* One cumulative ack for everything taken in */
+	ack[0] = htonl(RELAY_ACK_MAGIC);
+	ack[1] = htonl(ZDATA->acked);
+
+	for (sent = 0; sent < RELAY_ACK_SIZE; sent += n)
+	{
+		n = write(DATA->fd, (char*) ack + sent, RELAY_ACK_SIZE - sent);
+		if (n == -1 && errno == EINTR)
+			n = 0;
+		else if (n == -1)
+		{
+			SysErr(errno, "While sending relay ack");
+			return FALSE;
+		}
+	}
+
+	ZDATA->ackdue = FALSE;
+	return TRUE;
+}
+
+static int input_handler_tcp_connection_consume (struct input_handler *this, struct reader *report, char *data, int len)
 {
-	return input_handler_common_init("tcp-conn", res, fd);
+	if (ZDATA->relay)
+		return input_handler_tcp_connection_frames(this, report, data, len);
+
+	input_handler_tcp_connection_lines(this, report, data, len);
+	return TRUE;
+}
+
+static int input_handler_tcp_connection_read (struct input_handler *this, struct reader *report)
+{
+	int err, ret, readcount, maxread, produced;
+
+	/* Check if this input source is in a valid state */
+	if (DATA->state == is_eof)
+		return -1;
+
+	/* Determine how much data is available */
+	if (ioctl(DATA->fd, FIONREAD, &maxread) == -1)
+	{
+		SysErr(errno, "Error on ioctl FIONREAD on connection");
+		DATA->state = is_eof;
+		return -1;
+	}
+
+	/* Nothing available means the peer is gone */
+	if (maxread == 0)
+	{
+		DATA->state = is_eof;
+		return -1;
+	}
+	maxread = MIN(TCP_CONN_RAW_SIZE, maxread);
+
+	readcount = read(DATA->fd, ZDATA->raw, maxread);
+	if (readcount == -1)
+	{
+		err = errno;
+		if (err == EAGAIN || err == EINTR)
+			return 0;
+
+		SysErr(err, "Error occured during read from connection");
+		DATA->state = is_eof;
+		return -1;
+	}
+	else if (readcount == 0)
+	{
+		DATA->state = is_eof;
+		return -1;
+	}
+
+	if (! ZDATA->compress)
+	{
+		if (! input_handler_tcp_connection_consume(this, report, ZDATA->raw, readcount))
+		{
+			DATA->state = is_eof;
+			return -1;
+		}
+	}
+	else
+	{
+		/* Inflate chunk by chunk */
+		ZDATA->stream.next_in  = (Bytef*) ZDATA->raw;
+		ZDATA->stream.avail_in = readcount;
+		do
+		{
+			ZDATA->stream.next_out  = (Bytef*) ZDATA->chunk;
+			ZDATA->stream.avail_out = TCP_CONN_RAW_SIZE;
+
+			ret = inflate(&ZDATA->stream, Z_SYNC_FLUSH);
+			switch (ret)
+			{
+				case Z_OK:
+				case Z_BUF_ERROR:
+					break;
+
+				/* The peer may start over with a fresh stream */
+				case Z_STREAM_END:
+					inflateReset(&ZDATA->stream);
+					break;
+
+				default:
+					CustomLog(__FILE__, __LINE__, error, "Corrupt compressed stream: %s", ZDATA->stream.msg ? ZDATA->stream.msg : "unknown error");
+					DATA->state = is_eof;
+					return -1;
+			}
+
+			produced = TCP_CONN_RAW_SIZE - ZDATA->stream.avail_out;
+			if (produced > 0 && ! input_handler_tcp_connection_consume(this, report, ZDATA->chunk, produced))
+			{
+				DATA->state = is_eof;
+				return -1;
+			}
+		}
+		while (ZDATA->stream.avail_in > 0 || ZDATA->stream.avail_out == 0);
+	}
+
+	/* Everything read is on the queues now, let the sender know */
+	report->commit(report);
+	if (ZDATA->relay && ZDATA->ackdue && ! input_handler_tcp_connection_ack(this))
+	{
+		DATA->state = is_eof;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int input_handler_tcp_connection_cleanup (struct input_handler *this)
+{
+	/* Tidy up our own part, the rest is common */
+	if (ZDATA->compress)
+		inflateEnd(&ZDATA->stream);
+	free(ZDATA->raw);
+	free(ZDATA->chunk);
+	free(ZDATA->frame);
+
+	return input_handler_common_cleanup(this);
+}
+
+struct input_handler *input_handler_tcp_connection_init (char *res, int fd, int compress, int relay)
+{
+	struct input_handler *this = input_handler_common_init("tcp-conn", res, fd);
+
+	/* Plain lines are handled by the common code */
+	if (! compress && ! relay)
+		return this;
+
+	/* Grow the private data to hold our own state */
+	this->priv = realloc (this->priv, sizeof(struct ih_tcp_conn_priv));
+	SysFatal(this->priv == NULL, errno, "When allocating connection data");
+	memset((char*) this->priv + sizeof(struct ih_common_priv), 0, sizeof(struct ih_tcp_conn_priv) - sizeof(struct ih_common_priv));
+
+	ZDATA->compress = compress;
+	ZDATA->relay    = relay;
+
+	ZDATA->raw = (char*) malloc (TCP_CONN_RAW_SIZE);
+	SysFatal(ZDATA->raw == NULL, errno, "When allocating connection buffer");
+
+	if (compress)
+	{
+		ZDATA->chunk = (char*) malloc (TCP_CONN_RAW_SIZE);
+		SysFatal(ZDATA->chunk == NULL, errno, "When allocating inflate buffer");
+		Fatal(inflateInit(&ZDATA->stream) != Z_OK, "inflateInit failed", "[TCP connection input handler]");
+	}
+
+	this->type    = relay ? "tcp-relay" : "tcp-zconn";
+	this->read    = input_handler_tcp_connection_read;
+	this->cleanup = input_handler_tcp_connection_cleanup;
+
+	return this;
 }
@@ -3,6 +3,6 @@
 
 #include "input.h"
 
-extern struct input_handler *input_handler_tcp_connection_init (char *, int);
+extern struct input_handler *input_handler_tcp_connection_init (char *, int, int, int);
 
 #endif /* GENCACHE_INPUT_TCP_CONNECTION_H */
@@ -17,7 +17,6 @@
 int input_handler_common_read (struct input_handler *this, struct reader *report)
 {
 	int err, readcount, maxread;
-	char *msg;
 
 	Log2(debug, "Read requested", "[input_tools.c]{read}");
 
@@ -104,6 +103,13 @@ int input_handler_common_read (struct input_handler *this, struct reader *report
 			input_buffer_update(DATA->inbuf, readcount);
 	}
 
+	return input_handler_common_lines(this, report);
+}
+
+int input_handler_common_lines (struct input_handler *this, struct reader *report)
+{
+	char *msg;
+
 	/* Check if we're in an error state */
 	if (DATA->state == is_err)
 	{
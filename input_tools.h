@@ -26,6 +26,8 @@ extern int
 	input_handler_common_cleanup(struct input_handler*);
 extern int
 	input_handler_common_read(struct input_handler*, struct reader*);
+extern int
+	input_handler_common_lines(struct input_handler*, struct reader*);
 extern struct input_handler *
 	input_handler_common_init(char *type, char *res, int fd);
 	
@@ -14,6 +14,8 @@
 
 #include "input_tools.h"
 #include "net_tools.h"
+#include "message.h"
+#include "upgrade.h"
 #include "log.h"
 
 int input_handler_udp_read (struct input_handler *this, struct reader *report)
@@ -96,7 +98,7 @@ int input_handler_udp_read (struct input_handler *this, struct reader *report)
 	}
 
 	/* Push the whole msg in the queue */
-	msg = (char*) malloc (readcount + 2);
+	msg = message_alloc (readcount + 2);
 	if (msg == NULL)
 	{
 		Log2(err, "Unable to allocate memory for message", "[input_udp.c]{read}");
@@ -132,13 +134,16 @@ int input_handler_udp_read (struct input_handler *this, struct reader *report)
 	return 0;
 }
 
-struct input_handler *input_handler_udp_init (char *res)
+struct input_handler *input_handler_udp_init (char *res, struct options *opts)
 {
 	int fd, proto;
 	
-	/* Open the input stream */
-	proto = net_get_protocol ("udp");
-	fd    = net_create_listening_socket(res, "udp", proto);
+	/* Open the input stream, unless the process we upgrade from hands it over */
+	if ((fd = upgrade_socket("udp", res)) == -1)
+	{
+		proto = net_get_protocol ("udp");
+		fd    = net_create_listening_socket(res, "udp", proto);
+	}
 
 	struct input_handler *this = input_handler_common_init("udp", res, fd);
 
@@ -15,6 +15,7 @@
 #include <err.h>
 
 #include "input_tools.h"
+#include "upgrade.h"
 #include "log.h"
 
 static int make_named_socket (const char *filename)
@@ -65,10 +66,14 @@ static int connect_to_named_socket (const char *filename)
 	return connect(sock, (struct sockaddr *) &name, size);
 }
 
-struct input_handler *input_handler_unix_init (char *res)
+struct input_handler *input_handler_unix_init (char *res, struct options *opts)
 {
 	int fd;
 
+	/* The process we upgrade from may hand it over */
+	if ((fd = upgrade_socket("unix", res)) != -1)
+		return input_handler_common_init("unix", res, fd);
+
 	fd = connect_to_named_socket(res);
 	if (fd == -1)
 	{
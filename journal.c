@@ -0,0 +1,1446 @@
+#include "defines.h"
+#include "journal.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "message.h"
+#include "log.h"
+
+#define JOURNAL_HEADER_SIZE	8
+
+/* Anything bigger is taken as a corrupt length */
+#define JOURNAL_MAX_RECORD	(64 * 1024 * 1024)
+
+/* Digits of the segment number in its file name */
+#define JOURNAL_DIGITS		10
+
+/* CRC32C (Castagnoli), reflected */
+#define JOURNAL_CRC_POLY	0x82F63B78
+
+/* Seconds between checks of free space and ages, and between retries of a failed write */
+#define JOURNAL_IO_PERIOD	1
+
+/* Positions hold the segment number in the high half, the offset in the low one */
+#define JOURNAL_POSITION(seg, off)	(((long long) (seg) << 32) | (long long) (off))
+#define JOURNAL_SEGMENT(pos)		((unsigned int) ((pos) >> 32))
+#define JOURNAL_OFFSET(pos)		((off_t) ((pos) & 0xFFFFFFFFLL))
+
+static unsigned int journal_crc_table[256];
+static pthread_once_t journal_crc_once = PTHREAD_ONCE_INIT;
+
+/* A segment that's no longer written to */
+struct journal_segment {
+	struct journal_segment *next;
+	unsigned int seg;
+	long long    bytes;
+	time_t       written;
+};
+
+/* Records on their way to disk, all for the same segment */
+struct journal_chunk {
+	struct journal_chunk *next;
+	unsigned int seg;
+	off_t  off;
+	char  *data;
+	int    len;
+};
+
+/* A record read ahead, with the position just past it. It's handed out
+ * as a message, marked as replayed */
+struct journal_record {
+	struct journal_record *next;
+	unsigned int seg;
+	off_t  end;
+	int    len;
+	char  *data;
+	struct message msg;
+};
+
+/* All disk access happens on the journal's own I/O thread. Appending,
+ * peeking and consuming only touch memory, they wait for the thread
+ * only when the read ahead didn't keep up. */
+struct journal {
+	char *path;
+	char *dir;
+	struct journal_config config;
+
+	/* Guards everything but what's marked as the I/O thread's own */
+	pthread_mutex_t lock;
+	pthread_cond_t  work;		/* Something for the I/O thread */
+	pthread_cond_t  done;		/* The I/O thread got something done */
+	pthread_t       thread;
+	int             stopping;
+	int             failed;		/* The last write failed, it's retried */
+
+	/* Segments first up to write_seg, the ones before it are closed */
+	unsigned int first;
+	unsigned int write_seg;
+	off_t        wsize;		/* Bytes appended to the write segment */
+	time_t       wtime;		/* Last append */
+	struct journal_segment *closed, *closed_tail;
+
+	/* Limits are checked against these */
+	long long size;			/* Bytes of all segments, written or not */
+	long long unwritten;
+	long long disk_free;
+	long long dropped;
+
+	/* Appended records are collected, and handed to the I/O thread on commit */
+	char *wbuf;
+	int   wlen;
+	int   wmax;
+	struct journal_chunk *chunks, *chunks_tail;
+
+	/* Everything before this is on disk */
+	unsigned int done_seg;
+	off_t        done_off;
+
+	/* Records read ahead, reading goes on at read_seg, roff */
+	unsigned int read_seg;
+	off_t        roff;
+	struct journal_record *ready, *ready_tail;
+	long         ready_bytes;
+	int          peeked;		/* Leading ready records handed out */
+	int          writeonly;		/* Nobody reads anymore */
+
+	/* Just past the last consumed record, trimming and the index go up to it */
+	unsigned int cseg;
+	off_t        coff;
+	int          trim;
+
+	/* The I/O thread's own */
+	unsigned int disk_first;	/* Oldest segment that may be on disk */
+	time_t checked;
+	int    wfd;
+	unsigned int wfd_seg;
+	int    unsynced;
+	struct timeval synced;
+	int    rfd;
+	char  *rbuf;
+	int    rmax;
+};
+
+static void journal_crc_init ()
+{
+	unsigned int c;
+	int i, k;
+
+	for (i = 0; i < 256; i++)
+	{
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ JOURNAL_CRC_POLY : c >> 1;
+		journal_crc_table[i] = c;
+	}
+}
+
+static unsigned int journal_crc (const char *data, int len)
+{
+	const unsigned char *p = (const unsigned char*) data;
+	unsigned int c = 0xFFFFFFFF;
+
+	while (len-- > 0)
+		c = journal_crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+
+	return ~c;
+}
+
+static void journal_name (struct journal *this, unsigned int seg, char *name, int size)
+{
+	snprintf(name, size, "%s.%0*u", this->path, JOURNAL_DIGITS, seg);
+}
+
+static int journal_before (unsigned int seg1, off_t off1, unsigned int seg2, off_t off2)
+{
+	return seg1 < seg2 || (seg1 == seg2 && off1 < off2);
+}
+
+static int journal_consumed (struct journal *this, struct journal_segment *segment)
+{
+	return segment->seg < this->cseg || (segment->seg == this->cseg && this->coff >= segment->bytes);
+}
+
+/* Everything from here up to the I/O thread is called with the lock held */
+
+static void journal_handoff (struct journal *this)
+{
+	struct journal_chunk *chunk;
+
+	if (this->wlen == 0)
+		return;
+
+	chunk = (struct journal_chunk*) malloc (sizeof(struct journal_chunk));
+	SysFatal(chunk == NULL, errno, "While queueing journal write");
+
+	chunk->next = NULL;
+	chunk->seg  = this->write_seg;
+	chunk->off  = this->wsize - this->wlen;
+	chunk->data = this->wbuf;
+	chunk->len  = this->wlen;
+
+	if (this->chunks_tail != NULL)
+		this->chunks_tail->next = chunk;
+	else
+		this->chunks = chunk;
+	this->chunks_tail = chunk;
+
+	/* The buffer went along, a new one comes with the next append */
+	this->wbuf = NULL;
+	this->wlen = 0;
+	this->wmax = 0;
+
+	pthread_cond_signal(&this->work);
+}
+
+static void journal_roll (struct journal *this)
+{
+	struct journal_segment *segment;
+
+	journal_handoff(this);
+
+	segment = (struct journal_segment*) malloc (sizeof(struct journal_segment));
+	SysFatal(segment == NULL, errno, "While closing journal segment");
+
+	segment->next    = NULL;
+	segment->seg     = this->write_seg;
+	segment->bytes   = this->wsize;
+	segment->written = this->wtime;
+
+	if (this->closed_tail != NULL)
+		this->closed_tail->next = segment;
+	else
+		this->closed = segment;
+	this->closed_tail = segment;
+
+	this->write_seg++;
+	this->wsize = 0;
+}
+
+static void journal_forget (struct journal *this)
+{
+	struct journal_segment *segment = this->closed;
+	struct journal_record *record, *prev;
+	long long lost;
+	int i;
+
+	/* The file goes on the I/O thread */
+	this->closed = segment->next;
+	if (this->closed == NULL)
+		this->closed_tail = NULL;
+
+	/* So do its records that were read ahead, all but the ones peek handed out */
+	lost = 0;
+	for (prev = this->ready, i = 1; prev != NULL && i < this->peeked; i++)
+		prev = prev->next;
+	if (prev != NULL)
+	{
+		while ((record = prev->next) != NULL && record->seg <= segment->seg)
+		{
+			prev->next = record->next;
+			this->ready_bytes -= record->len;
+			free(record);
+			lost++;
+		}
+		if (prev->next == NULL)
+			this->ready_tail = prev;
+	}
+
+	if (lost > 0)
+	{
+		this->dropped += lost;
+		CustomLog(__FILE__, __LINE__, warning, "Dropped %lld messages read ahead from journal segment %u", lost, segment->seg);
+	}
+
+	this->size -= segment->bytes;
+	this->first = segment->seg + 1;
+	free(segment);
+
+	pthread_cond_signal(&this->work);
+}
+
+static int journal_drop_segment (struct journal *this)
+{
+	/* The segment being written goes as a whole */
+	if (this->closed == NULL)
+	{
+		if (this->wsize == 0)
+			return FALSE;
+		journal_roll(this);
+	}
+
+	/* The I/O thread counts what's lost with it */
+	journal_forget(this);
+	return TRUE;
+}
+
+static int journal_room (struct journal *this, int len)
+{
+	if (this->config.max_size > 0 && this->size + len > this->config.max_size)
+		return FALSE;
+
+	if (this->config.min_free > 0 && this->disk_free - this->unwritten - len < this->config.min_free)
+		return FALSE;
+
+	return TRUE;
+}
+
+int journal_append (struct journal *this, const char *msg, int len)
+{
+	unsigned int header[2];
+
+	pthread_mutex_lock(&this->lock);
+
+	/* Make room within the limits, as the policy says */
+	while (! journal_room(this, JOURNAL_HEADER_SIZE + len))
+	{
+		if (this->config.policy == journal_drop_newest)
+		{
+			this->dropped++;
+			pthread_mutex_unlock(&this->lock);
+			return TRUE;
+		}
+
+		if (this->config.policy == journal_block)
+		{
+			pthread_mutex_unlock(&this->lock);
+			return FALSE;
+		}
+
+		/* Nothing left to drop, it's written anyway */
+		if (! journal_drop_segment(this))
+			break;
+	}
+
+	/* Records don't span segments */
+	if (this->wsize > 0 && this->wsize + JOURNAL_HEADER_SIZE + len > this->config.segment_size)
+		journal_roll(this);
+
+	if (this->wlen + JOURNAL_HEADER_SIZE + len > this->wmax)
+	{
+		this->wmax = MAX(MAX(this->wmax * 2, this->config.read_ahead), this->wlen + JOURNAL_HEADER_SIZE + len);
+		this->wbuf = (char*) realloc (this->wbuf, this->wmax);
+		SysFatal(this->wbuf == NULL, errno, "While growing journal write buffer");
+	}
+
+	header[0] = htonl(len);
+	header[1] = htonl(journal_crc(msg, len));
+	memcpy(this->wbuf + this->wlen, header, JOURNAL_HEADER_SIZE);
+	memcpy(this->wbuf + this->wlen + JOURNAL_HEADER_SIZE, msg, len);
+
+	this->wlen      += JOURNAL_HEADER_SIZE + len;
+	this->wsize     += JOURNAL_HEADER_SIZE + len;
+	this->size      += JOURNAL_HEADER_SIZE + len;
+	this->unwritten += JOURNAL_HEADER_SIZE + len;
+	this->wtime      = time(NULL);
+
+	/* Don't let the buffer grow without bounds while things go well */
+	if (this->wlen >= this->config.read_ahead)
+		journal_handoff(this);
+
+	pthread_mutex_unlock(&this->lock);
+	return TRUE;
+}
+
+int journal_commit (struct journal *this)
+{
+	int retval;
+
+	pthread_mutex_lock(&this->lock);
+	journal_handoff(this);
+	retval = ! this->failed;
+	pthread_mutex_unlock(&this->lock);
+
+	return retval;
+}
+
+char *journal_peek (struct journal *this)
+{
+	char *retval = NULL;
+
+	pthread_mutex_lock(&this->lock);
+
+	/* There's more than was read ahead, wait for the I/O thread to bring it in */
+	while (this->ready == NULL && ! this->failed && ! this->writeonly && journal_before(this->read_seg, this->roff, this->write_seg, this->wsize))
+	{
+		journal_handoff(this);
+		pthread_cond_signal(&this->work);
+		pthread_cond_wait(&this->done, &this->lock);
+	}
+
+	if (this->ready != NULL)
+	{
+		retval = this->ready->data;
+		this->peeked = MAX(this->peeked, 1);
+	}
+
+	pthread_mutex_unlock(&this->lock);
+	return retval;
+}
+
+int journal_peek_batch (struct journal *this, char **msgs, int *lens, int max)
+{
+	struct journal_record *record;
+	int count;
+
+	/* The first one as peek has it, the rest only if it's read ahead already */
+	if (journal_peek(this) == NULL)
+		return 0;
+
+	pthread_mutex_lock(&this->lock);
+	for (record = this->ready, count = 0; record != NULL && count < max; record = record->next, count++)
+	{
+		msgs[count] = record->data;
+		lens[count] = record->len;
+	}
+	this->peeked = MAX(this->peeked, count);
+	pthread_mutex_unlock(&this->lock);
+
+	return count;
+}
+
+static struct journal_record *journal_take (struct journal *this)
+{
+	struct journal_record *record;
+
+	/* Called with the lock held, for the record peek handed out */
+	record = this->ready;
+	Require(record != NULL);
+
+	this->ready = record->next;
+	if (this->ready == NULL)
+		this->ready_tail = NULL;
+	this->ready_bytes -= record->len;
+	if (this->peeked > 0)
+		this->peeked--;
+
+	/* Keep the read ahead going */
+	if (this->ready_bytes < this->config.read_ahead / 2)
+		pthread_cond_signal(&this->work);
+
+	return record;
+}
+
+void journal_consume (struct journal *this)
+{
+	journal_consume_batch(this, 1);
+}
+
+void journal_consume_batch (struct journal *this, int count)
+{
+	struct journal_record *record;
+
+	pthread_mutex_lock(&this->lock);
+	while (count-- > 0)
+	{
+		record = journal_take(this);
+
+		/* Records of dropped segments may still come by, they don't move it back */
+		if (journal_before(this->cseg, this->coff, record->seg, record->end))
+		{
+			this->cseg = record->seg;
+			this->coff = record->end;
+		}
+
+		free(record);
+	}
+	pthread_mutex_unlock(&this->lock);
+}
+
+long long journal_advance (struct journal *this)
+{
+	struct journal_record *record;
+	long long retval;
+
+	/* Like consume, but it's only released later on */
+	pthread_mutex_lock(&this->lock);
+	record = journal_take(this);
+	retval = JOURNAL_POSITION(record->seg, record->end);
+	pthread_mutex_unlock(&this->lock);
+
+	free(record);
+	return retval;
+}
+
+void journal_release (struct journal *this, long long pos)
+{
+	pthread_mutex_lock(&this->lock);
+	if (journal_before(this->cseg, this->coff, JOURNAL_SEGMENT(pos), JOURNAL_OFFSET(pos)))
+	{
+		this->cseg = JOURNAL_SEGMENT(pos);
+		this->coff = JOURNAL_OFFSET(pos);
+	}
+	pthread_mutex_unlock(&this->lock);
+}
+
+long long journal_written (struct journal *this)
+{
+	long long retval;
+
+	pthread_mutex_lock(&this->lock);
+	retval = JOURNAL_POSITION(this->write_seg, this->wsize);
+	pthread_mutex_unlock(&this->lock);
+
+	return retval;
+}
+
+int journal_flush (struct journal *this)
+{
+	unsigned int seg;
+	off_t off;
+	int retval;
+
+	pthread_mutex_lock(&this->lock);
+	journal_handoff(this);
+
+	/* Wait for all of it to be written, and synced if that's the policy */
+	seg = this->write_seg;
+	off = this->wsize;
+	while (! this->failed && (this->chunks != NULL || journal_before(this->done_seg, this->done_off, seg, off)) && this->first <= seg)
+		pthread_cond_wait(&this->done, &this->lock);
+
+	retval = ! this->failed;
+	pthread_mutex_unlock(&this->lock);
+
+	return retval;
+}
+
+void journal_stop_reading (struct journal *this)
+{
+	struct journal_record *record;
+
+	/* What's appended from now on is only written */
+	pthread_mutex_lock(&this->lock);
+	this->writeonly = TRUE;
+	while ((record = this->ready) != NULL)
+	{
+		this->ready = record->next;
+		free(record);
+	}
+	this->ready_tail  = NULL;
+	this->ready_bytes = 0;
+	this->peeked      = 0;
+	pthread_mutex_unlock(&this->lock);
+}
+
+int journal_pending (struct journal *this)
+{
+	int retval;
+
+	/* Segments that were consumed completely, but are still on disk */
+	pthread_mutex_lock(&this->lock);
+	retval = this->closed != NULL && journal_consumed(this, this->closed);
+	pthread_mutex_unlock(&this->lock);
+
+	return retval;
+}
+
+int journal_empty (struct journal *this)
+{
+	int retval;
+
+	pthread_mutex_lock(&this->lock);
+	retval = this->ready == NULL && (this->writeonly || ! journal_before(this->read_seg, this->roff, this->write_seg, this->wsize));
+	pthread_mutex_unlock(&this->lock);
+
+	return retval;
+}
+
+void journal_trim (struct journal *this)
+{
+	pthread_mutex_lock(&this->lock);
+
+	/* Segments up to the last consumed record went out completely */
+	while (this->closed != NULL && journal_consumed(this, this->closed))
+		journal_forget(this);
+
+	/* The rest, and saving the index, is up to the I/O thread */
+	this->trim = TRUE;
+	pthread_cond_signal(&this->work);
+
+	pthread_mutex_unlock(&this->lock);
+}
+
+int journal_full (struct journal *this)
+{
+	int retval;
+
+	pthread_mutex_lock(&this->lock);
+	retval = this->config.policy == journal_block && ! journal_room(this, JOURNAL_HEADER_SIZE);
+	pthread_mutex_unlock(&this->lock);
+
+	return retval;
+}
+
+int journal_describe (struct journal *this, char *buf, int size)
+{
+	int len;
+
+	pthread_mutex_lock(&this->lock);
+	len = snprintf(buf, size, "backlog-bytes=%lld dropped=%lld", this->size, this->dropped);
+	pthread_mutex_unlock(&this->lock);
+
+	return len;
+}
+
+/* The I/O thread and its helpers, they run without the lock unless noted */
+
+static void journal_sync (struct journal *this, int force)
+{
+	struct timeval now;
+
+	if (! this->unsynced || this->wfd == -1)
+		return;
+
+	switch (this->config.sync)
+	{
+		case journal_sync_none:
+			return;
+
+		case journal_sync_interval:
+			gettimeofday(&now, NULL);
+			if (! force && (now.tv_sec - this->synced.tv_sec) * 1000 + (now.tv_usec - this->synced.tv_usec) / 1000 < this->config.sync_interval)
+				return;
+			break;
+
+		case journal_sync_commit:
+			break;
+	}
+
+	if (fdatasync(this->wfd) == -1)
+		SysErr(errno, "While syncing journal segment");
+
+	this->unsynced = FALSE;
+	gettimeofday(&this->synced, NULL);
+}
+
+static int journal_write_chunk (struct journal *this, struct journal_chunk *chunk)
+{
+	char name[PATH_MAX];
+	int dirfd, written;
+	ssize_t n;
+
+	/* On to the next segment, the previous one is complete */
+	if (this->wfd != -1 && this->wfd_seg != chunk->seg)
+	{
+		journal_sync(this, TRUE);
+		close(this->wfd);
+		this->wfd = -1;
+	}
+
+	if (this->wfd == -1)
+	{
+		journal_name(this, chunk->seg, name, sizeof(name));
+		if ((this->wfd = open(name, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)) == -1)
+		{
+			SysErr(errno, "While creating journal segment");
+			return FALSE;
+		}
+		this->wfd_seg = chunk->seg;
+
+		/* When syncing, a new segment should survive a crash as well */
+		if (chunk->off == 0 && this->config.sync != journal_sync_none && (dirfd = open(this->dir, O_RDONLY|O_DIRECTORY)) != -1)
+		{
+			if (fsync(dirfd) == -1)
+				SysErr(errno, "While syncing journal directory");
+			close(dirfd);
+		}
+	}
+
+	written = 0;
+	while (written < chunk->len)
+	{
+		n = pwrite(this->wfd, chunk->data + written, chunk->len - written, chunk->off + written);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			SysErr(errno, "While writing journal segment");
+
+			/* No half records on disk, the chunk is tried again later */
+			if (ftruncate(this->wfd, chunk->off) == -1)
+				SysErr(errno, "While cutting off a partial journal write");
+			return FALSE;
+		}
+		written += n;
+	}
+
+	this->unsynced = TRUE;
+	journal_sync(this, FALSE);
+	return TRUE;
+}
+
+static long long journal_count_records (const char *data, long len)
+{
+	unsigned int header[2];
+	long long count = 0;
+	long pos = 0;
+
+	while (pos + JOURNAL_HEADER_SIZE <= len)
+	{
+		memcpy(header, data + pos, JOURNAL_HEADER_SIZE);
+		pos += JOURNAL_HEADER_SIZE + ntohl(header[0]);
+		if (pos > len)
+			break;
+		count++;
+	}
+
+	return count;
+}
+
+static long long journal_count (struct journal *this, unsigned int seg, off_t off)
+{
+	char name[PATH_MAX], *buf;
+	unsigned int header[2], len;
+	long long count;
+	struct stat st;
+	off_t base;
+	ssize_t n;
+	int fd, pos;
+
+	/* Walk the headers of a segment, to know how many messages it held */
+	journal_name(this, seg, name, sizeof(name));
+	if ((fd = open(name, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+	{
+		if (fd != -1)
+			close(fd);
+		return 0;
+	}
+
+	buf = (char*) malloc (this->config.read_ahead);
+	SysFatal(buf == NULL, errno, "While counting journal records");
+
+	count = 0;
+	base  = off;
+	pos   = 0;
+	n     = 0;
+	while (TRUE)
+	{
+		/* Read on from the next header */
+		if (pos + JOURNAL_HEADER_SIZE > n)
+		{
+			base += pos;
+			pos   = 0;
+			if ((n = pread(fd, buf, this->config.read_ahead, base)) < JOURNAL_HEADER_SIZE)
+				break;
+		}
+
+		memcpy(header, buf + pos, JOURNAL_HEADER_SIZE);
+		len = ntohl(header[0]);
+		if (len > JOURNAL_MAX_RECORD || base + pos + JOURNAL_HEADER_SIZE + len > st.st_size)
+			break;
+
+		count++;
+		pos += JOURNAL_HEADER_SIZE + len;
+	}
+
+	free(buf);
+	close(fd);
+	return count;
+}
+
+static long long journal_unlink (struct journal *this, unsigned int seg)
+{
+	char name[PATH_MAX];
+	long long lost = 0;
+
+	/* What wasn't read yet is lost with it, the rest was or will be delivered */
+	if (seg >= this->read_seg)
+		lost = journal_count(this, seg, (seg == this->read_seg ? this->roff : 0));
+
+	if (this->rfd != -1 && seg == this->read_seg)
+	{
+		close(this->rfd);
+		this->rfd = -1;
+	}
+
+	if (this->wfd != -1 && seg == this->wfd_seg)
+	{
+		close(this->wfd);
+		this->wfd = -1;
+	}
+
+	journal_name(this, seg, name, sizeof(name));
+	if (unlink(name) == -1 && errno != ENOENT)
+		SysErr(errno, "While removing journal segment");
+
+	if (lost > 0)
+		CustomLog(__FILE__, __LINE__, warning, "Dropped %lld messages with journal segment %s", lost, name);
+
+	return lost;
+}
+
+static void journal_save_index (struct journal *this, unsigned int seg, off_t off, int none)
+{
+	char name[PATH_MAX], tmpname[PATH_MAX];
+	FILE *f;
+
+	snprintf(name, sizeof(name), "%s.index", this->path);
+	snprintf(tmpname, sizeof(tmpname), "%s.index.tmp", this->path);
+
+	/* No segments, nothing to point at */
+	if (none)
+	{
+		unlink(name);
+		return;
+	}
+
+	/* Replace it as a whole, a crash leaves the old or the new one */
+	if ((f = fopen(tmpname, "w")) == NULL)
+	{
+		SysErr(errno, "While writing journal index");
+		return;
+	}
+
+	fprintf(f, "%u %lld\n", seg, (long long) off);
+	if (fclose(f) != 0 || rename(tmpname, name) == -1)
+	{
+		SysErr(errno, "While writing journal index");
+		unlink(tmpname);
+	}
+}
+
+static void journal_start_over (struct journal *this)
+{
+	char name[PATH_MAX];
+
+	/* Called with the lock held, everything went out so the write segment can go as well */
+	if (this->rfd != -1)
+		close(this->rfd);
+	if (this->wfd != -1)
+	{
+		journal_sync(this, TRUE);
+		close(this->wfd);
+	}
+	this->rfd = -1;
+	this->wfd = -1;
+
+	journal_name(this, this->write_seg, name, sizeof(name));
+	if (unlink(name) == -1 && errno != ENOENT)
+		SysErr(errno, "While removing journal segment");
+
+	this->size -= this->wsize;
+	this->write_seg++;
+	this->wsize = 0;
+	this->first = this->disk_first = this->read_seg = this->done_seg = this->cseg = this->write_seg;
+	this->roff  = this->done_off = this->coff = 0;
+}
+
+static void journal_read_ahead (struct journal *this, unsigned int done_seg, off_t done_off)
+{
+	struct journal_record *records = NULL, *last = NULL, *record;
+	char name[PATH_MAX];
+	unsigned int header[2], len;
+	int pos, want, atend, skip, torn;
+	off_t limit, off;
+	struct stat st;
+	long bytes;
+	ssize_t n;
+
+	journal_name(this, this->read_seg, name, sizeof(name));
+	off   = this->roff;
+	pos   = 0;
+	bytes = 0;
+	skip  = FALSE;
+	torn  = FALSE;
+
+	if (this->rfd == -1 && (this->rfd = open(name, O_RDONLY)) == -1)
+	{
+		if (errno != ENOENT)
+			SysErr(errno, "While opening journal segment");
+		skip = TRUE;
+	}
+	else
+	{
+		/* Up to where writing got, segments before that are complete */
+		limit = done_off;
+		if (this->read_seg < done_seg)
+			limit = (fstat(this->rfd, &st) == 0 ? st.st_size : off);
+
+		want = MIN(this->rmax, limit - off);
+		n    = (want > 0 ? pread(this->rfd, this->rbuf, want, off) : 0);
+		if (n == -1)
+		{
+			SysErr(errno, "While reading journal segment");
+			n = 0;
+		}
+		atend = (n < want || n == limit - off);
+
+		while (pos + JOURNAL_HEADER_SIZE <= n)
+		{
+			memcpy(header, this->rbuf + pos, JOURNAL_HEADER_SIZE);
+			len = ntohl(header[0]);
+			if (len > JOURNAL_MAX_RECORD)
+			{
+				torn = TRUE;
+				break;
+			}
+
+			/* Not completely in the buffer, it may need a bigger one */
+			if (pos + JOURNAL_HEADER_SIZE + len > n)
+			{
+				if (atend)
+					torn = TRUE;
+				else if (pos == 0)
+				{
+					this->rmax = JOURNAL_HEADER_SIZE + len;
+					this->rbuf = (char*) realloc (this->rbuf, this->rmax);
+					SysFatal(this->rbuf == NULL, errno, "While growing journal read buffer");
+				}
+				break;
+			}
+
+			if (journal_crc(this->rbuf + pos + JOURNAL_HEADER_SIZE, len) != ntohl(header[1]))
+			{
+				torn = TRUE;
+				break;
+			}
+
+			record = (struct journal_record*) malloc (sizeof(struct journal_record) + len + 1);
+			SysFatal(record == NULL, errno, "While reading ahead in the journal");
+
+			record->next = NULL;
+			record->seg  = this->read_seg;
+			record->end  = off + pos + JOURNAL_HEADER_SIZE + len;
+			record->len  = len;
+			record->data = message_replay(&record->msg, JOURNAL_POSITION(record->seg, record->end));
+			memcpy(record->data, this->rbuf + pos + JOURNAL_HEADER_SIZE, len);
+			record->data[len] = '\0';
+
+			if (last != NULL)
+				last->next = record;
+			else
+				records = record;
+			last   = record;
+			bytes += len;
+			pos   += JOURNAL_HEADER_SIZE + len;
+		}
+
+		/* A partial header at the very end */
+		if (atend && ! torn && pos < n)
+			torn = TRUE;
+
+		/* Torn by a crash, or damaged otherwise, the rest of the segment can't be trusted */
+		if (torn)
+			CustomLog(__FILE__, __LINE__, error, "Torn or corrupt record in %s at offset %lld, skipping the rest of it", name, (long long) (off + pos));
+
+		/* Complete segments are left at their end, the one being written waits for more */
+		if (this->read_seg < done_seg && (torn || (atend && pos == n)))
+			skip = TRUE;
+		else if (torn)
+			pos = limit - off;
+	}
+
+	pthread_mutex_lock(&this->lock);
+
+	if (records != NULL)
+	{
+		if (this->ready_tail != NULL)
+			this->ready_tail->next = records;
+		else
+			this->ready = records;
+		this->ready_tail   = last;
+		this->ready_bytes += bytes;
+	}
+
+	if (skip)
+	{
+		if (this->rfd != -1)
+			close(this->rfd);
+		this->rfd = -1;
+		this->read_seg++;
+		this->roff = 0;
+	}
+	else
+		this->roff = off + pos;
+
+	pthread_cond_broadcast(&this->done);
+	pthread_mutex_unlock(&this->lock);
+}
+
+static void journal_refresh (struct journal *this)
+{
+	struct statvfs st;
+	long long disk_free;
+	time_t now;
+
+	/* Called with the lock held, it's let go for the disk */
+	now = time(NULL);
+	if (now - this->checked < JOURNAL_IO_PERIOD)
+		return;
+	this->checked = now;
+
+	if (this->config.min_free > 0)
+	{
+		pthread_mutex_unlock(&this->lock);
+		disk_free = -1;
+		if (statvfs(this->dir, &st) == -1)
+			SysErr(errno, "While checking free space for the journal");
+		else
+			disk_free = (long long) st.f_bavail * st.f_frsize;
+		pthread_mutex_lock(&this->lock);
+
+		if (disk_free >= 0)
+			this->disk_free = disk_free;
+	}
+
+	/* Segments past their age go, regardless of the policy */
+	while (this->config.max_age > 0)
+	{
+		if (this->closed != NULL ? this->closed->written + this->config.max_age > now : (this->wsize == 0 || this->wtime + this->config.max_age > now))
+			break;
+		journal_drop_segment(this);
+	}
+}
+
+static void *journal_run (void *arg)
+{
+	struct journal *this = (struct journal*) arg;
+	struct journal_chunk *chunk;
+	struct timespec until;
+	unsigned int seg;
+	long long lost;
+	off_t off;
+	int ok, none;
+
+	pthread_mutex_lock(&this->lock);
+	while (TRUE)
+	{
+		/* Writes go first, reading only gets as far as they did */
+		if ((chunk = this->chunks) != NULL)
+		{
+			/* Its segment was dropped before it got written */
+			if (chunk->seg < this->first)
+			{
+				lost = journal_count_records(chunk->data, chunk->len);
+				this->dropped += lost;
+				ok = TRUE;
+				CustomLog(__FILE__, __LINE__, warning, "Dropped %lld messages of journal segment %u before they were written", lost, chunk->seg);
+			}
+			else
+			{
+				pthread_mutex_unlock(&this->lock);
+				ok = journal_write_chunk(this, chunk);
+				pthread_mutex_lock(&this->lock);
+			}
+
+			/* Giving up on it, there's no later */
+			if (! ok && this->stopping)
+			{
+				CustomLog(__FILE__, __LINE__, error, "Lost %d bytes of journal that couldn't be written", chunk->len);
+				ok = TRUE;
+			}
+
+			if (ok)
+			{
+				this->chunks = chunk->next;
+				if (this->chunks == NULL)
+					this->chunks_tail = NULL;
+				this->unwritten -= chunk->len;
+				this->done_seg   = chunk->seg;
+				this->done_off   = chunk->off + chunk->len;
+				this->failed     = FALSE;
+				free(chunk->data);
+				free(chunk);
+
+				/* Someone may be waiting for it to be written */
+				pthread_cond_broadcast(&this->done);
+			}
+			else
+			{
+				/* Let waiting readers know, and try again in a while */
+				this->failed = TRUE;
+				pthread_cond_broadcast(&this->done);
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_sec += JOURNAL_IO_PERIOD;
+				pthread_cond_timedwait(&this->work, &this->lock, &until);
+			}
+			continue;
+		}
+
+		/* Files of trimmed or dropped segments */
+		if (this->disk_first < this->first)
+		{
+			seg = this->disk_first;
+			pthread_mutex_unlock(&this->lock);
+			lost = journal_unlink(this, seg);
+			pthread_mutex_lock(&this->lock);
+
+			this->dropped   += lost;
+			this->disk_first = seg + 1;
+			if (this->read_seg <= seg)
+			{
+				this->read_seg = seg + 1;
+				this->roff     = 0;
+			}
+			pthread_cond_broadcast(&this->done);
+			continue;
+		}
+
+		/* Remember how far delivery got, everything went out means starting over */
+		if (this->trim)
+		{
+			this->trim = FALSE;
+			if (this->ready == NULL && this->wlen == 0 && this->wsize > 0 && this->cseg == this->write_seg && this->coff == this->wsize)
+				journal_start_over(this);
+
+			seg  = this->cseg;
+			off  = this->coff;
+			none = (this->first == this->write_seg && this->wsize == 0);
+			if (journal_before(seg, off, this->first, 0))
+			{
+				seg = this->first;
+				off = 0;
+			}
+
+			pthread_mutex_unlock(&this->lock);
+			journal_save_index(this, seg, off, none);
+			pthread_mutex_lock(&this->lock);
+			continue;
+		}
+
+		/* What's left of the journal stays for the next run */
+		if (this->stopping)
+			break;
+
+		journal_refresh(this);
+
+		/* A sync on the interval may be due by now, without a write to go with it */
+		if (this->unsynced)
+		{
+			pthread_mutex_unlock(&this->lock);
+			journal_sync(this, FALSE);
+			pthread_mutex_lock(&this->lock);
+		}
+
+		/* Keep ahead of whoever reads */
+		if (! this->writeonly && this->ready_bytes < this->config.read_ahead && this->read_seg >= this->first && journal_before(this->read_seg, this->roff, this->done_seg, this->done_off))
+		{
+			seg = this->done_seg;
+			off = this->done_off;
+			pthread_mutex_unlock(&this->lock);
+			journal_read_ahead(this, seg, off);
+			pthread_mutex_lock(&this->lock);
+			continue;
+		}
+
+		/* Anything that came in while the lock was let go above */
+		if (this->chunks != NULL || this->disk_first < this->first || this->trim)
+			continue;
+
+		pthread_cond_broadcast(&this->done);
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += JOURNAL_IO_PERIOD;
+		pthread_cond_timedwait(&this->work, &this->lock, &until);
+	}
+	pthread_mutex_unlock(&this->lock);
+
+	journal_sync(this, TRUE);
+	return NULL;
+}
+
+static int journal_scan (struct journal *this, unsigned int *min, unsigned int *max)
+{
+	char *dirname, *base, *end;
+	struct dirent *entry;
+	unsigned long seg;
+	int len, count;
+	DIR *dir;
+
+	/* Segments live next to the path they're named after */
+	base = strrchr(this->path, '/');
+	if (base == NULL)
+	{
+		dirname = strdup(".");
+		base    = this->path;
+	}
+	else
+	{
+		dirname = (base == this->path ? strdup("/") : strndup(this->path, base - this->path));
+		base++;
+	}
+	SysFatal(dirname == NULL, errno, "While looking for journal segments");
+
+	if ((dir = opendir(dirname)) == NULL)
+	{
+		SysErr(errno, "While looking for journal segments");
+		this->dir = dirname;
+		return 0;
+	}
+
+	len   = strlen(base);
+	count = 0;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (strncmp(entry->d_name, base, len) != 0 || entry->d_name[len] != '.' || strlen(entry->d_name + len + 1) != JOURNAL_DIGITS)
+			continue;
+
+		seg = strtoul(entry->d_name + len + 1, &end, 10);
+		if (*end != '\0' || seg == 0 || seg >= UINT_MAX)
+			continue;
+
+		if (count == 0 || seg < *min)
+			*min = seg;
+		if (count == 0 || seg > *max)
+			*max = seg;
+		count++;
+	}
+
+	closedir(dir);
+	this->dir = dirname;
+	return count;
+}
+
+static void journal_import (struct journal *this)
+{
+	char *line = NULL;
+	size_t size = 0;
+	struct stat st;
+	ssize_t len;
+	int count, ok;
+	FILE *f;
+
+	/* A backlog from before journals were segmented, one message per line */
+	if (stat(this->path, &st) == -1 || ! S_ISREG(st.st_mode))
+		return;
+
+	if ((f = fopen(this->path, "r")) == NULL)
+	{
+		SysErr(errno, "While opening old backlog file");
+		return;
+	}
+
+	ok    = TRUE;
+	count = 0;
+	while (ok && (len = getline(&line, &size, f)) > 0)
+	{
+		ok = journal_append(this, line, len);
+		count++;
+	}
+
+	free(line);
+	fclose(f);
+
+	if (ok && journal_commit(this))
+	{
+		unlink(this->path);
+		CustomLog(__FILE__, __LINE__, warning, "Moved %d messages from the old backlog %s into the journal", count, this->path);
+	}
+	else
+		CustomLog(__FILE__, __LINE__, error, "Couldn't move the old backlog %s into the journal, leaving it", this->path);
+}
+
+void journal_close (struct journal *this)
+{
+	struct journal_segment *segment;
+	struct journal_record *record;
+	long long lost;
+
+	if (this == NULL)
+		return;
+
+	/* The I/O thread writes out what's left before it goes */
+	pthread_mutex_lock(&this->lock);
+	journal_handoff(this);
+	this->stopping = TRUE;
+	pthread_cond_signal(&this->work);
+	pthread_mutex_unlock(&this->lock);
+
+	pthread_join(this->thread, NULL);
+
+	/* The index was saved on the last trim, anything read since wasn't confirmed */
+
+	if (this->rfd != -1)
+		close(this->rfd);
+	if (this->wfd != -1)
+		close(this->wfd);
+
+	while ((segment = this->closed) != NULL)
+	{
+		this->closed = segment->next;
+		free(segment);
+	}
+
+	/* Read ahead records are read again next time, unless their segment is gone */
+	lost = 0;
+	while ((record = this->ready) != NULL)
+	{
+		if (record->seg < this->first)
+			lost++;
+		this->ready = record->next;
+		free(record);
+	}
+	if (lost > 0)
+		CustomLog(__FILE__, __LINE__, warning, "Dropped %lld messages of journal segments removed while they were read", lost);
+
+	pthread_cond_destroy(&this->done);
+	pthread_cond_destroy(&this->work);
+	pthread_mutex_destroy(&this->lock);
+
+	free(this->rbuf);
+	free(this->wbuf);
+	free(this->dir);
+	free(this->path);
+	free(this);
+}
+
+void journal_config_init (struct journal_config *config, struct options *opts)
+{
+	char *policy = options_get(opts, "backlog-policy", "drop-oldest");
+	char *sync;
+
+	if (strcasecmp(policy, "drop-oldest") == 0)
+		config->policy = journal_drop_oldest;
+	else if (strcasecmp(policy, "drop-newest") == 0)
+		config->policy = journal_drop_newest;
+	else if (strcasecmp(policy, "block") == 0)
+		config->policy = journal_block;
+	else
+	{
+		fprintf(stderr, "Unknown backlog policy: %s\n", policy);
+		exit(EXIT_FAILURE);
+	}
+
+	sync = options_get(opts, "backlog-sync", "none");
+	if (strcasecmp(sync, "none") == 0)
+		config->sync = journal_sync_none;
+	else if (strcasecmp(sync, "interval") == 0)
+		config->sync = journal_sync_interval;
+	else if (strcasecmp(sync, "commit") == 0)
+		config->sync = journal_sync_commit;
+	else
+	{
+		fprintf(stderr, "Unknown backlog sync: %s\n", sync);
+		exit(EXIT_FAILURE);
+	}
+
+	config->sync_interval = options_get_long(opts, "backlog-sync-interval", JOURNAL_SYNC_INTERVAL);
+	if (config->sync_interval < 0)
+	{
+		fprintf(stderr, "Invalid backlog-sync-interval\n");
+		exit(EXIT_FAILURE);
+	}
+
+	config->segment_size = options_get_long(opts, "segment-size", JOURNAL_SEGMENT_SIZE);
+	config->read_ahead   = options_get_long(opts, "read-ahead", JOURNAL_READ_AHEAD);
+	if (config->segment_size <= 0 || config->read_ahead <= 0)
+	{
+		fprintf(stderr, "Journal segment size and read ahead should be positive!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Offsets within a segment have to fit a position */
+	if (config->segment_size > JOURNAL_MAX_SEGMENT)
+	{
+		fprintf(stderr, "Journal segment size should be at most 1g!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	config->max_size = options_get_long(opts, "backlog-size", 0);
+	config->max_age  = options_get_long(opts, "backlog-age", 0);
+	config->min_free = options_get_long(opts, "backlog-min-free", 0);
+	if (config->max_size < 0 || config->max_age < 0 || config->min_free < 0)
+	{
+		fprintf(stderr, "Invalid backlog-size, backlog-age or backlog-min-free\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+struct journal *journal_open (char *path, struct journal_config *config)
+{
+	char name[PATH_MAX];
+	unsigned int min = 0, max = 0, seg;
+	struct journal_segment *segment;
+	struct statvfs sv;
+	struct stat st;
+	long long off;
+	struct journal *this;
+	FILE *f;
+
+	pthread_once(&journal_crc_once, journal_crc_init);
+
+	this = (struct journal*) calloc (1, sizeof(struct journal));
+	SysFatal(this == NULL, errno, "While creating journal");
+
+	this->path   = strdup(path);
+	this->config = *config;
+	this->wfd    = -1;
+	this->rfd    = -1;
+	this->rmax   = config->read_ahead;
+	this->rbuf   = (char*) malloc (this->rmax);
+	SysFatal(this->path == NULL || this->rbuf == NULL, errno, "While creating journal");
+
+	/* Pick up what earlier runs left, writing goes on in a fresh segment */
+	this->first = this->read_seg = this->write_seg = 1;
+	if (journal_scan(this, &min, &max) > 0)
+	{
+		this->first = this->read_seg = min;
+		this->write_seg = max + 1;
+		for (seg = min; seg <= max; seg++)
+		{
+			segment = (struct journal_segment*) calloc (1, sizeof(struct journal_segment));
+			SysFatal(segment == NULL, errno, "While creating journal");
+
+			segment->seg = seg;
+			journal_name(this, seg, name, sizeof(name));
+			if (stat(name, &st) == 0)
+			{
+				segment->bytes   = st.st_size;
+				segment->written = st.st_mtime;
+			}
+			this->size += segment->bytes;
+
+			if (this->closed_tail != NULL)
+				this->closed_tail->next = segment;
+			else
+				this->closed = segment;
+			this->closed_tail = segment;
+		}
+
+		/* The index tells how far reading got */
+		snprintf(name, sizeof(name), "%s.index", this->path);
+		if ((f = fopen(name, "r")) != NULL)
+		{
+			if (fscanf(f, "%u %lld", &seg, &off) == 2 && seg >= min && seg <= max && off >= 0)
+			{
+				this->read_seg = seg;
+				this->roff     = off;
+			}
+			fclose(f);
+		}
+
+		CustomLog(__FILE__, __LINE__, warning, "Resuming from journal %s, segments %u to %u", this->path, this->read_seg, max);
+	}
+
+	this->disk_first = this->first;
+	this->cseg       = this->read_seg;
+	this->coff       = this->roff;
+	this->done_seg   = this->write_seg;
+
+	/* Free space is known before the first append */
+	if (statvfs(this->dir, &sv) == 0)
+		this->disk_free = (long long) sv.f_bavail * sv.f_frsize;
+	this->checked = time(NULL);
+	gettimeofday(&this->synced, NULL);
+
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->work, NULL);
+	pthread_cond_init(&this->done, NULL);
+	SysFatal(pthread_create(&this->thread, NULL, journal_run, this), errno, "On journal thread start");
+
+	journal_import(this);
+	return this;
+}
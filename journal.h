@@ -0,0 +1,105 @@
+#ifndef GENCACHE_JOURNAL_H
+#define GENCACHE_JOURNAL_H
+
+#include <sys/types.h>
+
+#include "options.h"
+
+/** Segmented backlog journal
+ *
+ * Messages that can't be delivered are kept in segment files named
+ * <path>.<number>, each at most segment-size bytes. A record is a header
+ * of two 32 bit fields in network byte order, the payload length and the
+ * CRC32C of the payload, followed by the payload itself:
+ *
+ *   length  bytes of payload
+ *   crc     CRC32C of the payload
+ *
+ * Records are read oldest first, with large sequential reads, and are
+ * handed out straight from the read ahead, one or a batch at a time. They
+ * stay valid until they're consumed. A segment
+ * that was read completely is deleted once the destination confirmed it
+ * (journal_trim). The read cursor is kept in <path>.index, so a restart
+ * picks up where the last run left off. Writing always continues in a
+ * fresh segment, so a record torn by a crash is only ever at the end of
+ * a segment. It fails its length or checksum check and the rest of that
+ * segment is skipped.
+ *
+ * Each journal has an I/O thread that does all the writing, reading,
+ * syncing and deleting. Appended records are handed to it on commit, and
+ * it reads ahead up to read-ahead bytes of records in memory, so the
+ * calls below don't wait for the disk unless the read ahead fell behind.
+ */
+#define JOURNAL_SEGMENT_SIZE	(16 * 1024 * 1024)
+#define JOURNAL_MAX_SEGMENT	(1024 * 1024 * 1024)
+#define JOURNAL_READ_AHEAD	(1024 * 1024)
+#define JOURNAL_SYNC_INTERVAL	1000
+
+/** What happens once the journal hits one of its limits
+ *
+ * Segments older than the maximum age are always dropped. Dropped
+ * messages are counted, and reported with the destination's stats.
+ */
+enum journal_policy {
+	journal_drop_oldest,	/* Oldest segments go, the new messages are kept */
+	journal_drop_newest,	/* New messages are thrown away */
+	journal_block		/* Nothing is accepted, the input is held back */
+};
+
+/* When written segments are synced to disk */
+enum journal_sync {
+	journal_sync_none,	/* Leave it to the kernel */
+	journal_sync_interval,	/* On the commit after backlog-sync-interval ms */
+	journal_sync_commit	/* After every commit */
+};
+
+struct journal_config {
+	long segment_size;
+	long read_ahead;
+
+	enum journal_sync sync;
+	long sync_interval;
+
+	/* Zero means unlimited */
+	long long max_size;	/* Bytes of segments on disk */
+	long      max_age;	/* Seconds since a segment was last written */
+	long long min_free;	/* Bytes to leave free on the filesystem */
+	enum journal_policy policy;
+};
+
+struct journal;
+
+extern void journal_config_init (struct journal_config *, struct options *opts);
+
+extern struct journal *journal_open (char *path, struct journal_config *config);
+
+extern int   journal_append   (struct journal *, const char *msg, int len);
+extern int   journal_commit   (struct journal *);
+extern char *journal_peek     (struct journal *);
+extern void  journal_consume  (struct journal *);
+extern int   journal_peek_batch    (struct journal *, char **msgs, int *lens, int max);
+extern void  journal_consume_batch (struct journal *, int count);
+extern int   journal_pending  (struct journal *);
+extern void  journal_trim     (struct journal *);
+extern int   journal_empty    (struct journal *);
+extern int   journal_full     (struct journal *);
+extern int   journal_describe (struct journal *, char *buf, int size);
+extern void  journal_close    (struct journal *);
+
+/** Write-ahead use
+ *
+ * Positions are opaque and only ever grow. journal_written is the
+ * position just past the last appended record, journal_advance takes the
+ * peeked record without releasing it and returns the position past it.
+ * journal_release marks everything up to a position as done, it's
+ * dropped by the next journal_trim. journal_flush waits until everything
+ * appended is written, and synced if that's the policy. After
+ * journal_stop_reading records are no longer read back.
+ */
+extern long long journal_written      (struct journal *);
+extern long long journal_advance      (struct journal *);
+extern void      journal_release      (struct journal *, long long pos);
+extern int       journal_flush        (struct journal *);
+extern void      journal_stop_reading (struct journal *);
+
+#endif /* GENCACHE_JOURNAL_H */
@@ -1,15 +1,25 @@
 #include "defines.h"
 #include "logger.h"
 
+#include <pthread.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 #include "output.h"
 #include "buffer.h"
+#include "message.h"
+#include "journal.h"
 #include "log.h"
 
+#define LOGGER_BATCH_SIZE	1024
+
+/* Milliseconds the replay waits for live traffic to take its turn */
+#define LOGGER_REPLAY_WAIT	10
+
 static void logger_set_destination (struct logger *this, struct output_handler *handler)
 {
 	/* Basic assertions */
@@ -24,284 +34,738 @@ static void logger_set_destination (struct logger *this, struct output_handler *
 	this->dest = handler;
 }
 
-static int logger_write_backlog (struct logger *this, FILE *backlog_out)
+static int logger_write_backlog (struct logger *this, long keep)
 {
-	int i, qsize;
-	char *msg;
+	char *msgs[LOGGER_BATCH_SIZE];
+	int i, count, left;
+	long over;
 	
 	/* Basic assertions */
 	Require (
 		this != NULL &&
-		backlog_out != NULL
+		this->journal != NULL
 	);
 
-	/* Continue filling the backlog with queued messages */
-	qsize = this->buffer->size(this->buffer);
-	for (i = 0; i < qsize; i++)
+	/* Continue filling the journal with the oldest of what's queued, a
+	 * batch at a time, until the rest fits in keep bytes */
+	left = this->buffer->size(this->buffer);
+	over = this->buffer->bytes(this->buffer) - keep;
+	while (left > 0 && (over > 0 || keep == 0))
 	{
-		/* Fetch message from buffer */
-		msg = this->buffer->pop(this->buffer);
+		count = this->buffer->pop_batch(this->buffer, msgs, MIN(left, LOGGER_BATCH_SIZE));
 
 		/* Check for buffer end */
-		if (msg == NULL)
+		if (count == 0)
 		{
 			/* Reader has already stopped, we should stop
 			 * and continue another lifetime */
-			fclose (backlog_out);
+			journal_commit(this->journal);
 			return -2;
 		}
+		left -= count;
 
-		/* Write message to backlog */
-		if (fputs(msg, backlog_out) == EOF)
+		for (i = 0; i < count; i++)
 		{
-			SysErr(errno, "While trying to write to backlog");
-			this->buffer->unpop(this->buffer, msg);
+			/* What's left fits in memory, it stays queued */
+			if (keep > 0 && over <= 0)
+			{
+				while (count > i)
+					this->buffer->unpop(this->buffer, msgs[--count]);
+				break;
+			}
+
+			/* Add message to the journal */
+			if (! journal_append(this->journal, msgs[i], strlen(msgs[i])))
+			{
+				/* Error on the journal, or it's full, put back what didn't get in */
+				while (count > i)
+					this->buffer->unpop(this->buffer, msgs[--count]);
+
+				/* And keep what did */
+				journal_commit(this->journal);
+				return -1;
+			}
+
+			over -= strlen(msgs[i]);
+			this->buffer->release(this->buffer, msgs[i]);
+			this->spilled++;
+		}
+	}
+	
+	/* Written out as a whole, big queues go every read-ahead bytes */
+	return journal_commit(this->journal) ? 0 : -1;
+}
+
+static int logger_spill_batch (struct logger *this, struct output_batch *batch)
+{
+	/* Basic assertions */
+	Require (
+		this != NULL &&
+		batch != NULL &&
+		this->journal != NULL
+	);
 
-			/* Error on backlog_out */
+	/* Add the undelivered part of the batch to the journal */
+	while (batch->done < batch->count)
+	{
+		if (! journal_append(this->journal, batch->msgs[batch->done], batch->lens[batch->done]))
+		{
+			/* Error on the journal */
 			return -1;
 		}
 
-		fflush(backlog_out);
-		free(msg);
-		msg = NULL;
+		this->buffer->release(this->buffer, batch->msgs[batch->done]);
+		batch->msgs[batch->done] = NULL;
+		batch->done++;
+		this->spilled++;
 	}
-	
+
 	return 0;
 }
 
+static void logger_hold (struct logger *this)
+{
+	/* A full journal holds the input back, if that's the policy */
+	this->buffer->hold(this->buffer, journal_full(this->journal));
+}
+
+static int logger_confirm (struct logger *this, struct output_handler *dest)
+{
+	/* Journal segments are dropped once the destination confirmed all of them */
+	if (! dest->flush(dest))
+		return FALSE;
+
+	if (this->journal != NULL)
+	{
+		pthread_mutex_lock(&this->lock);
+		journal_trim(this->journal);
+		logger_hold(this);
+		pthread_mutex_unlock(&this->lock);
+	}
+
+	return TRUE;
+}
+
+static void logger_acked (struct logger *this)
+{
+	int i, acked;
+
+	if (this->unacked_count == 0)
+		return;
+
+	/* The destination still has the newest ones, everything before made it */
+	acked = this->unacked_count - this->dest->pending(this->dest);
+	if (acked <= 0)
+		return;
+
+	for (i = 0; i < acked; i++)
+		if (this->unacked[i] != NULL)
+			this->buffer->release(this->buffer, this->unacked[i]);
+
+	this->unacked_count -= acked;
+	memmove(this->unacked, this->unacked + acked, this->unacked_count * sizeof(char*));
+}
+
+static void logger_delivered (struct logger *this, char **msgs, int count)
+{
+	int i;
+
+	/* Done with, unless the destination confirms them later */
+	if (this->dest->pending == NULL)
+	{
+		for (i = 0; msgs != NULL && i < count; i++)
+			this->buffer->release(this->buffer, msgs[i]);
+		return;
+	}
+
+	/* Held on to until then, so the write-ahead log doesn't let go of them */
+	if (this->unacked_count + count > this->unacked_size)
+	{
+		this->unacked_size = MAX(this->unacked_size * 2, this->unacked_count + count);
+		this->unacked = (char**) realloc (this->unacked, this->unacked_size * sizeof(char*));
+		SysFatal(this->unacked == NULL, errno, "While holding unacknowledged messages");
+	}
+
+	for (i = 0; i < count; i++)
+		this->unacked[this->unacked_count++] = (msgs != NULL ? msgs[i] : NULL);
+
+	logger_acked(this);
+}
+
+static int logger_spill_unacked (struct logger *this, int running)
+{
+	struct output_batch back;
+	int i, count, failed;
+
+	/* Called with the lock held. Whatever the destination didn't ack yet
+	 * is older than anything else, it goes into the journal first */
+	logger_acked(this);
+	count  = 0;
+	failed = -1;
+	while (failed == -1 && this->unacked_count > count && this->dest->reclaim(this->dest, &back) > 0)
+	{
+		for (i = 0; i < back.count; i++, count++)
+		{
+			__sync_sub_and_fetch(&this->sent, 1);
+
+			/* On the way out, unconfirmed backlog is still in the journal */
+			if (failed != -1 || (this->unacked[count] == NULL && ! running))
+				continue;
+
+			if (! journal_append(this->journal, back.msgs[i], back.lens[i]))
+			{
+				failed = count;
+				continue;
+			}
+
+			if (this->unacked[count] != NULL)
+				this->buffer->release(this->buffer, this->unacked[count]);
+			this->spilled++;
+		}
+	}
+
+	/* What the journal didn't take is queued again, or lost on the way
+	 * out. It isn't released, so a write-ahead log keeps it */
+	for (i = count - 1; failed != -1 && i >= failed; i--)
+	{
+		if (running && this->unacked[i] != NULL)
+		{
+			this->buffer->unpop(this->buffer, this->unacked[i]);
+			continue;
+		}
+
+		if (this->unacked[i] != NULL)
+			message_free(this->unacked[i]);
+		this->lost++;
+	}
+
+	this->unacked_count -= count;
+	memmove(this->unacked, this->unacked + count, this->unacked_count * sizeof(char*));
+
+	return failed != -1 ? -1 : 0;
+}
+
+static void logger_unconfirmed (struct logger *this)
+{
+	struct output_batch back;
+	int i;
+
+	logger_acked(this);
+	if (this->unacked_count == 0)
+		return;
+
+	/* The rest was never confirmed. Handing over, it goes back in front of the queue */
+	if (this->handover)
+	{
+		for (i = this->unacked_count - 1; i >= 0; i--)
+			if (this->unacked[i] != NULL)
+				this->buffer->unpop(this->buffer, this->unacked[i]);
+		this->unacked_count = 0;
+
+		while (this->dest->reclaim(this->dest, &back) > 0)
+			;
+		return;
+	}
+
+	/* Into the journal for another try */
+	if (this->journal != NULL)
+	{
+		pthread_mutex_lock(&this->lock);
+		logger_spill_unacked(this, FALSE);
+		journal_commit(this->journal);
+		pthread_mutex_unlock(&this->lock);
+	}
+
+	/* Otherwise the destination dead-letters them. They aren't released, so a write-ahead log keeps them too */
+	for (i = 0; i < this->unacked_count; i++)
+	{
+		if (this->unacked[i] == NULL)
+			continue;
+		message_free(this->unacked[i]);
+		__sync_sub_and_fetch(&this->sent, 1);
+		this->lost++;
+	}
+	this->unacked_count = 0;
+}
+
+static long logger_keep (struct logger *this)
+{
+	/* Bytes of the queue that may stay in memory, all of it goes once the input ended */
+	if (this->memory_limit == 0 || this->buffer->at_end(this->buffer))
+		return 0;
+
+	return this->memory_limit;
+}
+
+static int logger_overflow (struct logger *this, struct output_batch *batch)
+{
+	long bytes, keep;
+	int i;
+
+	/* Handing over, the queue stays where it is */
+	if (this->handover)
+		return FALSE;
+
+	/* Without a memory budget everything is spilled */
+	if ((keep = logger_keep(this)) == 0)
+		return TRUE;
+
+	bytes = this->buffer->bytes(this->buffer);
+	if (batch != NULL)
+		for (i = batch->done; i < batch->count; i++)
+			bytes += batch->lens[i];
+
+	return bytes > keep;
+}
+
+static int logger_spill (struct logger *this, struct output_batch *batch)
+{
+	int retval;
+
+	/* The replay thread reads the journal while we add to it. What the
+	 * destination didn't ack is older than the batch, and what's in the
+	 * batch is older than the queue, so they go first */
+	pthread_mutex_lock(&this->lock);
+	retval = 0;
+	if (batch != NULL && (retval = logger_spill_unacked(this, TRUE)) == 0)
+		retval = logger_spill_batch(this, batch);
+	if (retval == 0)
+		retval = logger_write_backlog(this, logger_keep(this));
+	else
+		journal_commit(this->journal);
+	logger_hold(this);
+	pthread_mutex_unlock(&this->lock);
+
+	/* Something to replay */
+	pthread_cond_broadcast(&this->wake);
+	return retval;
+}
+
+static void logger_abandon (struct logger *this, struct output_batch *batch)
+{
+	char *msgs[LOGGER_BATCH_SIZE];
+	int i, count;
+
+	/* Handing over, the rest of the batch goes back in front of the queue */
+	if (this->handover)
+	{
+		if (batch != NULL)
+		{
+			for (i = batch->count - 1; i >= batch->done; i--)
+				this->buffer->unpop(this->buffer, batch->msgs[i]);
+			batch->count = 0;
+		}
+		return;
+	}
+
+	/* Out of time on shutdown, what couldn't go anywhere is let go. It
+	 * isn't released, so a write-ahead log keeps it for the next run */
+	if (batch != NULL)
+	{
+		for (i = batch->done; i < batch->count; i++)
+			message_free(batch->msgs[i]);
+		this->lost += batch->count - batch->done;
+		batch->count = 0;
+	}
+
+	while ((count = this->buffer->pop_batch(this->buffer, msgs, LOGGER_BATCH_SIZE)) > 0)
+	{
+		for (i = 0; i < count; i++)
+			message_free(msgs[i]);
+		this->lost += count;
+	}
+}
+
+static int logger_next_backlog (struct logger *this, struct output_batch *backlog, char **msgs, int *lens)
+{
+	/* Straight from what the journal read ahead, it stays there until it's consumed */
+	pthread_mutex_lock(&this->lock);
+	backlog->count = journal_peek_batch(this->journal, msgs, lens, this->limit != NULL ? ratelimit_batch(this->limit, LOGGER_BATCH_SIZE) : LOGGER_BATCH_SIZE);
+	pthread_mutex_unlock(&this->lock);
+
+	backlog->msgs   = msgs;
+	backlog->lens   = lens;
+	backlog->done   = 0;
+	backlog->offset = 0;
+
+	return backlog->count;
+}
+
+static void logger_pace_backlog (struct logger *this, struct output_batch *backlog)
+{
+	long bytes;
+	int i;
+
+	/* Backlog drains at the same pace as everything else */
+	if (this->limit != NULL)
+	{
+		for (i = 0, bytes = 0; i < backlog->count; i++)
+			bytes += backlog->lens[i];
+		ratelimit_take(this->limit, backlog->count, bytes);
+	}
+}
+
+static void logger_consume_backlog (struct logger *this, struct output_batch *backlog)
+{
+	/* What went out is done with, the rest of the batch moves up. The
+	 * offset stays, a partly sent message continues where it left off */
+	pthread_mutex_lock(&this->lock);
+	journal_consume_batch(this->journal, backlog->done);
+	pthread_mutex_unlock(&this->lock);
+	__sync_add_and_fetch(&this->sent, backlog->done);
+
+	backlog->msgs  += backlog->done;
+	backlog->lens  += backlog->done;
+	backlog->count -= backlog->done;
+	backlog->done   = 0;
+}
+
+static void logger_replay_turn (struct logger *this, int count)
+{
+	struct timespec until;
+
+	pthread_mutex_lock(&this->lock);
+	while (! this->stopping)
+	{
+		/* Live traffic is idle, the journal can have it all */
+		if (this->buffer->size(this->buffer) == 0)
+		{
+			this->live_msgs   = 0;
+			this->replay_msgs = 0;
+			break;
+		}
+
+		/* Otherwise it's kept to its share of the messages */
+		if (this->replay_msgs * 100 < this->replay_share * (this->live_msgs + this->replay_msgs + 1))
+			break;
+
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += LOGGER_REPLAY_WAIT * 1000000L;
+		if (until.tv_nsec >= 1000000000L)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&this->wake, &this->lock, &until);
+	}
+	this->replay_msgs += count;
+	pthread_mutex_unlock(&this->lock);
+}
+
+static void *logger_replay (void *arg)
+{
+	struct logger *this = (struct logger*) arg;
+	struct output_handler *dest = this->replay_dest;
+	struct output_batch backlog;
+	char *msgs[LOGGER_BATCH_SIZE];
+	int lens[LOGGER_BATCH_SIZE];
+	struct timespec until;
+	int held, sent;
+
+	held = FALSE;
+	sent = FALSE;
+	backlog.count = 0;
+	while (TRUE)
+	{
+		/* A destination in error is reset, it reconnects on its backoff schedule */
+		if (dest->state == os_error)
+		{
+			Log2(error, "Replay destination in error state, resetting it", "Logger");
+			dest->disconnect(dest);
+		}
+
+		if (backlog.count == 0 && logger_next_backlog(this, &backlog, msgs, lens) > 0)
+		{
+			/* Take turns with live traffic, and keep to the rate limit */
+			logger_replay_turn(this, backlog.count);
+			logger_pace_backlog(this, &backlog);
+		}
+
+		if (backlog.count == 0)
+		{
+			/* Caught up, the journal can go once the destination confirmed it */
+			if (sent && ! logger_confirm(this, dest))
+			{
+				Log2(warning, "Destination didn't confirm the backlog, keeping it", "Logger");
+			}
+			sent = FALSE;
+			held = FALSE;
+
+			/* Wait for the live side to spill something, unless it's done */
+			pthread_mutex_lock(&this->lock);
+			if (this->stopping)
+			{
+				pthread_mutex_unlock(&this->lock);
+				break;
+			}
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec++;
+			pthread_cond_timedwait(&this->wake, &this->lock, &until);
+			pthread_mutex_unlock(&this->lock);
+			continue;
+		}
+
+		/* Failed messages stay in the journal, and are tried again while there's live traffic */
+		if (! deliver_batch(dest, &backlog))
+		{
+			if (backlog.done > 0)
+			{
+				logger_consume_backlog(this, &backlog);
+				sent = TRUE;
+			}
+			if (this->stopping)
+				break;
+			continue;
+		}
+
+		logger_consume_backlog(this, &backlog);
+		sent = TRUE;
+
+		/* Drop segments that were sent completely, if the destination can confirm them */
+		if (journal_pending(this->journal) && ! held && ! logger_confirm(this, dest))
+			held = TRUE;
+	}
+
+	/* Whatever went out so far, what isn't confirmed stays in the journal */
+	if (sent && ! logger_confirm(this, dest) && dest->reclaim != NULL)
+	{
+		while (dest->reclaim(dest, &backlog) > 0)
+			;
+	}
+
+	return NULL;
+}
+
 static void logger_run (struct logger *this)
 {
-	size_t msglen;
-	char *msg;
-	FILE *backlog_in, *backlog_out;
+	struct output_batch batch, backlog;
+	char *msgs[LOGGER_BATCH_SIZE], *bmsgs[LOGGER_BATCH_SIZE];
+	int lens[LOGGER_BATCH_SIZE], blens[LOGGER_BATCH_SIZE];
+	pthread_t replay;
+	long bytes;
+	int i, draining, held, concurrent;
 	
 	/* Basic assertions */
 	Require(this != NULL);
 
-	msg = NULL;
-	backlog_in  = NULL;
-	backlog_out = NULL;
+	draining   = FALSE;
+	held       = FALSE;
+	concurrent = FALSE;
+
+	batch.msgs  = msgs;
+	batch.lens  = lens;
+	batch.count = 0;
+
+	backlog.count = 0;
 
 	/* Check if we've got a destination to log to */
 	Fatal(this->dest == NULL, "No destination set", "Logger");
 
-	/* Try to open an old backlog file */
-	if ((backlog_in = fopen(this->backlog_file, "r")) != NULL)
+	/* Open the journal, it may have been left by an earlier run */
+	if (this->backlog_file != NULL)
 	{
-		if (getline(&msg, &msglen, backlog_in) == -1)
-		{
-			SysErr(errno, "While trying to read from old backlog");
-			fclose(backlog_in);
-			backlog_in = NULL;
-			if (msg != NULL)
-			{
-				free(msg);
-				msg = NULL;
-			}
-		}
+		pthread_mutex_lock(&this->lock);
+		this->journal = journal_open(this->backlog_file, &this->journal_config);
+		draining      = ! journal_empty(this->journal);
+		pthread_mutex_unlock(&this->lock);
+	}
+
+	if (draining)
+	{
+		Log2(info, "Resuming from old backlog", "Logger");
 	}
 	else
 	{
 		Log2(info, "No initial backlog", "Logger");
 	}
-	
-	/* If there's no old message from backlog, wait for first one from the buffer */
-	if (msg == NULL)
+
+	/* Unless strictly in order, the journal drains on a connection of its own */
+	if (this->journal != NULL && this->replay != replay_strict)
 	{
-		/* Retrieve the first message */
-		msg = this->buffer->pop(this->buffer);
+		Require(this->replay_dest != NULL);
+		SysFatal(pthread_create(&replay, NULL, logger_replay, this), errno, "On replay thread start");
+		concurrent = TRUE;
+		draining   = FALSE;
 	}
-
-	/* While we've got a message to send */
-	while (msg)
+	
+	/* While there is something to send */
+	while (TRUE)
 	{
-		/* Check for error state in destination */
+		/* Handing over to a new process, which takes the queue from here */
+		if (this->handover)
+		{
+			logger_abandon(this, &batch);
+			break;
+		}
+
+		/* A destination in error is reset, it reconnects on its backoff schedule */
 		if (this->dest->state == os_error)
 		{
-			Log2(error, "Destination in insane state, shutting down", "Logger");
-			exit(1);
+			Log2(error, "Destination in error state, resetting it", "Logger");
+			this->dest->disconnect(this->dest);
 		}
-	
-		/* Try delivering the message */	
-		if (deliver_message(this->dest, msg))
+
+		if (draining)
 		{
-			/* Message was sent */
-			free(msg);
-			msg = NULL;
-			msglen = 0;
+			/* There is a backlog, it goes before anything in the queue, in batches */
+			if (backlog.count == 0 && logger_next_backlog(this, &backlog, bmsgs, blens) > 0)
+				logger_pace_backlog(this, &backlog);
 
-			if (backlog_in)
+			if (backlog.count == 0)
 			{
-				/* There is a backlog */
-				if (getline(&msg, &msglen, backlog_in) == -1)
+				/* Caught up, the journal can go once the destination confirmed it */
+				if (! logger_confirm(this, this->dest))
 				{
-					/* EOF reached, no more backlog */
-
-					/* Close backlog */
-					if (backlog_in)
-						fclose(backlog_in);
-					if (backlog_out)
-						fclose(backlog_out);
-					
-					/* Truncate backlog file */
-					if (truncate(this->backlog_file, 0))
-					{
-						SysErr(errno, "While trying to truncate the backlog file");
-					}
-						
-					/* Reset variables */
-					backlog_in  = NULL;
-					backlog_out = NULL;
-					
-					/* Pop a message of the queue*/
-					msg = this->buffer->pop(this->buffer);
+					Log2(warning, "Destination didn't confirm the backlog, keeping it", "Logger");
 				}
-				else
-				{
-					/* Succesfully read a message from the backlog */
 
-					/* If backlog is still opened */
-					if (backlog_out)
-					{
-						/* Seems like all is fine, stop writing to backlog file */
-						fclose(backlog_out);
-						backlog_out = NULL;
-					}
+				draining = FALSE;
+				held     = FALSE;
 
-				}
+				/* Continue with the queue */
+				continue;
 			}
-			else
-			{
-				/* There's no backlog, so just take the next message of the queue */
-				msg = this->buffer->pop(this->buffer);
-			}
-		}
-		else
-		{
-			/* Message was not sent */
 
-			if (backlog_in)
+			/* Try delivering the batch, a failed one picks up where it left off */
+			if (deliver_batch(this->dest, &backlog))
 			{
-				/* We've already got a backlog */
+				/* Batch was sent */
+				logger_delivered(this, NULL, backlog.done);
+				logger_consume_backlog(this, &backlog);
 
-				/* If backlog_out is not opened try opening it */
-				if (! backlog_out)
-				{
-					if (this->backlog_file == NULL)
-					{
-						/* No backlog specified */
-						continue;
-					}
-					else if ((backlog_out = fopen(this->backlog_file, "a")) != NULL)
-					{
-						/* Open of backlog failed, there's nothing we can do but.. */
-						SysErr(errno, "While trying to open backlog file for appending");
-						continue;
-					}
-				}
+				/* Drop segments that were sent completely, if the destination can confirm them */
+				if (journal_pending(this->journal) && ! held && ! logger_confirm(this, this->dest))
+					held = TRUE;
 
-				switch (logger_write_backlog(this, backlog_out))
-				{
-					case -1:
-						/* Write failed */
-						if (ferror(backlog_out))
-						{
-							fclose(backlog_out);
-							backlog_out = NULL;
-						}
-						break;
-
-					case -2:
-						/* End of buffer reached */
-						fclose(backlog_out);
-						fclose(backlog_in);
-						return;
-
-					default:
-						/* All went well, continue */
-						break;
-				}
+				continue;
+			}
 
-				/* Retry delivery */
+			/* Batch was not (completely) sent, what did get through is done with */
+			if (backlog.done > 0)
+			{
+				logger_delivered(this, NULL, backlog.done);
+				logger_consume_backlog(this, &backlog);
 			}
-			else
+
+			/* The queue goes after the rest once it outgrows memory */
+			if (logger_overflow(this, NULL) && logger_spill(this, NULL) == -2)
 			{
-				/* There is no backlog yet */
+				/* End of buffer reached */
+				break;
+			}
 
-				/* Open backlog */
-				if (!this->backlog_file)
-				{
-					/* No backlog specified */
-					continue;
-				}
+			/* Shutting down and out of time, with a journal that won't take the rest */
+			if (output_expired())
+			{
+				logger_abandon(this, NULL);
+				break;
+			}
 
-				backlog_out = fopen(this->backlog_file, "a");
+			/* Retry delivery */
+			continue;
+		}
 
-				if ((backlog_in = fopen(this->backlog_file, "r")) == NULL)
-				{
-					SysErr(errno, "An error occured when trying to open the backlog file for reading");
-				}
+		/* If there's no batch pending, wait for the next one from the buffer */
+		if (batch.count == 0)
+		{
+			batch.count  = this->buffer->pop_batch(this->buffer, msgs, this->limit != NULL ? ratelimit_batch(this->limit, LOGGER_BATCH_SIZE) : LOGGER_BATCH_SIZE);
+			batch.done   = 0;
+			batch.offset = 0;
 
-				if (backlog_out == NULL)
-				{
-					SysErr(errno, "An error occured when trying to open the backlog file for writing");
-					continue;
-				}
+			/* End of buffer reached */
+			if (batch.count == 0)
+				break;
 
-				/* Write current message to backlog (and free it) */
-				if (fputs(msg, backlog_out) == EOF)
-				{
-					SysErr(errno, "While trying to write to backlog");
-					this->buffer->unpop(this->buffer, msg);
+			for (i = 0, bytes = 0; i < batch.count; i++)
+				bytes += lens[i] = strlen(msgs[i]);
 
-					/* Error on backlog_out */
-					continue;
-				}
-				fflush(backlog_out);
-				free(msg);
-				msg = NULL;
-				msglen = 0;
+			/* Wait for our turn if the destination is rate limited */
+			if (this->limit != NULL)
+				ratelimit_take(this->limit, batch.count, bytes);
+		}
 
-				/* Write current queue to backlog */
-				switch (logger_write_backlog(this, backlog_out))
-				{
-					case -1:
-						/* Write failed */
-						if (ferror(backlog_out))
-						{
-							fclose(backlog_out);
-							backlog_out = NULL;
-						}
-						break;
-
-					case -2:
-						/* End of buffer reached */
-						fclose(backlog_out);
-						fclose(backlog_in);
-						return;
-
-					default:
-						/* All went well, continue */
-						break;
-				}
+		/* Try delivering the batch */
+		if (deliver_batch(this->dest, &batch))
+		{
+			/* Batch was sent */
+			logger_delivered(this, msgs, batch.count);
+			__sync_add_and_fetch(&this->sent, batch.count);
+
+			/* Counts towards the share of the replay */
+			if (concurrent)
+			{
+				pthread_mutex_lock(&this->lock);
+				this->live_msgs += batch.count;
+				pthread_mutex_unlock(&this->lock);
+				pthread_cond_broadcast(&this->wake);
+			}
+
+			batch.count = 0;
+			continue;
+		}
 
-				/* Read first message from backlog (also sets file position) */
-				if(getline(&msg, &msglen, backlog_in) == -1)
+		/* Batch was not (completely) sent, drop what did get through */
+		logger_delivered(this, msgs, batch.done);
+		for (i = 0; i < batch.done; i++)
+			msgs[i] = NULL;
+		__sync_add_and_fetch(&this->sent, batch.done);
+
+		if (this->journal == NULL || ! logger_overflow(this, &batch))
+		{
+			/* Shutting down and out of time, there's nowhere to keep it */
+			if (output_expired())
+			{
+				logger_abandon(this, &batch);
+				break;
+			}
+
+			/* No backlog specified, or it all fits in memory, retry the remainder */
+			continue;
+		}
+
+		/* Add remainder of the batch and the current queue to the journal (and free them) */
+		switch (logger_spill(this, &batch))
+		{
+			case -1:
+				/* Journal full or failing, the remainder is retried after what did get in */
+				if (batch.done < batch.count)
 				{
-					SysErr(errno, "While reading from just created backlog file");
-					if (ferror(backlog_in))
+					if (output_expired())
 					{
-						fclose(backlog_in);
-						backlog_in = NULL;
+						logger_abandon(this, &batch);
+						goto finish;
 					}
+
+					draining = ! concurrent;
+					continue;
 				}
+				break;
 
-				/* Resume delivery tries from the backlog */
-			}
+			case -2:
+				/* End of buffer reached */
+				batch.count = 0;
+				goto finish;
 		}
+		batch.count = 0;
+
+		/* Resume delivery tries from the backlog, unless it drains by itself */
+		draining = ! concurrent;
 	}
 
-	/* We're done */
+finish:
+	/* Let the replay finish, the journal keeps what it can't deliver */
+	if (concurrent)
+	{
+		pthread_mutex_lock(&this->lock);
+		this->stopping = TRUE;
+		pthread_mutex_unlock(&this->lock);
+		pthread_cond_broadcast(&this->wake);
+		SysFatal(pthread_join(replay, NULL), errno, "While waiting for replay thread to finish");
+	}
+
+	/* We're done, once the destination confirmed what it got */
+	logger_confirm(this, this->dest);
+	logger_unconfirmed(this);
 }
 
 static void logger_cleanup (struct logger *this)
@@ -312,6 +776,18 @@ static void logger_cleanup (struct logger *this)
 	/* Cleanup the output_handler */
 	if (this->dest != NULL)
 		this->dest->cleanup(this->dest);
+
+	if (this->limit != NULL)
+		ratelimit_cleanup(this->limit);
+
+	if (this->replay_dest != NULL)
+		this->replay_dest->cleanup(this->replay_dest);
+
+	journal_close(this->journal);
+	free(this->unacked);
+
+	pthread_mutex_destroy(&this->lock);
+	pthread_cond_destroy(&this->wake);
 	
 	/* Free structure */
 	free(this);
@@ -328,8 +804,27 @@ struct logger *logger_init(struct buffer *buffer)
 
 	/* Initialize variables */
 	this->backlog_file = NULL;
+	this->journal      = NULL;
+	journal_config_init(&this->journal_config, NULL);
+	this->memory_limit = 0;
+	this->replay       = replay_strict;
+	this->replay_share = 0;
+	this->replay_dest  = NULL;
+	this->stopping     = FALSE;
+	this->live_msgs    = 0;
+	this->replay_msgs  = 0;
+	this->sent         = 0;
+	this->spilled      = 0;
+	this->lost         = 0;
+	this->unacked      = NULL;
+	this->unacked_count = 0;
+	this->unacked_size = 0;
+	this->handover     = FALSE;
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->wake, NULL);
 	this->dest   = NULL;
 	this->buffer = buffer;
+	this->limit  = NULL;
 	
 	/* Set the handler functions */
 	this->set_destination = logger_set_destination;
@@ -3,12 +3,54 @@
 
 #include "output.h"
 #include "buffer.h"
+#include "ratelimit.h"
+#include "journal.h"
+
+#include <pthread.h>
+
+/* Percent of the messages an interleaved replay gets while live traffic waits */
+#define LOGGER_REPLAY_SHARE	20
+
+/* How the journal drains next to live traffic */
+enum logger_replay {
+	replay_strict,		/* In order, live traffic waits for the journal */
+	replay_live_first,	/* On its own connection, while live traffic is idle */
+	replay_interleave	/* On its own connection, with a share of the messages */
+};
 
 struct logger {
 	char * backlog_file;
+	struct journal_config  journal_config;
+	struct journal        *journal;
+	long                   memory_limit;	/* Bytes kept queued in memory on failure, 0 spills all of it */
+
+	/* Concurrent replay, the lock guards the journal and the counters */
+	enum logger_replay     replay;
+	int                    replay_share;	/* Percent of messages while live traffic waits */
+	struct output_handler *replay_dest;
+	pthread_mutex_t        lock;
+	pthread_cond_t         wake;
+	int                    stopping;	/* Live traffic ended */
+	long                   live_msgs;
+	long                   replay_msgs;
+
+	/* Messages that went out, into the backlog, or nowhere on shutdown */
+	long long              sent;
+	long long              spilled;
+	long long              lost;
+
+	/* Delivered to a destination that confirms later, oldest first. They're
+	 * released once it did, NULL stands in for backlog messages */
+	char                 **unacked;
+	int                    unacked_count;
+	int                    unacked_size;
+
+	/* Stop at the next batch, leaving the queue as it is for a live upgrade */
+	int                    handover;
 
 	struct output_handler *dest;
 	struct buffer         *buffer;
+	struct ratelimit      *limit;
 
 	void (*set_destination) (struct logger*, struct output_handler*);
 	void (*run)             (struct logger*);
@@ -4,6 +4,7 @@
 #include <signal.h>
 #include <pthread.h>
 #include <signal.h>
+#include <semaphore.h>
 #include <getopt.h>
 #include <string.h>
 #include <unistd.h>
@@ -17,15 +18,31 @@
 #include "output.h"
 #include "setup.h"
 #include "options.h"
+#include "output_file.h"
+#include "ratelimit.h"
+#include "control.h"
+#include "journal.h"
+#include "upgrade.h"
 
 #include "buffer.h"
 #include "reader.h"
 #include "logger.h"
 
 /* pthread identifier variables are global for the signal handler to be work */
-static pthread_t logthread;
+static pthread_t logthreads[GENCACHE_MAX_OUTPUT_HANDLERS];
 static pthread_t readthread;
 
+/* Set once we're asked to shut down */
+static volatile sig_atomic_t terminating = FALSE;
+
+/* The main thread wakes up when the reader or a logger ended, for a shutdown or an upgrade */
+static sem_t wakeup;
+static volatile sig_atomic_t reading = FALSE;
+static int loggers_running = 0;
+static volatile sig_atomic_t upgrade_requested = FALSE;
+static char **saved_argv;
+static int upgraded = FALSE;
+
 static void signal_handler (int signal)
 {
 	/* Determine action depending on signal */
@@ -34,10 +51,19 @@ static void signal_handler (int signal)
 		/* Nice shutdown requested */
 		case SIGHUP:
 			fprintf(stderr, "I got SIGHUP signal: %d\n", signal);
-      break;
+			output_file_rotate_all();
+			break;
 		case SIGTERM:
 			fprintf(stderr, "I got shutdown signal: %d\n", signal);
-			pthread_cancel(readthread);
+			terminating = TRUE;
+			if (reading)
+				pthread_cancel(readthread);
+			sem_post(&wakeup);
+			break;
+		case SIGUSR2:
+			fprintf(stderr, "I got upgrade signal: %d\n", signal);
+			upgrade_requested = TRUE;
+			sem_post(&wakeup);
 			break;
    /* Broken pipe, parent process died?*/
 		case SIGPIPE:
@@ -54,35 +80,177 @@ static void signal_handler (int signal)
 	}
 }
 
-static void run (struct reader *rd, struct logger *ld)
+static void signal_mask (int how)
+{
+	sigset_t signals;
+
+	/* The ones the handler is for, a SIGPIPE goes to the thread that wrote */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR2);
+	pthread_sigmask(how, &signals, NULL);
+}
+
+static void read_done (void *arg)
+{
+	/* However the reader ended, even cancelled */
+	reading = FALSE;
+	sem_post(&wakeup);
+}
+
+static void *read_main (void *arg)
+{
+	struct reader *rd = (struct reader*) arg;
+
+	pthread_cleanup_push(read_done, NULL);
+	rd->run(rd);
+	pthread_cleanup_pop(TRUE);
+
+	return NULL;
+}
+
+static void *logger_main (void *arg)
+{
+	struct logger *lg = (struct logger*) arg;
+
+	lg->run(lg);
+	__sync_sub_and_fetch(&loggers_running, 1);
+	sem_post(&wakeup);
+
+	return NULL;
+}
+
+static void run (struct reader *rd, struct logger **loggers, int count, char *control_path, struct journal *wal, long shutdown_timeout)
 {
-	/* Ignore signals for rest of threads */
+	struct control *control = NULL;
+	long long done;
+	int armed = FALSE;
+	int i;
+
+	/* Ignore signals until we're ready for them */
 	signal(SIGHUP, SIG_IGN);
 	signal(SIGTERM, SIG_IGN);
 	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR2, SIG_IGN);
+
+	/* The sockets a new process would take over, before the reader changes its list */
+	SysFatal(sem_init(&wakeup, 0, 0) == -1, errno, "On wakeup semaphore");
+	upgrade_sources(rd);
 
 	Log(error, "Starting threads!\n");
 
-	/* Create the worker threads */
-	SysFatal(pthread_create(&logthread,  NULL, (void*) ld->run, ld), errno, "On logger thread start");
-	SysFatal(pthread_create(&readthread, NULL, (void*) rd->run, rd), errno, "On reader thread start");
+	/* Create the worker threads, one logger for every destination */
+	loggers_running = count;
+	for (i = 0; i < count; i++)
+		SysFatal(pthread_create(&logthreads[i], NULL, logger_main, loggers[i]), errno, "On logger thread start");
+	reading = TRUE;
+	SysFatal(pthread_create(&readthread, NULL, read_main, rd), errno, "On reader thread start");
+
+	/* Take commands while running */
+	if (control_path != NULL)
+		control = control_init(control_path, loggers, count);
 	
 	/* Register signal handlers for nice shutdown */
 	signal(SIGHUP, signal_handler);
 	signal(SIGTERM, signal_handler);
 	signal(SIGPIPE, signal_handler);
+	signal(SIGUSR2, signal_handler);
+	signal_mask(SIG_UNBLOCK);
 
 	Log(error, "Waiting for readthread to terminate!\n");
 
+	/* Upgrade when asked to, until the reader finishes */
+	while (TRUE)
+	{
+		if (sem_wait(&wakeup) == -1)
+			continue;
+		if (! upgrade_requested)
+			break;
+		upgrade_requested = FALSE;
+
+		if (upgraded)
+			continue;
+		if (wal != NULL)
+		{
+			fprintf(stderr, "Can't upgrade with a write-ahead log\n");
+			continue;
+		}
+
+		/* Once the new process is ready, reading stops */
+		if (upgrade_start(saved_argv))
+		{
+			upgraded = TRUE;
+			pthread_cancel(readthread);
+		}
+	}
+
 	/* Wait for the reader to finish and cleanup */
 	SysFatal(pthread_join(readthread, NULL), errno, "While waiting for reader thread to finish");
+
+	/* The new process takes the connections, and the queues once the destinations stopped */
+	if (upgraded)
+	{
+		upgrade_connections(rd);
+		for (i = 0; i < count; i++)
+			__sync_lock_test_and_set(&loggers[i]->handover, TRUE);
+		output_shutdown(0);
+	}
 	rd->cleanup(rd);
 
-	Log(error, "Waiting for logthread to terminate!\n");
+	Log(error, "Waiting for logthreads to terminate!\n");
 
-	/* Wait for the logger to finish and cleanup */
-	SysFatal(pthread_join(logthread, NULL), errno, "While waiting for logger thread to finish");
-	ld->cleanup(ld);
+	/* Wait for the loggers to finish, they can be controlled until then */
+	while (__sync_add_and_fetch(&loggers_running, 0) > 0)
+	{
+		/* Asked to stop, before or while draining: what's queued has this long to go out before it's spilled */
+		if (terminating && ! armed && shutdown_timeout > 0)
+		{
+			output_shutdown(shutdown_timeout * 1000);
+			armed = TRUE;
+		}
+		sem_wait(&wakeup);
+	}
+	for (i = 0; i < count; i++)
+		SysFatal(pthread_join(logthreads[i], NULL), errno, "While waiting for logger thread to finish");
+	control_cleanup(control);
+
+	/* Only what no destination got out stays in the write-ahead log */
+	if (wal != NULL)
+	{
+		done = loggers[0]->buffer->progress(loggers[0]->buffer);
+		for (i = 1; i < count; i++)
+			done = MIN(done, loggers[i]->buffer->progress(loggers[i]->buffer));
+
+		journal_release(wal, done);
+		journal_trim(wal);
+		journal_close(wal);
+	}
+
+	/* What's still queued goes to the new process */
+	if (upgraded)
+	{
+		for (i = 0; i < count; i++)
+			fprintf(stderr, "Upgrade: handed over %ld messages queued for %s\n",
+				upgrade_queue(i, loggers[i]->buffer), loggers[i]->dest->res);
+	}
+
+	/* How the shutdown went for every destination */
+	if (terminating)
+	{
+		for (i = 0; i < count; i++)
+			fprintf(stderr, "Shutdown: %s delivered %lld, backlogged %lld, %s %lld\n",
+				loggers[i]->dest->res, loggers[i]->sent, loggers[i]->spilled,
+				wal != NULL ? "left in write-ahead log" : "lost", loggers[i]->lost);
+	}
+
+	for (i = 0; i < count; i++)
+		loggers[i]->cleanup(loggers[i]);
+
+	/* Backlogs are closed, the new process can take it from here */
+	if (upgraded)
+		upgrade_done();
+	sem_destroy(&wakeup);
 
 	Log(error, "All threads terminated!\n");
 }
@@ -97,6 +265,10 @@ static int parse_type (char *type)
 		return type_tcp;
 	else if (strcasecmp(type, "unix") == 0)
 		return type_unix;
+	else if (strcasecmp(type, "pool") == 0)
+		return type_pool;
+	else if (strcasecmp(type, "failover") == 0)
+		return type_failover;
 	else
 		return type_unknown;
 }
@@ -138,17 +310,27 @@ static void check_for_old_pidfile (char *filename)
 
 int main (int argc, char **argv)
 {
-	struct buffer *buffer;
+	struct buffer *buffers[GENCACHE_MAX_OUTPUT_HANDLERS];
+	struct logger *loggers[GENCACHE_MAX_OUTPUT_HANDLERS];
+	char *out_res[GENCACHE_MAX_OUTPUT_HANDLERS];
 	struct reader *rd;
-	struct logger *ld;
-	struct output_handler *outhandler;
+	struct output_handler *outhandler, *replay_dest;
+	struct ratelimit *limit;
 	struct input_handler *inhandler;
 	enum io_types out_type = type_file;
 	enum io_types in_type = type_file;
-	char *out_res = NULL;
+	struct options *opts = NULL;
+	char *backlog_file = NULL;
 	char *in_res = NULL;
 	char *pidfile = NULL;
-	int c, retval;
+	char *control_path = NULL;
+	struct journal_config journal_config;
+	struct journal *wal = NULL;
+	long replay_share, memory_limit, shutdown_timeout = 0;
+	char *end;
+	enum logger_replay replay_mode;
+	char *replay;
+	int c, i, retval, dest_count, upgrading;
 
 	static struct option long_options[] =
 	{
@@ -163,6 +345,10 @@ int main (int argc, char **argv)
 		{"destination", required_argument, NULL, 'd'},
 		{"backlog",     required_argument, NULL, 'b'},
 		{"pidfile",     required_argument, NULL, 'p'},
+		{"option",      required_argument, NULL, 'O'},
+		{"control",     required_argument, NULL, 'c'},
+		{"wal",         required_argument, NULL, 'w'},
+		{"shutdown-timeout", required_argument, NULL, 't'},
 		{ NULL,         0,                 NULL,  0 }
 	};
 	int option_index = 0;
@@ -170,16 +356,22 @@ int main (int argc, char **argv)
 	Log(critical, "Genbuf starting!\n");
 	retval = EXIT_SUCCESS;
 
-	buffer = buffer_init();
-	rd     = reader_init(buffer);
-	ld     = logger_init(buffer);
+	/* Signals are for the main thread only, every thread started from here on keeps them blocked */
+	signal_mask(SIG_BLOCK);
+
+	/* Started by an older process that hands over to us, we need its sockets before the sources are set up */
+	saved_argv = argv;
+	upgrading  = upgrade_init();
+
+	rd         = reader_init();
+	dest_count = 0;
 	current_log_level = impossible;
 
 	/* While we're busy */
 	while(TRUE)
 	{
 		/* Get option */
-		c = getopt_long (argc, argv, "vhi:o:s:d:b:p:", long_options, &option_index);
+		c = getopt_long (argc, argv, "vhi:o:s:d:b:p:O:c:w:t:", long_options, &option_index);
 
 		/* Detect the end of the options is reached */
 		if (c == -1)
@@ -201,7 +393,7 @@ int main (int argc, char **argv)
 			case 'i':
 				/* Set the input type for the next source */
 				in_type = parse_type(optarg);
-				if (in_type == type_unknown)
+				if (in_type == type_unknown || in_type == type_pool || in_type == type_failover)
 				{
 					fprintf(stderr, "Unknown in-type: %s\n", optarg);
 					retval = EXIT_FAILURE;
@@ -230,14 +422,24 @@ int main (int argc, char **argv)
 					goto clean_exit;
 				}
 
-				inhandler = create_input_handler(in_type, in_res);
+				inhandler = create_input_handler(in_type, in_res, opts);
+
+				/* Every option should have been picked up by now */
+				if (options_unused(opts) != NULL)
+				{
+					fprintf(stderr, "Unknown option for source: %s\n", options_unused(opts));
+					retval = EXIT_FAILURE;
+					goto clean_exit;
+				}
+				options_cleanup(opts);
+				opts = NULL;
 
 				/* Register with reader */
 				rd->add_source(rd, inhandler);
 				break;
 
 			case 'd':
-				/* Set the destination */
+				/* Add a destination */
 				if (out_type == type_unknown)
 				{
 					fprintf(stderr, "No output type specified for destination!\n");
@@ -245,36 +447,186 @@ int main (int argc, char **argv)
 					goto clean_exit;
 				}
 				
-				if (out_res != NULL)
+				if (dest_count == GENCACHE_MAX_OUTPUT_HANDLERS)
 				{
-					fprintf(stderr, "Destination already set!\n");
+					fprintf(stderr, "Too many destinations!\n");
 					retval = EXIT_FAILURE;
 					goto clean_exit;
 				}
 				
-				out_res = strdup(optarg);
-				if (out_res == NULL)
+				out_res[dest_count] = strdup(optarg);
+				if (out_res[dest_count] == NULL)
 				{
 					perror("String duplication failed");
 					retval = EXIT_FAILURE;
 					goto clean_exit;
 				}
 				
-				outhandler = create_output_handler(out_type, out_res);
+				outhandler = create_output_handler(out_type, out_res[dest_count], opts);
+				limit      = ratelimit_init(opts);
+
+				/* Journal layout and limits, used once a backlog is set */
+				journal_config_init(&journal_config, opts);
+
+				/* How much of the queue stays in memory before the backlog gets the rest */
+				memory_limit = options_get_long(opts, "memory-limit", 0);
+				if (memory_limit < 0)
+				{
+					fprintf(stderr, "Invalid memory-limit\n");
+					retval = EXIT_FAILURE;
+					goto clean_exit;
+				}
 
-				/* Register with logger */
-				ld->set_destination(ld, outhandler);
+				/* How a backlog drains next to live traffic */
+				replay       = options_get(opts, "replay", "strict");
+				replay_share = options_get_long(opts, "replay-share", LOGGER_REPLAY_SHARE);
+				if (strcasecmp(replay, "strict") == 0)
+					replay_mode = replay_strict;
+				else if (strcasecmp(replay, "live-first") == 0)
+					replay_mode = replay_live_first;
+				else if (strcasecmp(replay, "interleave") == 0)
+					replay_mode = replay_interleave;
+				else
+				{
+					fprintf(stderr, "Unknown replay mode: %s\n", replay);
+					retval = EXIT_FAILURE;
+					goto clean_exit;
+				}
+
+				if (replay_share < 1 || replay_share > 99)
+				{
+					fprintf(stderr, "Replay share should be a percentage between 1 and 99!\n");
+					retval = EXIT_FAILURE;
+					goto clean_exit;
+				}
+
+				/* Replaying next to live traffic takes a connection of its own */
+				replay_dest = NULL;
+				if (replay_mode != replay_strict)
+				{
+					if (out_type == type_file)
+					{
+						fprintf(stderr, "Replaying next to live traffic needs a network destination!\n");
+						retval = EXIT_FAILURE;
+						goto clean_exit;
+					}
+					replay_dest = create_output_handler(out_type, out_res[dest_count], opts);
+				}
+
+				/* Every option should have been picked up by now */
+				if (options_unused(opts) != NULL)
+				{
+					fprintf(stderr, "Unknown option for destination: %s\n", options_unused(opts));
+					retval = EXIT_FAILURE;
+					goto clean_exit;
+				}
+				options_cleanup(opts);
+				opts = NULL;
+
+				/* Every destination gets its own buffer and logger */
+				buffers[dest_count] = buffer_init();
+				loggers[dest_count] = logger_init(buffers[dest_count]);
+				loggers[dest_count]->set_destination(loggers[dest_count], outhandler);
+				loggers[dest_count]->limit = limit;
+				loggers[dest_count]->journal_config = journal_config;
+				loggers[dest_count]->memory_limit   = memory_limit;
+				loggers[dest_count]->replay       = replay_mode;
+				loggers[dest_count]->replay_share = (replay_mode == replay_interleave ? replay_share : 0);
+				loggers[dest_count]->replay_dest  = replay_dest;
+
+				/* Claim a backlog that was given before the destination */
+				loggers[dest_count]->backlog_file = backlog_file;
+				backlog_file = NULL;
+
+				/* Register with reader */
+				rd->add_buffer(rd, buffers[dest_count]);
+				dest_count++;
 				break;
 
 			case 'b':
-				/* Set backlog file */
-				ld->backlog_file = strdup(optarg);
-				if (ld->backlog_file == NULL)
+				/* Set backlog file of the last destination, or else the next one */
+				if (backlog_file != NULL)
+				{
+					fprintf(stderr, "Backlog already set!\n");
+					retval = EXIT_FAILURE;
+					goto clean_exit;
+				}
+
+				for (i = 0; i < dest_count; i++)
+				{
+					if (loggers[i]->backlog_file != NULL && strcmp(loggers[i]->backlog_file, optarg) == 0)
+					{
+						fprintf(stderr, "Backlog file is already used by another destination!\n");
+						retval = EXIT_FAILURE;
+						goto clean_exit;
+					}
+				}
+
+				backlog_file = strdup(optarg);
+				if (backlog_file == NULL)
 				{
 					perror("String duplication failed");
 					retval = EXIT_FAILURE;
 					goto clean_exit;
 				}
+
+				if (dest_count > 0 && loggers[dest_count - 1]->backlog_file == NULL)
+				{
+					loggers[dest_count - 1]->backlog_file = backlog_file;
+					backlog_file = NULL;
+				}
+				break;
+
+			case 'O':
+				/* Add an option for the next source or destination */
+				if (opts == NULL)
+					opts = options_init();
+
+				if (! options_add(opts, optarg))
+				{
+					fprintf(stderr, "Option should look like <name>=<value>: %s\n", optarg);
+					retval = EXIT_FAILURE;
+					goto clean_exit;
+				}
+				break;
+
+			case 'c':
+				/* Control socket */
+				control_path = optarg;
+				break;
+
+			case 't':
+				/* Seconds to deliver what's queued on shutdown, before it's spilled */
+				shutdown_timeout = strtol(optarg, &end, 10);
+				if (*optarg == '\0' || *end != '\0' || shutdown_timeout < 0)
+				{
+					fprintf(stderr, "Invalid shutdown timeout: %s\n", optarg);
+					retval = EXIT_FAILURE;
+					goto clean_exit;
+				}
+				break;
+
+			case 'w':
+				/* Write-ahead log, messages are queued once they're in it */
+				if (wal != NULL)
+				{
+					fprintf(stderr, "Write-ahead log already set!\n");
+					retval = EXIT_FAILURE;
+					goto clean_exit;
+				}
+
+				journal_config_init(&journal_config, opts);
+				if (options_unused(opts) != NULL)
+				{
+					fprintf(stderr, "Unknown option for write-ahead log: %s\n", options_unused(opts));
+					retval = EXIT_FAILURE;
+					goto clean_exit;
+				}
+				options_cleanup(opts);
+				opts = NULL;
+
+				wal = journal_open(optarg, &journal_config);
+				rd->set_wal(rd, wal);
 				break;
 
 			case 'p':
@@ -287,7 +639,9 @@ int main (int argc, char **argv)
 					goto clean_exit;
 				}
 
-				check_for_old_pidfile(pidfile);
+				/* The old process is still there during an upgrade */
+				if (! upgrading)
+					check_for_old_pidfile(pidfile);
 
 				FILE *pidfd = fopen(pidfile, "w");
 				if (pidfd == NULL)
@@ -320,11 +674,39 @@ int main (int argc, char **argv)
 						"-h(elp)\n"
 						"\t-v(erbose)\n"
 						"\t-p(idfile) <file>\n"
-						"\t[-in  <type> -s((ou)rc(e))      <res>]+\n"
-						"\t[-out <type> -d((e)st(ination)) <res>]\n"
+						"\t-c(ontrol) <socket>\n"
+						"\t-t(imeout) <seconds> (on shutdown, to deliver what's queued)\n"
+						"\tSIGUSR2 starts the binary again, and hands over to it without a restart\n"
+						"\t[-O(ption) <name>=<value>]* -w(al) <file>\n"
+						"\t[-in  <type> [-O(ption) <name>=<value>]* -s((ou)rc(e))      <res>]+\n"
+						"\t[-out <type> [-O(ption) <name>=<value>]* -d((e)st(ination)) <res> [-b(acklog) <file>]]+\n"
 						"\n"
-						"\t<type>=file/udp/tcp/unix\n"
-						"\t<res>=filename/host:port\n",
+						"\t<type>=file/udp/tcp/unix/pool/failover\n"
+						"\t<res>=filename/host:port/socketpath/host:port,host:port,..\n"
+						"\n"
+						"\ttcp options: connections=<n>, assign=source/hash, hash-field=<n>,\n"
+						"\t             compress=none/zlib, compress-level=auto/<0-9>,\n"
+						"\t             protocol=plain/relay (one connection), window=<frames>, ack-timeout=<ms>, max-attempts=<n>,\n"
+						"\t             batching=kernel/nodelay/cork, send-buffer=<n>, user-timeout=<ms>,\n"
+						"\t             zerocopy=<min batch bytes>, dns-ttl=<seconds>\n"
+						"\ttcp source options: compress=none/zlib, protocol=plain/relay\n"
+						"\tfile options: sync=none/interval/bytes/batch, sync-interval=<ms>, sync-bytes=<n>,\n"
+						"\t              buffer-size=<n>, preallocate=<n>, rotate-size=<n>,\n"
+						"\t              rotate-interval=<seconds>, rotate-compress=none/gzip\n"
+						"\ttcp and unix options: reconnect-first=<ms>, reconnect-delay=<ms>, reconnect-max=<ms>\n"
+						"\ttcp and file options: engine=write/uring, uring-depth=<buffers>, uring-buffer=<n>\n"
+						"\trelay and unix options: dead-letter=<file>\n"
+						"\tdestination options: byte-rate=<n/s>, byte-burst=<n>, msg-rate=<n/s>, msg-burst=<n>,\n"
+						"\t                     segment-size=<n>, read-ahead=<n>, memory-limit=<n>,\n"
+						"\t                     replay=strict/live-first/interleave, replay-share=<percent>,\n"
+						"\t                     backlog-size=<n>, backlog-age=<seconds>, backlog-min-free=<n>,\n"
+						"\t                     backlog-policy=drop-oldest/drop-newest/block,\n"
+						"\t                     backlog-sync=none/interval/commit, backlog-sync-interval=<ms>\n"
+						"\twal options: segment-size=<n>, read-ahead=<n>,\n"
+						"\t             backlog-sync=none/interval/commit, backlog-sync-interval=<ms>\n"
+						"\tpool options: balance=rr/least-bytes/hash, hash-field=<n>\n"
+						"\tfailover options: failure-threshold=<n>, probe-interval=<ms>, probe-timeout=<ms>,\n"
+						"\t                  write-timeout=<ms>\n",
 					argv[0]);
 				retval = EXIT_FAILURE;
 				goto clean_exit;
@@ -342,21 +724,44 @@ int main (int argc, char **argv)
 		}
 	}
 
+	/* Check if we've got somewhere to log to */
+	if (dest_count == 0)
+	{
+		fprintf(stderr, "No destination specified!\n");
+		retval = EXIT_FAILURE;
+		goto clean_exit;
+	}
+
+	if (backlog_file != NULL || opts != NULL)
+	{
+		fprintf(stderr, "Backlog or options specified without a destination!\n");
+		retval = EXIT_FAILURE;
+		goto clean_exit;
+	}
+
+	/* Take over from the old process */
+	if (upgrading)
+		upgrade_finish(rd, buffers, dest_count);
+
 	/* Run main program loop */
-	run(rd, ld);
+	run(rd, loggers, dest_count, control_path, wal, shutdown_timeout);
 
 	/* Do some cleanups */
 	free(in_res);
-	free(out_res);
 
 	/* Cleanup some last things */
-	buffer_cleanup(buffer);
+	for (i = 0; i < dest_count; i++)
+	{
+		buffer_cleanup(buffers[i]);
+		free(out_res[i]);
+	}
 
 	/* All went well, exit */
 	Log(critical, "Program finished succesfully..");
 
 clean_exit:
-	if (pidfile != NULL)
+	/* After an upgrade, the pidfile is the new process' */
+	if (pidfile != NULL && ! upgraded)
 	{
 		if (unlink(pidfile) == -1)
 		{
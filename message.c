@@ -0,0 +1,84 @@
+#include "defines.h"
+#include "message.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+
+#include "log.h"
+
+#define HEADER(msg)	((struct message*) ((msg) - offsetof(struct message, data)))
+#define CHEADER(msg)	((const struct message*) ((msg) - offsetof(struct message, data)))
+
+char *message_alloc (size_t size)
+{
+	struct message *retval;
+
+	/* Claim memory for header and message */
+	retval = (struct message*) malloc (sizeof(struct message) + size);
+	if (retval == NULL)
+		return NULL;
+
+	/* Whoever allocates, holds the first reference */
+	retval->refs   = 1;
+	retval->source = 0;
+	retval->seq    = 0;
+
+	return retval->data;
+}
+
+char *message_replay (struct message *header, long long seq)
+{
+	/* The journal holds the only reference, and frees it itself */
+	header->refs   = 1;
+	header->source = MESSAGE_REPLAYED;
+	header->seq    = seq;
+
+	return header->data;
+}
+
+int message_replayed (const char *msg)
+{
+	return CHEADER(msg)->source == MESSAGE_REPLAYED;
+}
+
+void message_ref (char *msg, int refs)
+{
+	Require(msg != NULL && refs >= 0 && ! message_replayed(msg));
+
+	__sync_add_and_fetch(&HEADER(msg)->refs, refs);
+}
+
+void message_free (char *msg)
+{
+	/* Like free(), NULL is fine */
+	if (msg == NULL)
+		return;
+	Require(! message_replayed(msg));
+
+	/* Release the memory once the last reference is gone */
+	if (__sync_sub_and_fetch(&HEADER(msg)->refs, 1) == 0)
+		free(HEADER(msg));
+}
+
+void message_set_source (char *msg, int source)
+{
+	HEADER(msg)->source = source;
+}
+
+int message_source (const char *msg)
+{
+	Require(! message_replayed(msg));
+	return CHEADER(msg)->source;
+}
+
+void message_set_seq (char *msg, long long seq)
+{
+	HEADER(msg)->seq = seq;
+}
+
+long long message_seq (const char *msg)
+{
+	Require(! message_replayed(msg));
+	return CHEADER(msg)->seq;
+}
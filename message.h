@@ -0,0 +1,42 @@
+#ifndef GENCACHE_MESSAGE_H
+#define GENCACHE_MESSAGE_H
+
+#include <stddef.h>
+
+/** Shared message store
+ *
+ * Messages are allocated once by the input side and referenced by every
+ * destination queue they are pushed on. The string handed out points just
+ * past a small header holding the reference count, so it can be used as
+ * a plain C string everywhere else. The last message_free() releases it.
+ * The header also remembers which input source the message came from,
+ * and its position in the write-ahead log if there is one.
+ *
+ * Records replayed from a journal carry a header of their own, but it
+ * belongs to the journal: their source is long gone, so they are marked
+ * MESSAGE_REPLAYED, and they're neither referenced nor freed like the
+ * others. Asking them for their source or position is a bug.
+ */
+struct message {
+	int  refs;
+	int  source;
+	long long seq;
+	char data[];
+};
+
+/* Source of a record replayed from a journal */
+#define MESSAGE_REPLAYED	(-1)
+
+extern char *message_alloc (size_t size);
+extern char *message_replay (struct message *header, long long seq);
+extern int   message_replayed (const char *msg);
+extern void  message_ref   (char *msg, int refs);
+extern void  message_free  (char *msg);
+
+extern void  message_set_source (char *msg, int source);
+extern int   message_source     (const char *msg);
+
+extern void      message_set_seq (char *msg, long long seq);
+extern long long message_seq     (const char *msg);
+
+#endif /* GENCACHE_MESSAGE_H */
@@ -5,6 +5,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -12,9 +13,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "log.h"
 
+/* The resolver's result buffer is shared by all threads */
+static pthread_mutex_t lookup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static int parse_resource_spec(char **ipaddr, int *port, char *res)
 {
 	char *offset;
@@ -55,18 +60,21 @@ int net_get_socketaddr (struct sockaddr_in *addr, char *res)
 	addr->sin_port = htons(port);
 	if (ipaddr != NULL)
 	{
+		pthread_mutex_lock(&lookup_mutex);
 		lookup = gethostbyname2(ipaddr, AF_INET);
-		if (lookup == NULL)
-		{
-			Log2(error, hstrerror(h_errno), "On input ip lookup");
-		}
-		if (lookup->h_addr_list[0] == NULL || lookup->h_length != 4)
+		if (lookup == NULL || lookup->h_addr_list[0] == NULL || lookup->h_length != 4)
 		{
-			SysErr(errno, "On resolving ip-address");
+			if (lookup == NULL)
+				Log2(error, hstrerror(h_errno), "On input ip lookup");
+			else
+				SysErr(errno, "On resolving ip-address");
+			pthread_mutex_unlock(&lookup_mutex);
+			free(ipaddr);
 			addr->sin_addr.s_addr = INADDR_ANY;
 			return FALSE;
 		}
 		addr->sin_addr.s_addr = ((u_int32_t*) lookup->h_addr_list[0])[0];
+		pthread_mutex_unlock(&lookup_mutex);
 
 		free(ipaddr);
 	}
@@ -96,7 +104,7 @@ int net_create_listening_socket (char *res, char *proto, int protocol)
 	int fd, sockop;
 	
 	Require(net_get_socketaddr(&addr, res));
-	fd = net_create_socket(protocol, proto);
+	fd = net_create_socket(PF_INET, protocol, proto);
 	
 	SysFatal(bind(fd, &addr, sizeof(struct sockaddr_in)) == -1, errno, "On socket bind");
 
@@ -108,7 +116,7 @@ int net_create_listening_socket (char *res, char *proto, int protocol)
 	return fd;
 }
 
-int net_create_socket (int protocol, char *proto)
+int net_create_socket (int family, int protocol, char *proto)
 {
 	int socktype = 0;
 	int fd, sockop;
@@ -122,7 +130,7 @@ int net_create_socket (int protocol, char *proto)
 		Fatal(TRUE, "Unkown internal usage of protocol specification", "IMPOSSIBLE");
 	
 	/* Create socket */
-	SysFatal((fd = socket(PF_INET, socktype, protocol)) == -1, errno, "On socket create");
+	SysFatal((fd = socket(family, socktype, protocol)) == -1, errno, "On socket create");
 
 	/* Set SO_KEEPALIVE and SO_REUSEADDR on socket */
 	sockop = 1;
@@ -131,3 +139,70 @@ int net_create_socket (int protocol, char *proto)
 
 	return fd;
 }
+
+void net_tuning_init (struct net_tuning *tuning, struct options *opts)
+{
+	char *batching = options_get(opts, "batching", "kernel");
+
+	if (strcasecmp(batching, "kernel") == 0)
+		tuning->batching = net_batching_kernel;
+	else if (strcasecmp(batching, "nodelay") == 0)
+		tuning->batching = net_batching_nodelay;
+	else if (strcasecmp(batching, "cork") == 0)
+		tuning->batching = net_batching_cork;
+	else
+	{
+		fprintf(stderr, "Unknown batching: %s\n", batching);
+		exit(EXIT_FAILURE);
+	}
+
+	tuning->sndbuf       = options_get_long(opts, "send-buffer", 0);
+	tuning->user_timeout = options_get_long(opts, "user-timeout", 0);
+	if (tuning->sndbuf < 0 || tuning->user_timeout < 0)
+	{
+		fprintf(stderr, "Invalid send-buffer or user-timeout\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+int net_tune_socket (int fd, struct net_tuning *tuning)
+{
+	int sockop, ret = TRUE;
+
+	/* None of this is fatal, the connection just keeps the kernel's defaults */
+	sockop = 1;
+	if (tuning->batching == net_batching_nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &sockop, sizeof(sockop)) == -1)
+	{
+		SysErr(errno, "On setting socket option TCP_NODELAY");
+		ret = FALSE;
+	}
+
+	/* The kernel doubles it for bookkeeping, and caps it at wmem_max */
+	sockop = tuning->sndbuf;
+	if (sockop > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sockop, sizeof(sockop)) == -1)
+	{
+		SysErr(errno, "On setting socket option SO_SNDBUF");
+		ret = FALSE;
+	}
+
+	sockop = tuning->user_timeout;
+	if (sockop > 0 && setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &sockop, sizeof(sockop)) == -1)
+	{
+		SysErr(errno, "On setting socket option TCP_USER_TIMEOUT");
+		ret = FALSE;
+	}
+
+	return ret;
+}
+
+int net_set_cork (int fd, int on)
+{
+	/* Uncorking sends out whatever was held back */
+	if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == -1)
+	{
+		SysErr(errno, "On setting socket option TCP_CORK");
+		return FALSE;
+	}
+
+	return TRUE;
+}
@@ -6,9 +6,34 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include "options.h"
+
+/* How writes are put into segments */
+enum net_batching {
+	net_batching_kernel,	/* Whatever the kernel does by default */
+	net_batching_nodelay,	/* TCP_NODELAY, every write goes out right away */
+	net_batching_cork	/* TCP_CORK, held back until the batch is written */
+};
+
+/** Send side tuning of a TCP socket
+ *
+ * Taken from the options of a destination (batching, send-buffer and
+ * user-timeout), so every link can be tuned for latency or throughput.
+ * Zero means the kernel default.
+ */
+struct net_tuning {
+	enum net_batching batching;
+	int sndbuf;
+	int user_timeout;	/* Milliseconds unacknowledged data may linger before the peer is given up */
+};
+
 extern int net_get_socketaddr (struct sockaddr_in *addr, char *res);
 extern int net_create_listening_socket (char *res, char *proto, int protocol);
 extern int net_get_protocol (char *proto);
-extern int net_create_socket (int protocol, char *proto);
+extern int net_create_socket (int family, int protocol, char *proto);
+
+extern void net_tuning_init (struct net_tuning *tuning, struct options *opts);
+extern int  net_tune_socket (int fd, struct net_tuning *tuning);
+extern int  net_set_cork    (int fd, int on);
 
 #endif /* GENCACHE_NET_TOOLS_H */
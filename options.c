@@ -1,2 +1,135 @@
 #include "defines.h"
 #include "options.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "log.h"
+
+struct options *options_init ()
+{
+	struct options *this = (struct options*) malloc (sizeof(struct options));
+
+	SysFatal(this == NULL, errno, "On options structure allocation");
+
+	this->count = 0;
+	this->pairs = NULL;
+
+	return this;
+}
+
+int options_add (struct options *this, const char *spec)
+{
+	char *split;
+	void *tmp;
+
+	Require(this != NULL && spec != NULL);
+
+	/* Options are given as <name>=<value> */
+	split = strchr(spec, '=');
+	if (split == NULL || split == spec)
+		return FALSE;
+
+	tmp = realloc(this->pairs, (this->count + 1) * sizeof(struct options_pair));
+	SysFatal(tmp == NULL, errno, "On options reallocation");
+	this->pairs = (struct options_pair*) tmp;
+
+	this->pairs[this->count].name  = strndup(spec, split - spec);
+	this->pairs[this->count].value = strdup(split + 1);
+	this->pairs[this->count].used  = FALSE;
+	SysFatal(this->pairs[this->count].name == NULL || this->pairs[this->count].value == NULL, errno, "On option duplication");
+
+	this->count++;
+	return TRUE;
+}
+
+char *options_get (struct options *this, const char *name, char *def)
+{
+	int i;
+
+	/* No options at all is fine */
+	if (this == NULL)
+		return def;
+
+	/* The last one given wins */
+	for (i = this->count - 1; i >= 0; i--)
+	{
+		if (strcmp(this->pairs[i].name, name) == 0)
+		{
+			this->pairs[i].used = TRUE;
+			return this->pairs[i].value;
+		}
+	}
+
+	return def;
+}
+
+int options_parse_long (const char *value, long *result)
+{
+	char *end;
+
+	/* Allow for k/m/g suffixes on sizes */
+	*result = strtol(value, &end, 0);
+	switch (*end)
+	{
+		case 'g': case 'G': *result *= 1024;
+		case 'm': case 'M': *result *= 1024;
+		case 'k': case 'K': *result *= 1024;
+			end++;
+	}
+
+	return end != value && *end == '\0';
+}
+
+long options_get_long (struct options *this, const char *name, long def)
+{
+	char *value;
+	long retval;
+
+	value = options_get(this, name, NULL);
+	if (value == NULL)
+		return def;
+
+	if (! options_parse_long(value, &retval))
+	{
+		fprintf(stderr, "Invalid value for option %s: %s\n", name, value);
+		exit(EXIT_FAILURE);
+	}
+
+	return retval;
+}
+
+char *options_unused (struct options *this)
+{
+	int i;
+
+	if (this == NULL)
+		return NULL;
+
+	for (i = 0; i < this->count; i++)
+	{
+		if (! this->pairs[i].used)
+			return this->pairs[i].name;
+	}
+
+	return NULL;
+}
+
+void options_cleanup (struct options *this)
+{
+	int i;
+
+	if (this == NULL)
+		return;
+
+	for (i = 0; i < this->count; i++)
+	{
+		free(this->pairs[i].name);
+		free(this->pairs[i].value);
+	}
+
+	free(this->pairs);
+	free(this);
+}
@@ -3,4 +3,28 @@
 
 #include "types.h"
 
+/** Module options
+ *
+ * Set on the command line with -O <name>=<value>, they apply to the next
+ * source or destination. Modules look them up while initializing and copy what they
+ * need, every option has to be claimed by some module.
+ */
+struct options {
+	int count;
+
+	struct options_pair {
+		char *name;
+		char *value;
+		int   used;
+	} *pairs;
+};
+
+extern struct options *options_init ();
+extern int   options_add      (struct options*, const char *spec);
+extern char *options_get      (struct options*, const char *name, char *def);
+extern long  options_get_long (struct options*, const char *name, long def);
+extern int   options_parse_long (const char *value, long *result);
+extern char *options_unused   (struct options*);
+extern void  options_cleanup  (struct options*);
+
 #endif /* GENCACHE_OPTIONS_H */
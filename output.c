@@ -1,53 +1,206 @@
+#include "defines.h"
 #include "output.h"
 
 #include <sys/select.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 #include <errno.h>
 
+#include "options.h"
 #include "log.h"
 
+/* Default reconnect schedule, in milliseconds */
+#define OUTPUT_RECONNECT_FIRST	10
+#define OUTPUT_RECONNECT_DELAY	100
+#define OUTPUT_RECONNECT_MAX	30000
+
+/* Waits are cut in slices of this many ms, to notice a shutdown deadline */
+#define OUTPUT_DEADLINE_CHECK	250
+
+/* Monotonic milliseconds after which deliveries give up, 0 for never */
+static long long output_deadline = 0;
+
+long long output_now ()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void output_shutdown (long timeout)
+{
+	__sync_lock_test_and_set(&output_deadline, output_now() + timeout);
+}
+
+int output_expired ()
+{
+	long long deadline = __sync_add_and_fetch(&output_deadline, 0);
+
+	return deadline != 0 && output_now() >= deadline;
+}
+
+/* Milliseconds of the next slice of a wait until then, 0 once it's over */
+long output_slice (long long until)
+{
+	long long deadline = __sync_add_and_fetch(&output_deadline, 0);
+
+	if (deadline != 0 && deadline < until)
+		until = deadline;
+	return MIN(MAX(until - output_now(), 0), OUTPUT_DEADLINE_CHECK);
+}
+
+void output_backoff_init (struct output_handler *handler, struct options *opts)
+{
+	struct output_backoff *backoff = &handler->backoff;
+
+	backoff->first    = options_get_long(opts, "reconnect-first", OUTPUT_RECONNECT_FIRST);
+	backoff->delay    = options_get_long(opts, "reconnect-delay", OUTPUT_RECONNECT_DELAY);
+	backoff->max      = options_get_long(opts, "reconnect-max", OUTPUT_RECONNECT_MAX);
+	backoff->attempts = 0;
+	backoff->seed     = time(NULL) ^ getpid() ^ (unsigned long) handler;
+	clock_gettime(CLOCK_MONOTONIC, &backoff->next);
+
+	if (backoff->first < 0 || backoff->delay < 1 || backoff->max < backoff->delay)
+	{
+		fprintf(stderr, "Invalid reconnect-first, reconnect-delay or reconnect-max for %s\n", handler->res);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void output_backoff_failed (struct output_handler *handler)
+{
+	struct output_backoff *backoff = &handler->backoff;
+	long wait;
+	int i;
+
+	/* Fast first, then doubling up to the cap */
+	backoff->attempts++;
+	if (backoff->attempts == 1)
+		wait = backoff->first;
+	else
+	{
+		wait = backoff->delay;
+		for (i = 2; i < backoff->attempts && wait < backoff->max; i++)
+			wait *= 2;
+		wait = MIN(wait, backoff->max);
+	}
+
+	/* Somewhere between half and all of it */
+	if (wait > 1)
+		wait = wait / 2 + rand_r(&backoff->seed) % (wait - wait / 2 + 1);
+
+	if (backoff->attempts > 1)
+		CustomLog(__FILE__, __LINE__, warning, "Reconnecting to %s in %ld ms (attempt %d)", handler->res, wait, backoff->attempts);
+
+	clock_gettime(CLOCK_MONOTONIC, &backoff->next);
+	backoff->next.tv_sec  += wait / 1000;
+	backoff->next.tv_nsec += (wait % 1000) * 1000000;
+	if (backoff->next.tv_nsec >= 1000000000)
+	{
+		backoff->next.tv_sec++;
+		backoff->next.tv_nsec -= 1000000000;
+	}
+}
+
+void output_backoff_wait (struct output_handler *handler)
+{
+	struct timespec *next = &handler->backoff.next;
+	struct timespec slice;
+	long wait;
+
+	/* Sleep until then, or until a shutdown deadline */
+	while ((wait = output_slice((long long) next->tv_sec * 1000 + (next->tv_nsec + 999999) / 1000000)) > 0)
+	{
+		slice.tv_sec  = wait / 1000;
+		slice.tv_nsec = (wait % 1000) * 1000000;
+		nanosleep(&slice, NULL);
+	}
+}
+
+void output_backoff_reset (struct output_handler *handler)
+{
+	if (handler->backoff.attempts > 0)
+		CustomLog(__FILE__, __LINE__, info, "Connection to %s is back after %d failed attempts", handler->res, handler->backoff.attempts);
+
+	handler->backoff.attempts = 0;
+}
+
 int deliver_message (struct output_handler *handler, char *msg)
+{
+	struct output_batch batch;
+	int msglen;
+
+	/* Wrap the message in a batch of one */
+	msglen = strlen(msg);
+	batch.msgs   = &msg;
+	batch.lens   = &msglen;
+	batch.count  = 1;
+	batch.done   = 0;
+	batch.offset = 0;
+
+	return deliver_batch(handler, &batch);
+}
+
+int deliver_batch (struct output_handler *handler, struct output_batch *batch)
 {
 	struct timeval timeout;
-	int todo, retry, msglen, s;
+	long long limit;
+	long wait;
+	int retry, s;
 	fd_set fds;
 
+	/* Composite destinations take care of delivery themselves */
+	if (handler->deliver != NULL)
+		return handler->deliver(handler, batch);
+
 	/* Initialize variables */
-	FD_ZERO(&fds);
-	todo = msglen = strlen(msg);
 	retry = handler->retry;
 
-	/* Try to send the message with reasonable effort */
+	/* Try to send the batch with reasonable effort */
 	while (retry > 0)
 	{
-		/* If not connected, connect */
-		if (handler->state == os_disconnected)
+		/* Shutting down, and out of time */
+		if (output_expired())
 		{
-			handler->connect(handler);
+			Log2(warning, "Shutdown deadline passed, giving up delivery", "[output.c]{deliver_batch}");
+			return 0;
 		}
 
-		/* If valid filedescriptor, listen for signals */
-		if (handler->fd != -1)
+		/* If not connected, connect once the backoff allows it */
+		if (handler->state == os_disconnected)
 		{
-			/* Add the handler's fd to the watchlist */
-			FD_SET(handler->fd, &fds);
+			output_backoff_wait(handler);
+			handler->connect(handler);
 		}
-		
-		/* Set maximum timeout */
-		timeout.tv_sec  = 30;
-		timeout.tv_usec = 0;
-
-		/* Perform select */
-		if (handler->state == os_ready || handler->state == os_sending)
-			s = select(handler->fd + 1, NULL, &fds, NULL, &timeout);
-		else
+
+		/* Perform select for at most 30 seconds, a pending connect shows up as writable too */
+		limit = output_now() + 30000;
+		do
 		{
-			timeout.tv_sec = 5;
-			s = select(0, NULL, NULL, NULL, &timeout);
+			/* If valid filedescriptor, listen for signals */
+			FD_ZERO(&fds);
+			if (handler->fd != -1)
+			{
+				/* Add the handler's fd to the watchlist */
+				FD_SET(handler->fd, &fds);
+			}
+
+			/* In slices, a shutdown deadline may cut it short */
+			wait = output_slice(limit);
+			timeout.tv_sec  = wait / 1000;
+			timeout.tv_usec = (wait % 1000) * 1000;
+
+			if (handler->state == os_ready || handler->state == os_sending || handler->state == os_connecting)
+				s = select(handler->fd + 1, NULL, &fds, NULL, &timeout);
+			else
+				s = 1;	/* Nothing to wait for, the error is dealt with below */
 		}
+		while (s == 0 && wait > 0);
 		
 		/* Determine select status */
 		switch(s)
@@ -59,13 +212,20 @@ int deliver_message (struct output_handler *handler, char *msg)
 
 			/* Timeout occured */
 			case 0:
-				Log2(warning, "Output handling timeout", "[output.c]{deliver_message}");
+				Log2(warning, "Output handling timeout", "[output.c]{deliver_batch}");
 				retry--;
+
+				/* A connect that takes this long counts as a failed attempt */
+				if (handler->state == os_connecting)
+				{
+					handler->err   = ETIMEDOUT;
+					handler->state = os_error;
+				}
 				break;
 
 			/* Activity on filedescriptor */
 			default:
-				Log2(warning, "Output is active", "[output.c]{deliver_message}");
+				Log2(warning, "Output is active", "[output.c]{deliver_batch}");
 				switch (handler->state)
 				{
 					/* Try to connect */
@@ -80,14 +240,15 @@ int deliver_message (struct output_handler *handler, char *msg)
 						handler->connect(handler);
 						break;
 					
-					/* Try to send the message */
+					/* Try to send the batch */
 					case os_ready:
 					case os_sending:
-						retry = 3;
-						CustomLog(__FILE__, __LINE__, warning, "Trying to send message(msg=%p, msglen=%d, cont=%p)!", msg, msglen, todo);
-						if (FD_ISSET(handler->fd, &fds) && handler->write(handler, msg, msglen, &todo))
+						retry = handler->retry;
+						CustomLog(__FILE__, __LINE__, warning, "Trying to send batch(count=%d, done=%d, offset=%d)!", batch->count, batch->done, batch->offset);
+						if (FD_ISSET(handler->fd, &fds) && handler->writev(handler, batch))
 						{
 							/* Write succesfully completed */
+							output_backoff_reset(handler);
 							return 1;
 						}
 						break;
@@ -99,7 +260,7 @@ int deliver_message (struct output_handler *handler, char *msg)
 						
 					/* Impossible */
 					default:
-						Log2(impossible, "IMPOSSIBLE state", "[output.c]{deliver_message}");
+						Log2(impossible, "IMPOSSIBLE state", "[output.c]{deliver_batch}");
 						return 0;
 				}
 
@@ -110,9 +271,13 @@ int deliver_message (struct output_handler *handler, char *msg)
 		/* If we're in error state, disconnect */
 		if (handler->state == os_error)
 		{
-			/* SysErr(handler->err, "[output.c]{deliver_message} Handler is in an error state"); */
+			/* SysErr(handler->err, "[output.c]{deliver_batch} Handler is in an error state"); */
 			handler->disconnect(handler);
+			output_backoff_failed(handler);
 			retry --;
+
+			/* A partially sent message has to be resent as a whole */
+			batch->offset = 0;
 		}
 	}
 
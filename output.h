@@ -1,8 +1,43 @@
 #ifndef GENCACHE_OUTPUT_H
 #define GENCACHE_OUTPUT_H
 
+#include <time.h>
+
 #include "types.h"
 
+struct options;
+
+/** Batch of messages handed to an output handler in one go
+ *
+ * 'done' counts the messages that were sent completely, 'offset' is the
+ * number of bytes of msgs[done] that already went out (streams only).
+ */
+struct output_batch {
+	char **msgs;
+	int   *lens;
+	int    count;
+	int    done;
+	int    offset;
+};
+
+/** Reconnect schedule of a destination
+ *
+ * The first retry after a failure comes quickly (first), the ones after
+ * that back off exponentially from delay up to max. Every wait is
+ * jittered between half and all of it, so a fleet of genbufs doesn't
+ * reconnect in lockstep. A successful write starts the schedule over.
+ * All times are in milliseconds.
+ */
+struct output_backoff {
+	long first;
+	long delay;
+	long max;
+
+	int attempts;		/* Failures in a row */
+	struct timespec next;	/* No connection attempts before this */
+	unsigned int seed;
+};
+
 /** Output Handler module interface
  *
  * Params:
@@ -25,6 +60,7 @@ struct output_handler {
 	int   fd;
 	int   err;
 	int   retry;
+	struct output_backoff backoff;
 	char *res;
 	char *type;
 	void *priv;
@@ -33,9 +69,25 @@ struct output_handler {
 	int   (*disconnect) (struct output_handler*);	/* Disconnect from destination resource */
 	int   (*timeout)    (struct output_handler*);	/* Timeout occured, destination dependant action */
 	int   (*write)      (struct output_handler*, char *str, int strlen, int *send);	/* (Continue?) Send message to destination */
+	int   (*writev)     (struct output_handler*, struct output_batch*);	/* (Continue?) Send batch of messages to destination */
+	int   (*deliver)    (struct output_handler*, struct output_batch*);	/* Optional, composite destinations deliver batches themselves */
+	int   (*flush)      (struct output_handler*);	/* Wait until everything handed over is confirmed by the destination */
+	int   (*pending)    (struct output_handler*);	/* Optional, messages handed over but not confirmed yet, always the newest ones */
+	int   (*reclaim)    (struct output_handler*, struct output_batch*);	/* Optional, hands back the oldest of those and forgets them, 0 once there are none */
 	int   (*cleanup)    (struct output_handler*);	/* Tidy up */
 };
 
 extern int deliver_message (struct output_handler*, char *msg);	/* Overall statefull logic processor, easy to use sender :) */
+extern int deliver_batch   (struct output_handler*, struct output_batch*);	/* Same, but for a whole batch of messages */
+
+extern void output_backoff_init   (struct output_handler*, struct options*);	/* Reconnect schedule, from the reconnect-* options */
+extern void output_backoff_failed (struct output_handler*);	/* Connection failed, schedule the next attempt */
+extern void output_backoff_wait   (struct output_handler*);	/* Sleep until the next attempt is due */
+extern void output_backoff_reset  (struct output_handler*);	/* Connection proved itself, retry fast next time */
+
+extern void output_shutdown (long timeout);	/* Deliveries give up timeout ms from now, for a shutdown */
+extern int  output_expired  ();	/* Whether that deadline passed */
+extern long long output_now ();	/* Monotonic milliseconds */
+extern long output_slice    (long long until);	/* Milliseconds of the next slice of a wait until then, 0 once it or the deadline passed */
 
 #endif /* GENCACHE_OUTPUT_H */
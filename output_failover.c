@@ -0,0 +1,355 @@
+#include "defines.h"
+#include "output_failover.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "resolver.h"
+#include "output_tcp.h"
+#include "output_tools.h"
+#include "log.h"
+
+/* Circuit breaker states */
+enum breaker_state {
+	breaker_closed,		/* Member is healthy, gets traffic */
+	breaker_open,		/* Member failed, only the prober talks to it */
+	breaker_half_open	/* Prober got through, next batch decides */
+};
+
+struct failover_member {
+	struct output_handler *handler;
+	enum breaker_state breaker;
+	int failures;
+};
+
+#define PRIVATE ((struct priv*) this->priv)
+struct priv {
+	int threshold;		/* Consecutive failures that open the breaker */
+	int probe_interval;	/* Milliseconds between health probes */
+	int probe_timeout;	/* Milliseconds a probe, or a member's connect, may take */
+	int write_timeout;	/* Milliseconds a member may stall a batch */
+	int current;		/* Member that got the last batch */
+
+	int member_count;
+	struct failover_member *members;
+
+	/* Health prober */
+	int running;
+	pthread_t prober;
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+};
+
+static void failover_success (struct output_handler *this, int m)
+{
+	pthread_mutex_lock(&PRIVATE->mutex);
+	if (PRIVATE->members[m].breaker != breaker_closed)
+		CustomLog(__FILE__, __LINE__, warning, "Failover member %s is back in business", PRIVATE->members[m].handler->res);
+	PRIVATE->members[m].breaker  = breaker_closed;
+	PRIVATE->members[m].failures = 0;
+	pthread_mutex_unlock(&PRIVATE->mutex);
+}
+
+static void failover_failure (struct output_handler *this, int m)
+{
+	struct failover_member *member = &PRIVATE->members[m];
+
+	/* Drop the connection, the prober decides when to try again */
+	if (member->handler->state != os_disconnected)
+		member->handler->disconnect(member->handler);
+
+	pthread_mutex_lock(&PRIVATE->mutex);
+	member->failures++;
+	if (member->breaker == breaker_half_open || member->failures >= PRIVATE->threshold)
+	{
+		CustomLog(__FILE__, __LINE__, warning, "Failover member %s failed, opening its circuit", member->handler->res);
+		member->breaker = breaker_open;
+	}
+	pthread_mutex_unlock(&PRIVATE->mutex);
+
+	/* Wake the prober, it has work to do */
+	pthread_cond_signal(&PRIVATE->cond);
+}
+
+static int failover_pick_member (struct output_handler *this)
+{
+	int m;
+
+	/* The first member (in order of preference) that isn't open */
+	pthread_mutex_lock(&PRIVATE->mutex);
+	for (m = 0; m < PRIVATE->member_count; m++)
+	{
+		if (PRIVATE->members[m].breaker != breaker_open)
+			break;
+	}
+	pthread_mutex_unlock(&PRIVATE->mutex);
+
+	return m < PRIVATE->member_count ? m : -1;
+}
+
+static int failover_probe (struct output_handler *this, char *res)
+{
+	struct sockaddr_storage addr;
+	struct pollfd pfd;
+	socklen_t len;
+	int fd, err;
+
+	if (! resolver_lookup(res, RESOLVER_DEFAULT_TTL, &addr, &len))
+		return FALSE;
+
+	/* Non-blocking connect, with a deadline */
+	fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	if (fd == -1)
+		return FALSE;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	err = 0;
+	if (connect(fd, (struct sockaddr*) &addr, len) == -1)
+	{
+		err = errno;
+		if (err == EINPROGRESS)
+		{
+			pfd.fd     = fd;
+			pfd.events = POLLOUT;
+			len = sizeof(err);
+			if (poll(&pfd, 1, PRIVATE->probe_timeout) != 1 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+				err = ETIMEDOUT;
+		}
+	}
+
+	close(fd);
+	return err == 0;
+}
+
+static void *failover_prober (void *arg)
+{
+	struct output_handler *this = (struct output_handler*) arg;
+	struct timespec deadline;
+	int m, open;
+
+	pthread_mutex_lock(&PRIVATE->mutex);
+	while (PRIVATE->running)
+	{
+		/* Probe members with an open circuit */
+		for (m = 0; m < PRIVATE->member_count && PRIVATE->running; m++)
+		{
+			if (PRIVATE->members[m].breaker != breaker_open)
+				continue;
+
+			pthread_mutex_unlock(&PRIVATE->mutex);
+			open = failover_probe(this, PRIVATE->members[m].handler->res);
+			pthread_mutex_lock(&PRIVATE->mutex);
+
+			/* Let one batch through to see if it really works */
+			if (open && PRIVATE->members[m].breaker == breaker_open)
+			{
+				CustomLog(__FILE__, __LINE__, warning, "Failover member %s answers probes again", PRIVATE->members[m].handler->res);
+				PRIVATE->members[m].breaker = breaker_half_open;
+			}
+		}
+
+		/* Wait for the next round, or until someone fails */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec  += PRIVATE->probe_interval / 1000;
+		deadline.tv_nsec += (PRIVATE->probe_interval % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		if (PRIVATE->running)
+			pthread_cond_timedwait(&PRIVATE->cond, &PRIVATE->mutex, &deadline);
+	}
+	pthread_mutex_unlock(&PRIVATE->mutex);
+
+	return NULL;
+}
+
+static int failover_send (struct output_handler *this, struct output_handler *handler, struct output_batch *batch)
+{
+	struct pollfd pfd;
+
+	/* Connect first, a refused or unanswered connection fails over right away */
+	if (handler->state == os_disconnected)
+		handler->connect(handler);
+
+	pfd.fd     = handler->fd;
+	pfd.events = POLLOUT;
+	if (handler->state == os_connecting && poll(&pfd, 1, PRIVATE->probe_timeout) == 1)
+		handler->connect(handler);
+
+	if (handler->state != os_ready && handler->state != os_sending)
+		return FALSE;
+
+	/* A member that stops taking data is as good as down, there's another one waiting */
+	while (! output_expired())
+	{
+		if (handler->writev(handler, batch))
+			return TRUE;
+		if (handler->state != os_sending)
+			return FALSE;
+
+		pfd.fd = handler->fd;
+		if (poll(&pfd, 1, PRIVATE->write_timeout) == 0)
+		{
+			CustomLog(__FILE__, __LINE__, warning, "Failover member %s stalled for %d ms", handler->res, PRIVATE->write_timeout);
+			return FALSE;
+		}
+	}
+
+	return FALSE;
+}
+
+static int output_failover_deliver (struct output_handler *this, struct output_batch *batch)
+{
+	struct output_handler *handler;
+	int m;
+
+	/* Try members in order of preference until one takes the batch */
+	while ((m = failover_pick_member(this)) != -1)
+	{
+		handler = PRIVATE->members[m].handler;
+
+		if (m != PRIVATE->current)
+		{
+			CustomLog(__FILE__, __LINE__, warning, "Failing over to %s", handler->res);
+			PRIVATE->current = m;
+		}
+
+		if (failover_send(this, handler, batch))
+		{
+			failover_success(this, m);
+			return TRUE;
+		}
+
+		/* A partially sent message has to be resent as a whole */
+		batch->offset = 0;
+		failover_failure(this, m);
+	}
+
+	/* Every circuit is open */
+	Log2(error, "All failover members are down", "[Failover output handler]");
+	return FALSE;
+}
+
+static int output_failover_connect (struct output_handler *this)
+{
+	this->state = os_ready;
+	return TRUE;
+}
+
+static int output_failover_disconnect (struct output_handler *this)
+{
+	int m;
+
+	for (m = 0; m < PRIVATE->member_count; m++)
+	{
+		if (PRIVATE->members[m].handler->state != os_disconnected)
+			PRIVATE->members[m].handler->disconnect(PRIVATE->members[m].handler);
+	}
+
+	this->state = os_disconnected;
+	return TRUE;
+}
+
+static int output_failover_cleanup (struct output_handler *this)
+{
+	char *res;
+	int m;
+
+	/* Stop the prober */
+	pthread_mutex_lock(&PRIVATE->mutex);
+	PRIVATE->running = FALSE;
+	pthread_cond_signal(&PRIVATE->cond);
+	pthread_mutex_unlock(&PRIVATE->mutex);
+	pthread_join(PRIVATE->prober, NULL);
+
+	/* Tidy up the members */
+	for (m = 0; m < PRIVATE->member_count; m++)
+	{
+		/* The member may still use its name while it tidies up */
+		res = PRIVATE->members[m].handler->res;
+		PRIVATE->members[m].handler->cleanup(PRIVATE->members[m].handler);
+		free(res);
+	}
+
+	pthread_mutex_destroy(&PRIVATE->mutex);
+	pthread_cond_destroy(&PRIVATE->cond);
+	free(PRIVATE->members);
+	free(this->priv);
+	this->priv = NULL;
+
+	/* The members are gone already, so just free ourselves */
+	free(this);
+	return TRUE;
+}
+
+struct output_handler *output_handler_failover_init (char *res, struct options *opts)
+{
+	struct output_handler *this = output_handler_common_init("failover", res, -1);
+	char *list, *member, *save;
+
+	/* Allocate private data part */
+	struct priv *private = (struct priv*) calloc (1, sizeof(struct priv));
+	SysFatal(private == NULL, errno, "While creating failover output private data");
+	this->priv = private;
+
+	PRIVATE->threshold      = options_get_long(opts, "failure-threshold", 1);
+	PRIVATE->probe_interval = options_get_long(opts, "probe-interval", 500);
+	PRIVATE->probe_timeout  = options_get_long(opts, "probe-timeout", 200);
+	PRIVATE->write_timeout  = options_get_long(opts, "write-timeout", 1000);
+	PRIVATE->current        = 0;
+
+	if (PRIVATE->probe_timeout < 1 || PRIVATE->write_timeout < 1)
+	{
+		fprintf(stderr, "Invalid probe-timeout or write-timeout for %s\n", res);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Create a TCP output for every host:port, in order of preference */
+	list = strdup(res);
+	SysFatal(list == NULL, errno, "While parsing failover members");
+	for (member = strtok_r(list, ",", &save); member != NULL; member = strtok_r(NULL, ",", &save))
+	{
+		PRIVATE->members = (struct failover_member*) realloc (PRIVATE->members, (PRIVATE->member_count + 1) * sizeof(struct failover_member));
+		SysFatal(PRIVATE->members == NULL, errno, "While adding failover member");
+
+		PRIVATE->members[PRIVATE->member_count].handler  = output_handler_tcp_init(strdup(member), opts);
+		PRIVATE->members[PRIVATE->member_count].breaker  = breaker_closed;
+		PRIVATE->members[PRIVATE->member_count].failures = 0;
+
+		PRIVATE->member_count++;
+	}
+	free(list);
+
+	if (PRIVATE->member_count == 0)
+	{
+		fprintf(stderr, "Failover without members: %s\n", res);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Start probing members */
+	pthread_mutex_init(&PRIVATE->mutex, NULL);
+	pthread_cond_init(&PRIVATE->cond, NULL);
+	PRIVATE->running = TRUE;
+	SysFatal(pthread_create(&PRIVATE->prober, NULL, failover_prober, this), errno, "On failover prober thread start");
+
+	this->state      = os_ready;
+	this->connect    = output_failover_connect;
+	this->disconnect = output_failover_disconnect;
+	this->deliver    = output_failover_deliver;
+	this->cleanup    = output_failover_cleanup;
+
+	return this;
+}
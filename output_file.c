@@ -3,23 +3,279 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <signal.h>
 #include <strings.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
-#include <stdio.h>
+#include <limits.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
 
 #include "output_tools.h"
+#include "output_uring.h"
 #include "log.h"
 
-static int output_file_connect (struct output_handler *this)
+/* When to push written data to disk */
+enum file_sync {
+	sync_none,		/* Leave it to the kernel */
+	sync_interval,		/* fsync when the last one is sync-interval ms ago */
+	sync_bytes,		/* fsync after sync-bytes were written */
+	sync_batch		/* fdatasync after every batch */
+};
+
+/* Rotated files waiting to be compressed */
+struct file_job {
+	char *name;
+	struct file_job *next;
+};
+
+/* Bumped on SIGHUP, every file output rotates when it notices */
+static volatile sig_atomic_t file_rotation = 0;
+
+#define PRIVATE ((struct priv*) this->priv)
+struct priv {
+	/* Batches are collected here and written in one go */
+	char *buf;
+	int   bufsize;
+
+	enum file_sync sync;
+	long  sync_interval;
+	long  sync_bytes;
+	long  unsynced;
+	struct timespec synced;	/* CLOCK_MONOTONIC */
+
+	/* An idle file is synced on the interval from a thread of its own */
+	int    syncing;
+	pthread_t syncer;
+	pthread_cond_t tick;
+
+	/* Guards the file against the syncer */
+	pthread_mutex_t lock;
+
+	/* Space reserved ahead of the end of the file */
+	long  prealloc;
+	off_t size;
+	off_t allocated;
+
+	/* Rotation, by size, time bucket or signal */
+	long   rotate_size;
+	long   rotate_interval;
+	time_t bucket;
+	int    rotation;
+
+	/* Background compression of rotated files */
+	int    compress;
+	int    running;
+	struct file_job *jobs;
+	pthread_t compressor;
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+
+	/* io_uring engine, if asked for */
+	struct output_uring *ring;
+};
+
+void output_file_rotate_all ()
+{
+	/* Called from a signal handler, so just leave a note */
+	file_rotation++;
+}
+
+static void output_file_sync (struct output_handler *this, int force)
+{
+	struct timespec now;
+	int ret;
+
+	if (PRIVATE->unsynced == 0)
+		return;
+
+	switch (PRIVATE->sync)
+	{
+		case sync_none:
+			return;
+
+		case sync_interval:
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (! force && (now.tv_sec - PRIVATE->synced.tv_sec) * 1000 + (now.tv_nsec - PRIVATE->synced.tv_nsec) / 1000000 < PRIVATE->sync_interval)
+				return;
+			break;
+
+		case sync_bytes:
+			if (! force && PRIVATE->unsynced < PRIVATE->sync_bytes)
+				return;
+			break;
+
+		case sync_batch:
+		default:
+			break;
+	}
+
+	/* Queued writes have to land before they can be synced */
+	if (PRIVATE->ring != NULL)
+		output_uring_drain(PRIVATE->ring);
+
+	ret = (PRIVATE->sync == sync_batch ? fdatasync(this->fd) : fsync(this->fd));
+
+	/* Pipes and the like can't be synced, that's fine */
+	if (ret == -1 && errno != EINVAL && errno != EROFS)
+		SysErr(errno, "While syncing output file");
+
+	PRIVATE->unsynced = 0;
+	clock_gettime(CLOCK_MONOTONIC, &PRIVATE->synced);
+}
+
+static void *output_file_syncer (void *arg)
+{
+	struct output_handler *this = (struct output_handler*) arg;
+	struct timespec until;
+
+	/* Writes sync when one is due, the last ones before a pause are synced from here */
+	pthread_mutex_lock(&PRIVATE->lock);
+	while (PRIVATE->syncing)
+	{
+		if (PRIVATE->unsynced == 0 || this->fd == -1)
+		{
+			pthread_cond_wait(&PRIVATE->tick, &PRIVATE->lock);
+			continue;
+		}
+
+		until = PRIVATE->synced;
+		until.tv_sec  += PRIVATE->sync_interval / 1000;
+		until.tv_nsec += (PRIVATE->sync_interval % 1000) * 1000000;
+		if (until.tv_nsec >= 1000000000)
+		{
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+
+		if (pthread_cond_timedwait(&PRIVATE->tick, &PRIVATE->lock, &until) == ETIMEDOUT && this->fd != -1)
+			output_file_sync(this, FALSE);
+	}
+	pthread_mutex_unlock(&PRIVATE->lock);
+
+	return NULL;
+}
+
+static void output_file_preallocate (struct output_handler *this, int len)
+{
+	/* Reserve a big chunk at a time, so appends don't fragment the file */
+	if (PRIVATE->prealloc == 0 || PRIVATE->size + len <= PRIVATE->allocated)
+		return;
+
+	if (fallocate(this->fd, FALLOC_FL_KEEP_SIZE, PRIVATE->allocated, PRIVATE->size + len - PRIVATE->allocated + PRIVATE->prealloc) == -1)
+	{
+		/* Not supported here, don't bother again */
+		SysErr(errno, "While preallocating output file, no longer trying");
+		PRIVATE->prealloc = 0;
+		return;
+	}
+
+	PRIVATE->allocated = PRIVATE->size + len + PRIVATE->prealloc;
+}
+
+static int output_file_gzip (const char *name)
+{
+	char gzname[PATH_MAX], tmpname[PATH_MAX], buf[65536];
+	gzFile out;
+	int fd, len;
+
+	snprintf(gzname, sizeof(gzname), "%s.gz", name);
+	snprintf(tmpname, sizeof(tmpname), "%s.gz.tmp", name);
+
+	if ((fd = open(name, O_RDONLY)) == -1)
+	{
+		SysErr(errno, "While opening rotated file for compression");
+		return FALSE;
+	}
+
+	if ((out = gzopen(tmpname, "wb")) == NULL)
+	{
+		SysErr(errno, "While creating compressed rotated file");
+		close(fd);
+		return FALSE;
+	}
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+	{
+		if (gzwrite(out, buf, len) != len)
+			break;
+	}
+	close(fd);
+
+	/* Only replace the original once the compressed copy is complete */
+	if (gzclose(out) != Z_OK || len != 0 || rename(tmpname, gzname) == -1)
+	{
+		CustomLog(__FILE__, __LINE__, error, "Compressing %s failed, leaving it as is", name);
+		unlink(tmpname);
+		return FALSE;
+	}
+
+	unlink(name);
+	return TRUE;
+}
+
+static void *output_file_compressor (void *arg)
+{
+	struct output_handler *this = (struct output_handler*) arg;
+	struct file_job *job;
+
+	/* Compression is a chore, delivery goes first */
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	pthread_mutex_lock(&PRIVATE->mutex);
+	while (TRUE)
+	{
+		while (PRIVATE->jobs == NULL && PRIVATE->running)
+			pthread_cond_wait(&PRIVATE->cond, &PRIVATE->mutex);
+
+		/* Finish the work that's left before stopping */
+		if ((job = PRIVATE->jobs) == NULL)
+			break;
+		PRIVATE->jobs = job->next;
+
+		pthread_mutex_unlock(&PRIVATE->mutex);
+		output_file_gzip(job->name);
+		free(job->name);
+		free(job);
+		pthread_mutex_lock(&PRIVATE->mutex);
+	}
+	pthread_mutex_unlock(&PRIVATE->mutex);
+
+	return NULL;
+}
+
+static void output_file_queue_compression (struct output_handler *this, char *name)
+{
+	struct file_job *job, **last;
+
+	job = (struct file_job*) malloc (sizeof(struct file_job));
+	SysFatal(job == NULL, errno, "While queueing rotated file for compression");
+	job->name = name;
+	job->next = NULL;
+
+	/* Oldest file first */
+	pthread_mutex_lock(&PRIVATE->mutex);
+	for (last = &PRIVATE->jobs; *last != NULL; last = &(*last)->next)
+		;
+	*last = job;
+	pthread_cond_signal(&PRIVATE->cond);
+	pthread_mutex_unlock(&PRIVATE->mutex);
+}
+
+static int output_file_open (struct output_handler *this)
 {
+	struct stat st;
+
 	/* Check if we're in a valid state */
 	Require(this->state == os_disconnected);
-	
+
 	/* If output is stdout, do nothing */
 	if (this->fd == 1)
 	{
@@ -28,33 +284,53 @@ static int output_file_connect (struct output_handler *this)
 		return TRUE;
 	}
 
-	this->fd = open(this->res, O_WRONLY|O_CREAT|O_APPEND);
+	/* io_uring writes at explicit offsets, which O_APPEND would ignore */
+	this->fd = open(this->res, O_WRONLY|O_CREAT|(PRIVATE->ring != NULL ? 0 : O_APPEND), S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
 
 	/* Check if open succeeded */
 	if (this->fd == -1)
 	{
 		SysErr(errno, "While trying to open output file");
 		this->err = errno;
+		this->state = os_error;
 		return FALSE;
 	}
-	
+
+	/* The file belongs to the current time bucket */
+	if (PRIVATE->rotate_interval > 0)
+		PRIVATE->bucket = time(NULL) / PRIVATE->rotate_interval * PRIVATE->rotate_interval;
+
+	/* Appends go at the end, preallocation starts there too */
+	if (fstat(this->fd, &st) == 0)
+		PRIVATE->size = PRIVATE->allocated = st.st_size;
+	else
+		PRIVATE->prealloc = 0;
+
 	Log2(info, "Using file for output file", "output_file.c{connect}");
-	
+
 	/* All went well */
 	this->state = os_ready;
 	return TRUE;
 }
 
-static int output_file_disconnect (struct output_handler *this)
+static int output_file_close (struct output_handler *this)
 {
 	/* Check if we're in a valid state */
 	Require(
 		this->state == os_connecting ||
 		this->state == os_ready      ||
+		this->state == os_sending    ||
 		this->state == os_error
 	);
 
-	
+	/* Let queued writes finish, what failed is written again after reconnecting */
+	if (this->fd != -1 && PRIVATE->ring != NULL && ! output_uring_drain(PRIVATE->ring))
+		output_uring_resume(PRIVATE->ring);
+
+	/* Whatever the policy, what's written should be on disk now */
+	if (this->fd != -1)
+		output_file_sync(this, TRUE);
+
 	/* If output is stdout, do nothing */
 	if (this->fd == 1)
 	{
@@ -63,30 +339,424 @@ static int output_file_disconnect (struct output_handler *this)
 		return TRUE;
 	}
 
+	/* Give back what was preallocated but not used */
+	if (this->fd != -1 && PRIVATE->allocated > PRIVATE->size && ftruncate(this->fd, PRIVATE->size) == -1)
+		SysErr(errno, "While releasing preallocated space");
+
 	/* Try and close the file */
-	if (close(this->fd) == -1)
+	if (this->fd != -1 && close(this->fd) == -1)
 	{
 		this->fd = -1;
 		this->err = errno;
+		this->state = os_disconnected;
 		SysErr(this->err, "While closing output file");
 		return FALSE;
 	}
-	
+
 	Log2(info, "Closed output file filehandle", "output_file.c:{disconnect}");
-	
+
 	/* All went well */
 	this->fd = -1;
 	this->state = os_disconnected;
 	return TRUE;
 }
 
-struct output_handler *output_handler_file_init (char *res)
+static int output_file_connect (struct output_handler *this)
 {
-	struct output_handler *retval = output_handler_common_init("file", res, (strcmp(res, "-") ? -1 : 1));
-	
-	retval->state      = os_ready;
-	retval->connect    = output_file_connect;
-	retval->disconnect = output_file_disconnect;
+	int retval;
+
+	pthread_mutex_lock(&PRIVATE->lock);
+	retval = output_file_open(this);
+	pthread_mutex_unlock(&PRIVATE->lock);
 
 	return retval;
 }
+
+static int output_file_disconnect (struct output_handler *this)
+{
+	int retval;
+
+	pthread_mutex_lock(&PRIVATE->lock);
+	retval = output_file_close(this);
+	pthread_mutex_unlock(&PRIVATE->lock);
+
+	return retval;
+}
+
+static int output_file_rotate (struct output_handler *this)
+{
+	char stamp[32], gzname[PATH_MAX], *name;
+	struct stat st;
+	struct tm tm;
+	time_t when;
+	int n, len;
+
+	/* Name the old file after its bucket, or the time it was rotated */
+	when = (PRIVATE->rotate_interval > 0 ? PRIVATE->bucket : time(NULL));
+	localtime_r(&when, &tm);
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+
+	len  = strlen(this->res) + sizeof(stamp) + 16;
+	name = (char*) malloc (len);
+	SysFatal(name == NULL, errno, "While naming rotated file");
+
+	/* Never overwrite an earlier rotation (or its compressed version) */
+	snprintf(name, len, "%s.%s", this->res, stamp);
+	for (n = 1; n < 1000; n++)
+	{
+		snprintf(gzname, sizeof(gzname), "%s.gz", name);
+		if (stat(name, &st) == -1 && stat(gzname, &st) == -1)
+			break;
+		snprintf(name, len, "%s.%s.%d", this->res, stamp, n);
+	}
+
+	/* Atomically move the file aside, the writer keeps its descriptor */
+	if (rename(this->res, name) == -1)
+	{
+		SysErr(errno, "While rotating output file");
+		free(name);
+		return FALSE;
+	}
+
+	/* Close the old one and continue in a fresh file */
+	output_file_close(this);
+	output_file_open(this);
+
+	CustomLog(__FILE__, __LINE__, info, "Rotated %s to %s", this->res, name);
+
+	if (PRIVATE->compress)
+		output_file_queue_compression(this, name);
+	else
+		free(name);
+
+	return this->state == os_ready;
+}
+
+static int output_file_want_rotation (struct output_handler *this, int len)
+{
+	/* stdout can't be rotated */
+	if (this->fd == 1)
+		return FALSE;
+
+	/* SIGHUP */
+	if (PRIVATE->rotation != file_rotation)
+	{
+		PRIVATE->rotation = file_rotation;
+		return PRIVATE->size > 0;
+	}
+
+	/* Next time bucket, an empty file just moves on to it */
+	if (PRIVATE->rotate_interval > 0 && time(NULL) / PRIVATE->rotate_interval * PRIVATE->rotate_interval != PRIVATE->bucket)
+	{
+		if (PRIVATE->size > 0)
+			return TRUE;
+		PRIVATE->bucket = time(NULL) / PRIVATE->rotate_interval * PRIVATE->rotate_interval;
+	}
+
+	/* Size limit */
+	return PRIVATE->rotate_size > 0 && PRIVATE->size > 0 && PRIVATE->size + len > PRIVATE->rotate_size;
+}
+
+static int output_file_writev_uring (struct output_handler *this, struct output_batch *batch)
+{
+	off_t size = PRIVATE->size;
+	int i, len;
+
+	len = -batch->offset;
+	for (i = batch->done; i < batch->count; i++)
+		len += batch->lens[i];
+
+	/* Start a new file when this one is done */
+	if (output_file_want_rotation(this, len) && ! output_file_rotate(this))
+	{
+		this->state = os_error;
+		return FALSE;
+	}
+
+	output_file_preallocate(this, len);
+
+	/* The engine takes the whole batch, completions come in later */
+	if (! output_uring_write(PRIVATE->ring, this->fd, batch, (this->fd == 1 ? NULL : &PRIVATE->size), PRIVATE->sync == sync_batch))
+	{
+		this->err = output_uring_error(PRIVATE->ring);
+		SysErr(this->err, "[output_file.c:output_file_writev_uring] While trying to write");
+		this->state = os_error;
+		return FALSE;
+	}
+
+	/* With sync=batch the engine syncs behind every batch itself */
+	if (PRIVATE->sync != sync_batch)
+	{
+		PRIVATE->unsynced += PRIVATE->size - size;
+		output_file_sync(this, FALSE);
+	}
+
+	this->state = os_ready;
+	return TRUE;
+}
+
+static int output_file_write_batch (struct output_handler *this, struct output_batch *batch)
+{
+	int i, offset, len, chunk;
+	ssize_t sent, written;
+
+	/* Check if we're in a valid state */
+	Require(
+		this->state == os_ready   ||
+		this->state == os_sending
+	);
+
+	if (PRIVATE->ring != NULL)
+		return output_file_writev_uring(this, batch);
+
+	errno = 0;
+	while (batch->done < batch->count)
+	{
+		/* Collect as much of the batch as fits in the buffer */
+		len    = 0;
+		offset = batch->offset;
+		for (i = batch->done; i < batch->count && len < PRIVATE->bufsize; i++)
+		{
+			chunk = MIN(batch->lens[i] - offset, PRIVATE->bufsize - len);
+			memcpy(PRIVATE->buf + len, batch->msgs[i] + offset, chunk);
+			len += chunk;
+			offset = 0;
+		}
+
+		/* Start a new file when this one is done */
+		if (output_file_want_rotation(this, len) && ! output_file_rotate(this))
+		{
+			this->state = os_error;
+			return FALSE;
+		}
+
+		output_file_preallocate(this, len);
+
+		/* And write it in one go */
+		written = 0;
+		while (written < len)
+		{
+			sent = write(this->fd, PRIVATE->buf + written, len - written);
+			if (sent == -1 && errno == EINTR)
+				continue;
+			if (sent <= 0)
+				break;
+			written += sent;
+		}
+
+		/* Messages only count once they're written completely */
+		output_batch_advance(batch, written);
+		PRIVATE->size     += written;
+		PRIVATE->unsynced += written;
+
+		if (written < len)
+		{
+			this->err = errno;
+			SysErr(this->err, "[output_file.c:output_file_writev] While trying to write");
+			this->state = (this->err == EAGAIN ? os_sending : os_error);
+			return FALSE;
+		}
+	}
+
+	/* One sync decision per batch */
+	output_file_sync(this, FALSE);
+
+	this->state = os_ready;
+	return TRUE;
+}
+
+static int output_file_writev (struct output_handler *this, struct output_batch *batch)
+{
+	long unsynced;
+	int retval;
+
+	pthread_mutex_lock(&PRIVATE->lock);
+	unsynced = PRIVATE->unsynced;
+	retval   = output_file_write_batch(this, batch);
+
+	/* The syncer waits for something to sync */
+	if (PRIVATE->syncing && unsynced == 0 && PRIVATE->unsynced > 0)
+		pthread_cond_signal(&PRIVATE->tick);
+	pthread_mutex_unlock(&PRIVATE->lock);
+
+	return retval;
+}
+
+static int output_file_write (struct output_handler *this, char *str, int strlen, int *todo)
+{
+	struct output_batch batch;
+
+	/* A single message is just a tiny batch */
+	batch.msgs   = &str;
+	batch.lens   = &strlen;
+	batch.count  = 1;
+	batch.done   = 0;
+	batch.offset = strlen - *todo;
+
+	if (this->writev(this, &batch))
+	{
+		*todo = 0;
+		return TRUE;
+	}
+
+	*todo = strlen - batch.offset;
+	return FALSE;
+}
+
+static int output_file_flush (struct output_handler *this)
+{
+	int retval = TRUE;
+
+	/* Everything queued in the engine has to be written */
+	pthread_mutex_lock(&PRIVATE->lock);
+	if (this->fd != -1)
+		retval = output_uring_drain(PRIVATE->ring);
+	pthread_mutex_unlock(&PRIVATE->lock);
+
+	return retval;
+}
+
+static int output_file_cleanup (struct output_handler *this)
+{
+	/* No more syncs from the side */
+	if (PRIVATE->syncing)
+	{
+		pthread_mutex_lock(&PRIVATE->lock);
+		PRIVATE->syncing = FALSE;
+		pthread_cond_signal(&PRIVATE->tick);
+		pthread_mutex_unlock(&PRIVATE->lock);
+		pthread_join(PRIVATE->syncer, NULL);
+	}
+
+	/* Disconnect while the private data is still around */
+	if (this->state != os_disconnected)
+		this->disconnect(this);
+
+	/* stdout stays open, but we're done with it */
+	this->state = os_disconnected;
+
+	/* Let the compressor finish what's queued */
+	if (PRIVATE->compress)
+	{
+		pthread_mutex_lock(&PRIVATE->mutex);
+		PRIVATE->running = FALSE;
+		pthread_cond_signal(&PRIVATE->cond);
+		pthread_mutex_unlock(&PRIVATE->mutex);
+		pthread_join(PRIVATE->compressor, NULL);
+
+		pthread_mutex_destroy(&PRIVATE->mutex);
+		pthread_cond_destroy(&PRIVATE->cond);
+	}
+
+	pthread_mutex_destroy(&PRIVATE->lock);
+	pthread_cond_destroy(&PRIVATE->tick);
+
+	/* Free private data */
+	output_uring_cleanup(PRIVATE->ring);
+	free(PRIVATE->buf);
+	free(this->priv);
+	this->priv = NULL;
+
+	return output_handler_common_cleanup(this);
+}
+
+struct output_handler *output_handler_file_init (char *res, struct options *opts)
+{
+	struct output_handler *this = output_handler_common_init("file", res, (strcmp(res, "-") ? -1 : 1));
+	pthread_condattr_t attr;
+	char *sync, *compress;
+
+	/* Allocate private data part */
+	struct priv *private = (struct priv*) calloc (1, sizeof(struct priv));
+	SysFatal(private == NULL, errno, "While creating file output private data");
+	this->priv = private;
+
+	/* Determine when to sync */
+	sync = options_get(opts, "sync", "none");
+	if (strcasecmp(sync, "none") == 0)
+		PRIVATE->sync = sync_none;
+	else if (strcasecmp(sync, "interval") == 0)
+		PRIVATE->sync = sync_interval;
+	else if (strcasecmp(sync, "bytes") == 0)
+		PRIVATE->sync = sync_bytes;
+	else if (strcasecmp(sync, "batch") == 0)
+		PRIVATE->sync = sync_batch;
+	else
+	{
+		fprintf(stderr, "Unknown sync policy: %s\n", sync);
+		exit(EXIT_FAILURE);
+	}
+	PRIVATE->sync_interval = options_get_long(opts, "sync-interval", 1000);
+	PRIVATE->sync_bytes    = options_get_long(opts, "sync-bytes", 1024 * 1024);
+	clock_gettime(CLOCK_MONOTONIC, &PRIVATE->synced);
+
+	PRIVATE->bufsize  = options_get_long(opts, "buffer-size", 1024 * 1024);
+	PRIVATE->prealloc = options_get_long(opts, "preallocate", 0);
+	if (PRIVATE->bufsize < 1 || PRIVATE->prealloc < 0)
+	{
+		fprintf(stderr, "Invalid buffer-size or preallocate for %s\n", res);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Rotation settings */
+	PRIVATE->rotate_size     = options_get_long(opts, "rotate-size", 0);
+	PRIVATE->rotate_interval = options_get_long(opts, "rotate-interval", 0);
+	PRIVATE->rotation        = file_rotation;
+	if (PRIVATE->rotate_size < 0 || PRIVATE->rotate_interval < 0)
+	{
+		fprintf(stderr, "Invalid rotate-size or rotate-interval for %s\n", res);
+		exit(EXIT_FAILURE);
+	}
+
+	compress = options_get(opts, "rotate-compress", "none");
+	if (strcasecmp(compress, "gzip") == 0)
+		PRIVATE->compress = TRUE;
+	else if (strcasecmp(compress, "none") == 0)
+		PRIVATE->compress = FALSE;
+	else
+	{
+		fprintf(stderr, "Unknown rotate-compress: %s\n", compress);
+		exit(EXIT_FAILURE);
+	}
+
+	if (PRIVATE->compress)
+	{
+		pthread_mutex_init(&PRIVATE->mutex, NULL);
+		pthread_cond_init(&PRIVATE->cond, NULL);
+		PRIVATE->running = TRUE;
+		SysFatal(pthread_create(&PRIVATE->compressor, NULL, output_file_compressor, this), errno, "On file compressor thread start");
+	}
+
+	PRIVATE->buf = (char*) malloc (PRIVATE->bufsize);
+	SysFatal(PRIVATE->buf == NULL, errno, "While creating file output buffer");
+
+	/* Interval syncs are timed on the monotonic clock, like the syncs themselves */
+	pthread_mutex_init(&PRIVATE->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&PRIVATE->tick, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* stdout is a stream, files are written at their offsets */
+	if (output_uring_wanted(opts))
+		PRIVATE->ring = output_uring_init(opts, this->fd == 1);
+
+	/* stdout is always there, files are opened on first use */
+	this->state      = (this->fd == 1 ? os_ready : os_disconnected);
+	this->connect    = output_file_connect;
+	this->disconnect = output_file_disconnect;
+	this->write      = output_file_write;
+	this->writev     = output_file_writev;
+	this->cleanup    = output_file_cleanup;
+
+	if (PRIVATE->ring != NULL)
+		this->flush = output_file_flush;
+
+	if (PRIVATE->sync == sync_interval)
+	{
+		PRIVATE->syncing = TRUE;
+		SysFatal(pthread_create(&PRIVATE->syncer, NULL, output_file_syncer, this), errno, "On file syncer thread start");
+	}
+
+	return this;
+}
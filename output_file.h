@@ -2,7 +2,9 @@
 #define GENCACHE_OUTPUT_FILE_H
 
 #include "output.h"
+#include "options.h"
 
-extern struct output_handler *output_handler_file_init (char *);
+extern struct output_handler *output_handler_file_init (char *, struct options *);
+extern void output_file_rotate_all ();
 
 #endif /* GENCACHE_OUTPUT_FILE_H */
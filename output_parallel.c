@@ -0,0 +1,310 @@
+#include "defines.h"
+#include "output_parallel.h"
+
+#include <sys/types.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "output_tcp.h"
+#include "output_relay.h"
+#include "output_tools.h"
+#include "message.h"
+#include "log.h"
+
+enum parallel_assign {
+	assign_source,
+	assign_hash
+};
+
+struct parallel_conn {
+	struct output_handler *handler;
+	struct priv *priv;
+	pthread_t sender;
+
+	/* Part of the current batch for this connection */
+	struct output_batch part;
+	int   *index;
+	int    busy;
+};
+
+#define PRIVATE ((struct priv*) this->priv)
+struct priv {
+	enum parallel_assign assign;
+	int hash_field;
+
+	int conn_count;
+	struct parallel_conn *conns;
+
+	/* Handing out work to the senders */
+	int running;
+	int busy;
+	pthread_mutex_t mutex;
+	pthread_cond_t  work;
+	pthread_cond_t  done;
+
+	/* Scratch space for the current batch */
+	int    capacity;
+	char  *delivered;
+	char **msgs;
+	int   *lens;
+};
+
+static void *parallel_sender (void *arg)
+{
+	struct parallel_conn *conn = (struct parallel_conn*) arg;
+	struct priv *priv = conn->priv;
+
+	pthread_mutex_lock(&priv->mutex);
+	while (TRUE)
+	{
+		/* Wait for something to send */
+		while (! conn->busy && priv->running)
+			pthread_cond_wait(&priv->work, &priv->mutex);
+
+		if (! conn->busy)
+			break;
+
+		/* Send our part, the others do the same in the mean time */
+		pthread_mutex_unlock(&priv->mutex);
+		if (! deliver_batch(conn->handler, &conn->part))
+			CustomLog(__FILE__, __LINE__, warning, "Parallel connection to %s failed", conn->handler->res);
+		pthread_mutex_lock(&priv->mutex);
+
+		/* Report back */
+		conn->busy = FALSE;
+		priv->busy--;
+		pthread_cond_broadcast(&priv->done);
+	}
+	pthread_mutex_unlock(&priv->mutex);
+
+	return NULL;
+}
+
+static void parallel_reserve (struct output_handler *this, int count)
+{
+	int c;
+
+	if (count <= PRIVATE->capacity)
+		return;
+
+	/* Grow scratch space to hold the whole batch */
+	PRIVATE->delivered = (char*) realloc (PRIVATE->delivered, count * sizeof(char));
+	PRIVATE->msgs      = (char**) realloc (PRIVATE->msgs, count * sizeof(char*));
+	PRIVATE->lens      = (int*) realloc (PRIVATE->lens, count * sizeof(int));
+	SysFatal(PRIVATE->delivered == NULL || PRIVATE->msgs == NULL || PRIVATE->lens == NULL, errno, "While growing parallel scratch space");
+
+	for (c = 0; c < PRIVATE->conn_count; c++)
+	{
+		PRIVATE->conns[c].part.msgs = (char**) realloc (PRIVATE->conns[c].part.msgs, count * sizeof(char*));
+		PRIVATE->conns[c].part.lens = (int*) realloc (PRIVATE->conns[c].part.lens, count * sizeof(int));
+		PRIVATE->conns[c].index     = (int*) realloc (PRIVATE->conns[c].index, count * sizeof(int));
+		SysFatal(PRIVATE->conns[c].part.msgs == NULL || PRIVATE->conns[c].part.lens == NULL || PRIVATE->conns[c].index == NULL, errno, "While growing parallel connection scratch space");
+	}
+
+	PRIVATE->capacity = count;
+}
+
+static int output_parallel_deliver (struct output_handler *this, struct output_batch *batch)
+{
+	struct parallel_conn *conn;
+	unsigned int key;
+	int i, j, c;
+
+	parallel_reserve(this, batch->count);
+
+	/* Split the batch over the connections, a source (or key) always uses the same one */
+	for (c = 0; c < PRIVATE->conn_count; c++)
+	{
+		PRIVATE->conns[c].part.count  = 0;
+		PRIVATE->conns[c].part.done   = 0;
+		PRIVATE->conns[c].part.offset = 0;
+	}
+
+	for (i = 0; i < batch->count; i++)
+	{
+		PRIVATE->delivered[i] = (i < batch->done);
+		if (PRIVATE->delivered[i])
+			continue;
+
+		/* Backlog doesn't know its source anymore, it all goes over the
+		 * first connection, which keeps it in the order it was queued */
+		if (PRIVATE->assign == assign_hash)
+			key = output_key_hash(batch->msgs[i], batch->lens[i], PRIVATE->hash_field);
+		else if (message_replayed(batch->msgs[i]))
+			key = 0;
+		else
+			key = message_source(batch->msgs[i]);
+
+		conn = &PRIVATE->conns[key % PRIVATE->conn_count];
+		conn->part.msgs[conn->part.count] = batch->msgs[i];
+		conn->part.lens[conn->part.count] = batch->lens[i];
+		conn->index[conn->part.count]     = i;
+		conn->part.count++;
+	}
+
+	/* Set the senders to work and wait for them to finish */
+	pthread_mutex_lock(&PRIVATE->mutex);
+	for (c = 0; c < PRIVATE->conn_count; c++)
+	{
+		if (PRIVATE->conns[c].part.count > 0)
+		{
+			PRIVATE->conns[c].busy = TRUE;
+			PRIVATE->busy++;
+		}
+	}
+	pthread_cond_broadcast(&PRIVATE->work);
+
+	while (PRIVATE->busy > 0)
+		pthread_cond_wait(&PRIVATE->done, &PRIVATE->mutex);
+	pthread_mutex_unlock(&PRIVATE->mutex);
+
+	/* Collect what got through */
+	for (c = 0; c < PRIVATE->conn_count; c++)
+	{
+		for (j = 0; j < PRIVATE->conns[c].part.done; j++)
+			PRIVATE->delivered[PRIVATE->conns[c].index[j]] = TRUE;
+	}
+
+	/* Delivered messages go first, the logger deals with the rest */
+	output_batch_compact(batch, PRIVATE->delivered, PRIVATE->msgs, PRIVATE->lens);
+
+	return batch->done == batch->count;
+}
+
+static int output_parallel_connect (struct output_handler *this)
+{
+	this->state = os_ready;
+	return TRUE;
+}
+
+static int output_parallel_disconnect (struct output_handler *this)
+{
+	int c;
+
+	for (c = 0; c < PRIVATE->conn_count; c++)
+	{
+		if (PRIVATE->conns[c].handler->state != os_disconnected)
+			PRIVATE->conns[c].handler->disconnect(PRIVATE->conns[c].handler);
+	}
+
+	this->state = os_disconnected;
+	return TRUE;
+}
+
+static int output_parallel_flush (struct output_handler *this)
+{
+	int c, flushed;
+
+	/* Every connection has to be confirmed */
+	flushed = TRUE;
+	for (c = 0; c < PRIVATE->conn_count; c++)
+	{
+		if (! PRIVATE->conns[c].handler->flush(PRIVATE->conns[c].handler))
+			flushed = FALSE;
+	}
+
+	return flushed;
+}
+
+static int output_parallel_cleanup (struct output_handler *this)
+{
+	int c;
+
+	/* Stop the senders */
+	pthread_mutex_lock(&PRIVATE->mutex);
+	PRIVATE->running = FALSE;
+	pthread_cond_broadcast(&PRIVATE->work);
+	pthread_mutex_unlock(&PRIVATE->mutex);
+
+	for (c = 0; c < PRIVATE->conn_count; c++)
+	{
+		pthread_join(PRIVATE->conns[c].sender, NULL);
+		PRIVATE->conns[c].handler->cleanup(PRIVATE->conns[c].handler);
+		free(PRIVATE->conns[c].part.msgs);
+		free(PRIVATE->conns[c].part.lens);
+		free(PRIVATE->conns[c].index);
+	}
+
+	pthread_mutex_destroy(&PRIVATE->mutex);
+	pthread_cond_destroy(&PRIVATE->work);
+	pthread_cond_destroy(&PRIVATE->done);
+	free(PRIVATE->conns);
+	free(PRIVATE->delivered);
+	free(PRIVATE->msgs);
+	free(PRIVATE->lens);
+	free(this->priv);
+	this->priv = NULL;
+
+	/* The connections are gone already, so just free ourselves */
+	free(this);
+	return TRUE;
+}
+
+struct output_handler *output_handler_parallel_init (char *res, struct options *opts)
+{
+	struct output_handler *this = output_handler_common_init("tcp", res, -1);
+	char *assign;
+	int c;
+
+	/* Allocate private data part */
+	struct priv *private = (struct priv*) calloc (1, sizeof(struct priv));
+	SysFatal(private == NULL, errno, "While creating parallel output private data");
+	this->priv = private;
+
+	/* Determine how messages are spread over the connections */
+	assign = options_get(opts, "assign", "source");
+	if (strcasecmp(assign, "source") == 0)
+		PRIVATE->assign = assign_source;
+	else if (strcasecmp(assign, "hash") == 0)
+		PRIVATE->assign = assign_hash;
+	else
+	{
+		fprintf(stderr, "Unknown assign method: %s\n", assign);
+		exit(EXIT_FAILURE);
+	}
+	PRIVATE->hash_field = options_get_long(opts, "hash-field", 0);
+
+	PRIVATE->conn_count = options_get_long(opts, "connections", 1);
+	if (PRIVATE->conn_count < 1)
+	{
+		fprintf(stderr, "Need at least one connection: %d\n", PRIVATE->conn_count);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Acks come in per connection, not for the newest messages handed
+	 * over as the logger counts on, so they can't be told apart here */
+	if (output_relay_wanted(opts))
+	{
+		fprintf(stderr, "Relay protocol takes a single connection\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_mutex_init(&PRIVATE->mutex, NULL);
+	pthread_cond_init(&PRIVATE->work, NULL);
+	pthread_cond_init(&PRIVATE->done, NULL);
+	PRIVATE->running = TRUE;
+
+	/* Every connection is a TCP output with a sender of its own */
+	PRIVATE->conns = (struct parallel_conn*) calloc (PRIVATE->conn_count, sizeof(struct parallel_conn));
+	SysFatal(PRIVATE->conns == NULL, errno, "While creating parallel connections");
+	for (c = 0; c < PRIVATE->conn_count; c++)
+	{
+		PRIVATE->conns[c].handler = output_handler_tcp_init(res, opts);
+		PRIVATE->conns[c].priv    = PRIVATE;
+		SysFatal(pthread_create(&PRIVATE->conns[c].sender, NULL, parallel_sender, &PRIVATE->conns[c]), errno, "On parallel sender thread start");
+	}
+
+	this->state      = os_ready;
+	this->connect    = output_parallel_connect;
+	this->disconnect = output_parallel_disconnect;
+	this->deliver    = output_parallel_deliver;
+	this->flush      = output_parallel_flush;
+	this->cleanup    = output_parallel_cleanup;
+
+	return this;
+}
@@ -0,0 +1,9 @@
+#ifndef GENCACHE_OUTPUT_PARALLEL_H
+#define GENCACHE_OUTPUT_PARALLEL_H
+
+#include "output.h"
+#include "options.h"
+
+extern struct output_handler *output_handler_parallel_init (char *, struct options *);
+
+#endif /* GENCACHE_OUTPUT_PARALLEL_H */
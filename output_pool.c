@@ -0,0 +1,392 @@
+#include "defines.h"
+#include "output_pool.h"
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+
+#include "output_tcp.h"
+#include "output_tools.h"
+#include "log.h"
+
+/* Number of points every member gets on the hash ring */
+#define POOL_RING_POINTS	64
+
+/* Seconds a failed member is left alone before it gets traffic again */
+#define POOL_DOWN_TIME		5
+
+enum pool_balance {
+	balance_rr,
+	balance_least_bytes,
+	balance_hash
+};
+
+struct pool_member {
+	struct output_handler *handler;
+	time_t down_until;
+
+	/* Part of the current batch for this member */
+	char **msgs;
+	int   *lens;
+	int   *index;
+	int    count;
+};
+
+struct pool_point {
+	unsigned int hash;
+	int member;
+};
+
+#define PRIVATE ((struct priv*) this->priv)
+struct priv {
+	enum pool_balance balance;
+	int hash_field;
+	int next;
+
+	int member_count;
+	struct pool_member *members;
+	struct pool_point  *ring;
+
+	/* Scratch space for the current batch */
+	int    capacity;
+	char  *delivered;
+	char **msgs;
+	int   *lens;
+};
+
+static int pool_compare_points (const void *a, const void *b)
+{
+	const struct pool_point *pa = a, *pb = b;
+
+	return (pa->hash > pb->hash) - (pa->hash < pb->hash);
+}
+
+static int pool_member_up (struct output_handler *this, int m, time_t now)
+{
+	struct pool_member *member = &PRIVATE->members[m];
+
+	/* Recently failed members are left alone for a while */
+	if (member->down_until > now)
+		return FALSE;
+
+	/* Connect if needed, a failing connect takes the member down */
+	if (member->handler->state == os_disconnected)
+		member->handler->connect(member->handler);
+
+	if (member->handler->state == os_error)
+	{
+		member->handler->disconnect(member->handler);
+		member->down_until = now + POOL_DOWN_TIME;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static int pool_pick_member (struct output_handler *this, struct output_batch *batch, int i, time_t now)
+{
+	int m, n, best, outq, least;
+	unsigned int hash;
+	int lo, hi, mid;
+
+	switch (PRIVATE->balance)
+	{
+		case balance_hash:
+			/* First point on the ring at or after the key's hash */
+			hash = output_key_hash(batch->msgs[i], batch->lens[i], PRIVATE->hash_field);
+			lo = 0;
+			hi = PRIVATE->member_count * POOL_RING_POINTS;
+			while (lo < hi)
+			{
+				mid = (lo + hi) / 2;
+				if (PRIVATE->ring[mid].hash < hash)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			/* Walk on to the first member that is up, this keeps keys in place */
+			for (n = 0; n < PRIVATE->member_count * POOL_RING_POINTS; n++)
+			{
+				m = PRIVATE->ring[(lo + n) % (PRIVATE->member_count * POOL_RING_POINTS)].member;
+				if (pool_member_up(this, m, now))
+					return m;
+			}
+			return -1;
+
+		case balance_least_bytes:
+			/* Member with the least unsent bytes in its socket */
+			best  = -1;
+			least = 0;
+			for (m = 0; m < PRIVATE->member_count; m++)
+			{
+				if (! pool_member_up(this, m, now))
+					continue;
+
+				outq = 0;
+				if (PRIVATE->members[m].handler->fd != -1 && ioctl(PRIVATE->members[m].handler->fd, SIOCOUTQ, &outq) == -1)
+					outq = 0;
+
+				if (best == -1 || outq < least)
+				{
+					best  = m;
+					least = outq;
+				}
+			}
+			return best;
+
+		case balance_rr:
+		default:
+			/* Next member in line that is up */
+			for (n = 0; n < PRIVATE->member_count; n++)
+			{
+				m = (PRIVATE->next + n) % PRIVATE->member_count;
+				if (pool_member_up(this, m, now))
+				{
+					PRIVATE->next = (m + 1) % PRIVATE->member_count;
+					return m;
+				}
+			}
+			return -1;
+	}
+}
+
+static void pool_reserve (struct output_handler *this, int count)
+{
+	int m;
+
+	if (count <= PRIVATE->capacity)
+		return;
+
+	/* Grow scratch space to hold the whole batch */
+	PRIVATE->delivered = (char*) realloc (PRIVATE->delivered, count * sizeof(char));
+	PRIVATE->msgs      = (char**) realloc (PRIVATE->msgs, count * sizeof(char*));
+	PRIVATE->lens      = (int*) realloc (PRIVATE->lens, count * sizeof(int));
+	SysFatal(PRIVATE->delivered == NULL || PRIVATE->msgs == NULL || PRIVATE->lens == NULL, errno, "While growing pool scratch space");
+
+	for (m = 0; m < PRIVATE->member_count; m++)
+	{
+		PRIVATE->members[m].msgs  = (char**) realloc (PRIVATE->members[m].msgs, count * sizeof(char*));
+		PRIVATE->members[m].lens  = (int*) realloc (PRIVATE->members[m].lens, count * sizeof(int));
+		PRIVATE->members[m].index = (int*) realloc (PRIVATE->members[m].index, count * sizeof(int));
+		SysFatal(PRIVATE->members[m].msgs == NULL || PRIVATE->members[m].lens == NULL || PRIVATE->members[m].index == NULL, errno, "While growing pool member scratch space");
+	}
+
+	PRIVATE->capacity = count;
+}
+
+static int output_pool_deliver (struct output_handler *this, struct output_batch *batch)
+{
+	struct pool_member *member;
+	struct output_batch part;
+	int i, j, m, pending, chosen;
+	time_t now;
+
+	pool_reserve(this, batch->count);
+
+	/* What came in as done stays done */
+	for (i = 0; i < batch->count; i++)
+		PRIVATE->delivered[i] = (i < batch->done);
+	batch->offset = 0;
+
+	/* Keep going until everything is out, or no member is left */
+	pending = batch->count - batch->done;
+	while (pending > 0)
+	{
+		now = time(NULL);
+
+		/* Split what's left over the members */
+		for (m = 0; m < PRIVATE->member_count; m++)
+			PRIVATE->members[m].count = 0;
+
+		chosen = -1;
+		for (i = 0; i < batch->count; i++)
+		{
+			if (PRIVATE->delivered[i])
+				continue;
+
+			/* Hashing is done per message, the others per batch */
+			if (PRIVATE->balance == balance_hash || chosen == -1)
+				chosen = pool_pick_member(this, batch, i, now);
+			if (chosen == -1)
+				break;
+
+			member = &PRIVATE->members[chosen];
+			member->msgs[member->count]  = batch->msgs[i];
+			member->lens[member->count]  = batch->lens[i];
+			member->index[member->count] = i;
+			member->count++;
+		}
+
+		/* All members are down */
+		if (chosen == -1)
+			break;
+
+		/* Hand every member its part */
+		for (m = 0; m < PRIVATE->member_count; m++)
+		{
+			member = &PRIVATE->members[m];
+			if (member->count == 0)
+				continue;
+
+			part.msgs   = member->msgs;
+			part.lens   = member->lens;
+			part.count  = member->count;
+			part.done   = 0;
+			part.offset = 0;
+
+			if (! deliver_batch(member->handler, &part))
+			{
+				/* Leave this member alone for a while, the rest moves elsewhere */
+				CustomLog(__FILE__, __LINE__, warning, "Pool member %s failed, taking it out", member->handler->res);
+				member->down_until = now + POOL_DOWN_TIME;
+				if (member->handler->state != os_disconnected)
+					member->handler->disconnect(member->handler);
+			}
+
+			for (j = 0; j < part.done; j++)
+				PRIVATE->delivered[member->index[j]] = TRUE;
+			pending -= part.done;
+		}
+	}
+
+	/* Delivered messages go first, the logger deals with the rest */
+	output_batch_compact(batch, PRIVATE->delivered, PRIVATE->msgs, PRIVATE->lens);
+
+	return batch->done == batch->count;
+}
+
+static int output_pool_connect (struct output_handler *this)
+{
+	int m;
+
+	/* Connect whatever member is up */
+	for (m = 0; m < PRIVATE->member_count; m++)
+		pool_member_up(this, m, time(NULL));
+
+	this->state = os_ready;
+	return TRUE;
+}
+
+static int output_pool_disconnect (struct output_handler *this)
+{
+	int m;
+
+	for (m = 0; m < PRIVATE->member_count; m++)
+	{
+		if (PRIVATE->members[m].handler->state != os_disconnected)
+			PRIVATE->members[m].handler->disconnect(PRIVATE->members[m].handler);
+	}
+
+	this->state = os_disconnected;
+	return TRUE;
+}
+
+static int output_pool_cleanup (struct output_handler *this)
+{
+	char *res;
+	int m;
+
+	/* Tidy up the members */
+	for (m = 0; m < PRIVATE->member_count; m++)
+	{
+		/* The member may still use its name while it tidies up */
+		res = PRIVATE->members[m].handler->res;
+		PRIVATE->members[m].handler->cleanup(PRIVATE->members[m].handler);
+		free(res);
+		free(PRIVATE->members[m].msgs);
+		free(PRIVATE->members[m].lens);
+		free(PRIVATE->members[m].index);
+	}
+
+	free(PRIVATE->members);
+	free(PRIVATE->ring);
+	free(PRIVATE->delivered);
+	free(PRIVATE->msgs);
+	free(PRIVATE->lens);
+	free(this->priv);
+	this->priv = NULL;
+
+	/* The members are gone already, so just free ourselves */
+	free(this);
+	return TRUE;
+}
+
+struct output_handler *output_handler_pool_init (char *res, struct options *opts)
+{
+	struct output_handler *this = output_handler_common_init("pool", res, -1);
+	char *balance, *list, *member, *save, point[256];
+	int m, p;
+
+	/* Allocate private data part */
+	struct priv *private = (struct priv*) calloc (1, sizeof(struct priv));
+	SysFatal(private == NULL, errno, "While creating pool output private data");
+	this->priv = private;
+
+	/* Determine how to balance */
+	balance = options_get(opts, "balance", "rr");
+	if (strcasecmp(balance, "rr") == 0)
+		PRIVATE->balance = balance_rr;
+	else if (strcasecmp(balance, "least-bytes") == 0)
+		PRIVATE->balance = balance_least_bytes;
+	else if (strcasecmp(balance, "hash") == 0)
+		PRIVATE->balance = balance_hash;
+	else
+	{
+		fprintf(stderr, "Unknown balance method: %s\n", balance);
+		exit(EXIT_FAILURE);
+	}
+	PRIVATE->hash_field = options_get_long(opts, "hash-field", 0);
+
+	/* Create a TCP output for every host:port in the list */
+	list = strdup(res);
+	SysFatal(list == NULL, errno, "While parsing pool members");
+	for (member = strtok_r(list, ",", &save); member != NULL; member = strtok_r(NULL, ",", &save))
+	{
+		PRIVATE->members = (struct pool_member*) realloc (PRIVATE->members, (PRIVATE->member_count + 1) * sizeof(struct pool_member));
+		SysFatal(PRIVATE->members == NULL, errno, "While adding pool member");
+
+		memset(&PRIVATE->members[PRIVATE->member_count], 0, sizeof(struct pool_member));
+		PRIVATE->members[PRIVATE->member_count].handler = output_handler_tcp_init(strdup(member), opts);
+
+		/* Failing members should hand over their traffic quickly */
+		PRIVATE->members[PRIVATE->member_count].handler->retry = 1;
+		PRIVATE->member_count++;
+	}
+	free(list);
+
+	if (PRIVATE->member_count == 0)
+	{
+		fprintf(stderr, "Pool without members: %s\n", res);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Put the members on the hash ring */
+	PRIVATE->ring = (struct pool_point*) malloc (PRIVATE->member_count * POOL_RING_POINTS * sizeof(struct pool_point));
+	SysFatal(PRIVATE->ring == NULL, errno, "While creating pool hash ring");
+	for (m = 0; m < PRIVATE->member_count; m++)
+	{
+		for (p = 0; p < POOL_RING_POINTS; p++)
+		{
+			snprintf(point, sizeof(point), "%s#%d", PRIVATE->members[m].handler->res, p);
+			PRIVATE->ring[m * POOL_RING_POINTS + p].hash   = output_key_hash(point, strlen(point), 0);
+			PRIVATE->ring[m * POOL_RING_POINTS + p].member = m;
+		}
+	}
+	qsort(PRIVATE->ring, PRIVATE->member_count * POOL_RING_POINTS, sizeof(struct pool_point), pool_compare_points);
+
+	this->state      = os_ready;
+	this->connect    = output_pool_connect;
+	this->disconnect = output_pool_disconnect;
+	this->deliver    = output_pool_deliver;
+	this->cleanup    = output_pool_cleanup;
+
+	return this;
+}
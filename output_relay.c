@@ -0,0 +1,613 @@
+#include "defines.h"
+#include "output_relay.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "relay.h"
+#include "deadletter.h"
+#include "output_tcp.h"
+#include "output_tools.h"
+#include "message.h"
+#include "log.h"
+
+/* Acks taken from the socket in one go */
+#define RELAY_ACK_READ		64
+
+struct relay_frame {
+	unsigned int seq;
+	char *data;	/* A message of its own, zerocopy sends may hold on to it */
+	int   len;
+	int   count;	/* Messages in it */
+	int  *lens;	/* And their lengths */
+	int   attempts;	/* Times it was sent */
+	int   alone;	/* Times it went unacked being the only one sent */
+};
+
+#define PRIVATE ((struct priv*) this->priv)
+struct priv {
+	struct output_handler *member;
+
+	int window;		/* Frames that may be in flight */
+	int ack_timeout;	/* Milliseconds to wait for an ack when the window is full */
+	int max_attempts;	/* Sends of a frame before it's given up on, 0 for never */
+
+	/* Unacknowledged frames, oldest first. Splitting one can take them past the window */
+	struct relay_frame *frames;
+	int slots;
+	int head;
+	int pending;
+	unsigned int next_seq;
+	int resend;		/* Connection is new, resend what's pending */
+
+	/* Partially received ack */
+	unsigned char ack[RELAY_ACK_SIZE];
+	int acklen;
+
+	/* Where frames go that keep failing */
+	struct deadletter *dead;
+
+	/* The frame reclaim handed back last */
+	char  *reclaimed;
+	int   *reclaimed_lens;
+	char **reclaimed_msgs;
+	int    reclaimed_size;
+};
+
+int output_relay_wanted (struct options *opts)
+{
+	char *protocol = options_get(opts, "protocol", "plain");
+
+	if (strcasecmp(protocol, "relay") == 0)
+		return TRUE;
+	else if (strcasecmp(protocol, "plain") == 0)
+		return FALSE;
+
+	fprintf(stderr, "Unknown protocol: %s\n", protocol);
+	exit(EXIT_FAILURE);
+}
+
+static void relay_pop (struct output_handler *this)
+{
+	struct relay_frame *frame = &PRIVATE->frames[PRIVATE->head];
+
+	/* The oldest frame leaves the window */
+	message_free(frame->data);
+	free(frame->lens);
+	frame->data = NULL;
+	frame->lens = NULL;
+	PRIVATE->head = (PRIVATE->head + 1) % PRIVATE->slots;
+	PRIVATE->pending--;
+}
+
+static void relay_release (struct output_handler *this, unsigned int seq)
+{
+	/* Acks are cumulative, everything up to seq made it */
+	while (PRIVATE->pending > 0 && (int) (PRIVATE->frames[PRIVATE->head].seq - seq) <= 0)
+		relay_pop(this);
+}
+
+static void relay_header (struct relay_frame *frame)
+{
+	unsigned int header[RELAY_HEADER_SIZE / 4];
+
+	header[0] = htonl(RELAY_FRAME_MAGIC);
+	header[1] = htonl(frame->seq);
+	header[2] = htonl(frame->count);
+	header[3] = htonl(frame->len - RELAY_HEADER_SIZE);
+	memcpy(frame->data, header, RELAY_HEADER_SIZE);
+}
+
+static void relay_split (struct output_handler *this)
+{
+	struct relay_frame *frames;
+	struct relay_frame *frame, *half;
+	int i, first, len;
+
+	/* Room for one more */
+	if (PRIVATE->pending == PRIVATE->slots)
+	{
+		frames = (struct relay_frame*) calloc (PRIVATE->slots * 2, sizeof(struct relay_frame));
+		SysFatal(frames == NULL, errno, "While growing relay window");
+		for (i = 0; i < PRIVATE->pending; i++)
+			frames[i] = PRIVATE->frames[(PRIVATE->head + i) % PRIVATE->slots];
+
+		free(PRIVATE->frames);
+		PRIVATE->frames = frames;
+		PRIVATE->slots *= 2;
+		PRIVATE->head   = 0;
+	}
+
+	/* The second half goes right after the first */
+	for (i = PRIVATE->pending; i > 1; i--)
+		PRIVATE->frames[(PRIVATE->head + i) % PRIVATE->slots] = PRIVATE->frames[(PRIVATE->head + i - 1) % PRIVATE->slots];
+	PRIVATE->pending++;
+
+	frame = &PRIVATE->frames[PRIVATE->head];
+	half  = &PRIVATE->frames[(PRIVATE->head + 1) % PRIVATE->slots];
+
+	first = frame->count / 2;
+	for (i = 0, len = RELAY_HEADER_SIZE; i < first; i++)
+		len += frame->lens[i];
+
+	half->count    = frame->count - first;
+	half->len      = RELAY_HEADER_SIZE + frame->len - len;
+	half->attempts = frame->attempts;
+	half->alone    = 0;
+	half->data = message_alloc (half->len);
+	half->lens = (int*) malloc (half->count * sizeof(int));
+	SysFatal(half->data == NULL || half->lens == NULL, errno, "While splitting relay frame");
+	memcpy(half->data + RELAY_HEADER_SIZE, frame->data + len, half->len - RELAY_HEADER_SIZE);
+	memcpy(half->lens, frame->lens + first, half->count * sizeof(int));
+
+	frame->count = first;
+	frame->len   = len;
+	frame->alone = 0;
+
+	/* The connection is new, so the frames can be numbered again */
+	for (i = 0; i < PRIVATE->pending; i++)
+	{
+		frame = &PRIVATE->frames[(PRIVATE->head + i) % PRIVATE->slots];
+		frame->seq = PRIVATE->next_seq - PRIVATE->pending + 1 + i;
+		relay_header(frame);
+	}
+	PRIVATE->next_seq++;
+}
+
+static void relay_give_up (struct output_handler *this)
+{
+	struct relay_frame *frame = &PRIVATE->frames[PRIVATE->head];
+	char reason[64];
+
+	/* The oldest frame holds up all the others, acks being cumulative */
+	snprintf(reason, sizeof(reason), "not acknowledged after %d attempts", frame->attempts);
+	deadletter_write(PRIVATE->dead, reason, frame->data + RELAY_HEADER_SIZE, frame->len - RELAY_HEADER_SIZE);
+	relay_pop(this);
+}
+
+static void relay_drop_connection (struct output_handler *this)
+{
+	if (PRIVATE->member->state != os_disconnected)
+		PRIVATE->member->disconnect(PRIVATE->member);
+
+	/* Whatever is pending goes again on the next connection */
+	PRIVATE->acklen = 0;
+	PRIVATE->resend = TRUE;
+}
+
+static int relay_read_acks (struct output_handler *this, int wait)
+{
+	unsigned char buf[RELAY_ACK_READ * RELAY_ACK_SIZE];
+	struct pollfd pfd;
+	unsigned int magic, seq;
+	long long until;
+	int i, n;
+
+	if (PRIVATE->member->fd == -1)
+		return FALSE;
+
+	/* Wait for acks to come in, if asked to, but not past a shutdown deadline */
+	if (wait > 0)
+	{
+		pfd.fd     = PRIVATE->member->fd;
+		pfd.events = POLLIN;
+		until = output_now() + wait;
+		do
+		{
+			if ((wait = output_slice(until)) == 0)
+				return FALSE;
+			n = poll(&pfd, 1, wait);
+		}
+		while (n == 0);
+		if (n == -1 && errno != EINTR)
+			return FALSE;
+	}
+
+	while (TRUE)
+	{
+		n = recv(PRIVATE->member->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n == 0)
+		{
+			Log2(warning, "Relay peer closed the connection", "[Relay output handler]");
+			return FALSE;
+		}
+		else if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return TRUE;
+
+			SysErr(errno, "While reading relay acks");
+			return FALSE;
+		}
+
+		/* Put acks together, they may come in pieces */
+		for (i = 0; i < n; i++)
+		{
+			PRIVATE->ack[PRIVATE->acklen++] = buf[i];
+			if (PRIVATE->acklen < RELAY_ACK_SIZE)
+				continue;
+
+			memcpy(&magic, PRIVATE->ack, 4);
+			memcpy(&seq, PRIVATE->ack + 4, 4);
+			PRIVATE->acklen = 0;
+
+			if (ntohl(magic) != RELAY_ACK_MAGIC)
+			{
+				Log2(error, "Garbage on relay ack stream", "[Relay output handler]");
+				return FALSE;
+			}
+
+			/* The peer is taking frames, so the connection is good */
+			relay_release(this, ntohl(seq));
+			output_backoff_reset(PRIVATE->member);
+		}
+	}
+}
+
+static int relay_send (struct output_handler *this, struct relay_frame *frame)
+{
+	struct output_batch batch;
+
+	/* A frame is a single message to the TCP output underneath */
+	batch.msgs   = &frame->data;
+	batch.lens   = &frame->len;
+	batch.count  = 1;
+	batch.done   = 0;
+	batch.offset = 0;
+
+	frame->attempts++;
+	return deliver_batch(PRIVATE->member, &batch);
+}
+
+static int relay_connect (struct output_handler *this)
+{
+	struct output_handler *member = PRIVATE->member;
+	struct relay_frame *frame;
+	struct pollfd pfd;
+	unsigned int seq;
+	long long until;
+	long wait;
+	int i;
+
+	if (member->state == os_error)
+		relay_drop_connection(this);
+
+	/* Connect when the backoff allows it, and wait for it to finish */
+	if (member->state == os_disconnected)
+	{
+		output_backoff_wait(member);
+		member->connect(member);
+		PRIVATE->resend = TRUE;
+	}
+
+	/* Up to ack-timeout, or the shutdown deadline */
+	until = output_now() + PRIVATE->ack_timeout;
+	while (member->state == os_connecting && (wait = output_slice(until)) > 0)
+	{
+		pfd.fd     = member->fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, wait) == 1)
+			member->connect(member);
+	}
+
+	if (member->state != os_ready && member->state != os_sending)
+	{
+		relay_drop_connection(this);
+
+		/* Don't hammer a peer that's not there */
+		output_backoff_failed(member);
+		return FALSE;
+	}
+
+	/* A new connection gets every unacknowledged frame again, in order */
+	if (PRIVATE->resend)
+	{
+		/* Except for a message the peer keeps dropping the connection over.
+		 * A frame that went before is tried by itself first, acks of the
+		 * others may have been lost with the connection. If the peer drops
+		 * it alone, it's halved, down to the message at fault, which is
+		 * given up on */
+		while (PRIVATE->pending > 0 && PRIVATE->max_attempts > 0 && PRIVATE->frames[PRIVATE->head].attempts > 1)
+		{
+			frame = &PRIVATE->frames[PRIVATE->head];
+			if (frame->alone > 0 && frame->count > 1)
+			{
+				CustomLog(__FILE__, __LINE__, warning, "Splitting a frame of %d messages to %s after %d attempts", frame->count, this->res, frame->attempts);
+				relay_split(this);
+				frame = &PRIVATE->frames[PRIVATE->head];
+			}
+			else if (frame->alone > 0 && frame->attempts >= PRIVATE->max_attempts)
+			{
+				relay_give_up(this);
+				continue;
+			}
+
+			seq = frame->seq;
+			if (! relay_send(this, frame))
+			{
+				frame->alone++;
+				relay_drop_connection(this);
+				return FALSE;
+			}
+
+			while (PRIVATE->pending > 0 && PRIVATE->frames[PRIVATE->head].seq == seq)
+			{
+				if (! relay_read_acks(this, PRIVATE->ack_timeout))
+				{
+					frame->alone++;
+					relay_drop_connection(this);
+					return FALSE;
+				}
+			}
+		}
+
+		if (PRIVATE->pending > 0)
+			CustomLog(__FILE__, __LINE__, warning, "Resending %d unacknowledged frames to %s", PRIVATE->pending, this->res);
+
+		for (i = 0; i < PRIVATE->pending; i++)
+		{
+			if (! relay_send(this, &PRIVATE->frames[(PRIVATE->head + i) % PRIVATE->slots]))
+			{
+				relay_drop_connection(this);
+				return FALSE;
+			}
+		}
+		PRIVATE->resend = FALSE;
+	}
+
+	return TRUE;
+}
+
+static int output_relay_deliver (struct output_handler *this, struct output_batch *batch)
+{
+	struct relay_frame *frame;
+	char *pos;
+	int i, len;
+
+	if (batch->done == batch->count)
+		return TRUE;
+
+	if (! relay_connect(this))
+		return FALSE;
+
+	/* Take in whatever acks arrived in the mean time */
+	if (! relay_read_acks(this, 0))
+	{
+		relay_drop_connection(this);
+		return FALSE;
+	}
+
+	/* Window is full, wait for the peer to catch up */
+	while (PRIVATE->pending >= PRIVATE->window)
+	{
+		if (! relay_read_acks(this, PRIVATE->ack_timeout))
+		{
+			CustomLog(__FILE__, __LINE__, warning, "No acks from %s, reconnecting", this->res);
+			relay_drop_connection(this);
+			return FALSE;
+		}
+	}
+
+	/* Frame the rest of the batch */
+	len = RELAY_HEADER_SIZE;
+	for (i = batch->done; i < batch->count; i++)
+		len += batch->lens[i];
+
+	frame = &PRIVATE->frames[(PRIVATE->head + PRIVATE->pending) % PRIVATE->slots];
+	frame->seq  = PRIVATE->next_seq++;
+	frame->len  = len;
+	frame->count = batch->count - batch->done;
+	frame->attempts = 0;
+	frame->alone    = 0;
+	frame->data = message_alloc (len);
+	frame->lens = (int*) malloc (frame->count * sizeof(int));
+	SysFatal(frame->data == NULL || frame->lens == NULL, errno, "While creating relay frame");
+	memcpy(frame->lens, batch->lens + batch->done, frame->count * sizeof(int));
+	relay_header(frame);
+
+	pos = frame->data + RELAY_HEADER_SIZE;
+	for (i = batch->done; i < batch->count; i++)
+	{
+		memcpy(pos, batch->msgs[i], batch->lens[i]);
+		pos += batch->lens[i];
+	}
+
+	/* The window holds on to the messages until they're acked, they're pending until then */
+	PRIVATE->pending++;
+	batch->done   = batch->count;
+	batch->offset = 0;
+
+	/* A failed send is retried on the next connection */
+	if (! relay_send(this, frame))
+		relay_drop_connection(this);
+
+	return TRUE;
+}
+
+static int output_relay_flush (struct output_handler *this)
+{
+	struct pollfd pfd;
+	long long until;
+	long wait;
+
+	/* Wait for every frame to be acked, reconnecting as needed, up to ack-timeout or the shutdown deadline */
+	until = output_now() + PRIVATE->ack_timeout;
+	while (PRIVATE->pending > 0 && (wait = output_slice(until)) > 0)
+	{
+		if (! relay_connect(this))
+			continue;
+
+		pfd.fd     = PRIVATE->member->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, wait) == 0)
+			continue;
+
+		if (! relay_read_acks(this, 0))
+			relay_drop_connection(this);
+	}
+
+	if (PRIVATE->pending > 0)
+		CustomLog(__FILE__, __LINE__, error, "%d frames to %s were never acknowledged", PRIVATE->pending, this->res);
+
+	return PRIVATE->pending == 0;
+}
+
+static int output_relay_pending (struct output_handler *this)
+{
+	int i, count;
+
+	for (i = 0, count = 0; i < PRIVATE->pending; i++)
+		count += PRIVATE->frames[(PRIVATE->head + i) % PRIVATE->slots].count;
+
+	return count;
+}
+
+static int output_relay_reclaim (struct output_handler *this, struct output_batch *batch)
+{
+	struct relay_frame *frame = &PRIVATE->frames[PRIVATE->head];
+	char *pos;
+	int i;
+
+	/* The frame handed back last time is done with */
+	message_free(PRIVATE->reclaimed);
+	free(PRIVATE->reclaimed_lens);
+	PRIVATE->reclaimed      = NULL;
+	PRIVATE->reclaimed_lens = NULL;
+
+	if (PRIVATE->pending == 0)
+		return 0;
+
+	if (frame->count > PRIVATE->reclaimed_size)
+	{
+		PRIVATE->reclaimed_size = frame->count;
+		PRIVATE->reclaimed_msgs = (char**) realloc (PRIVATE->reclaimed_msgs, frame->count * sizeof(char*));
+		SysFatal(PRIVATE->reclaimed_msgs == NULL, errno, "While reclaiming relay frame");
+	}
+
+	/* Its messages, as they were framed */
+	pos = frame->data + RELAY_HEADER_SIZE;
+	for (i = 0; i < frame->count; i++)
+	{
+		PRIVATE->reclaimed_msgs[i] = pos;
+		pos += frame->lens[i];
+	}
+
+	batch->msgs   = PRIVATE->reclaimed_msgs;
+	batch->lens   = frame->lens;
+	batch->count  = frame->count;
+	batch->done   = 0;
+	batch->offset = 0;
+
+	/* It's someone else's now, the peer won't see it again */
+	PRIVATE->reclaimed      = frame->data;
+	PRIVATE->reclaimed_lens = frame->lens;
+	frame->data = NULL;
+	frame->lens = NULL;
+	relay_pop(this);
+
+	return batch->count;
+}
+
+static int output_relay_connect (struct output_handler *this)
+{
+	relay_connect(this);
+
+	this->state = os_ready;
+	return TRUE;
+}
+
+static int output_relay_disconnect (struct output_handler *this)
+{
+	relay_drop_connection(this);
+
+	this->state = os_disconnected;
+	return TRUE;
+}
+
+static int output_relay_cleanup (struct output_handler *this)
+{
+	struct relay_frame *frame;
+
+	/* What never got acked, and nobody else kept, is a dead letter */
+	while (PRIVATE->pending > 0)
+	{
+		frame = &PRIVATE->frames[PRIVATE->head];
+		deadletter_write(PRIVATE->dead, "not acknowledged before shutdown", frame->data + RELAY_HEADER_SIZE, frame->len - RELAY_HEADER_SIZE);
+		relay_pop(this);
+	}
+	message_free(PRIVATE->reclaimed);
+	free(PRIVATE->reclaimed_lens);
+	free(PRIVATE->reclaimed_msgs);
+
+	PRIVATE->member->cleanup(PRIVATE->member);
+	deadletter_cleanup(PRIVATE->dead);
+	free(PRIVATE->frames);
+	free(this->priv);
+	this->priv = NULL;
+
+	/* The connection is gone already, so just free ourselves */
+	free(this);
+	return TRUE;
+}
+
+struct output_handler *output_handler_relay_init (char *res, struct options *opts)
+{
+	struct output_handler *this = output_handler_common_init("tcp", res, -1);
+
+	/* Allocate private data part */
+	struct priv *private = (struct priv*) calloc (1, sizeof(struct priv));
+	SysFatal(private == NULL, errno, "While creating relay output private data");
+	this->priv = private;
+
+	/* Claim the protocol option, we know it's ours */
+	output_relay_wanted(opts);
+
+	PRIVATE->window      = options_get_long(opts, "window", 64);
+	PRIVATE->ack_timeout = options_get_long(opts, "ack-timeout", 30000);
+	if (PRIVATE->window < 1 || PRIVATE->ack_timeout < 1)
+	{
+		fprintf(stderr, "Relay window and ack-timeout should be positive\n");
+		exit(EXIT_FAILURE);
+	}
+
+	PRIVATE->max_attempts = options_get_long(opts, "max-attempts", 0);
+	if (PRIVATE->max_attempts < 0)
+	{
+		fprintf(stderr, "Relay max-attempts can't be negative\n");
+		exit(EXIT_FAILURE);
+	}
+
+	PRIVATE->slots  = PRIVATE->window;
+	PRIVATE->frames = (struct relay_frame*) calloc (PRIVATE->slots, sizeof(struct relay_frame));
+	SysFatal(PRIVATE->frames == NULL, errno, "While creating relay window");
+
+	/* Frames given up on end up here */
+	PRIVATE->dead = deadletter_init(res, opts);
+
+	/* The frames go out through a plain TCP output, we handle the retries */
+	PRIVATE->member = output_handler_tcp_init(res, opts);
+	PRIVATE->member->retry = 1;
+
+	this->state      = os_ready;
+	this->connect    = output_relay_connect;
+	this->disconnect = output_relay_disconnect;
+	this->deliver    = output_relay_deliver;
+	this->flush      = output_relay_flush;
+	this->pending    = output_relay_pending;
+	this->reclaim    = output_relay_reclaim;
+	this->cleanup    = output_relay_cleanup;
+
+	return this;
+}
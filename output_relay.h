@@ -0,0 +1,10 @@
+#ifndef GENCACHE_OUTPUT_RELAY_H
+#define GENCACHE_OUTPUT_RELAY_H
+
+#include "output.h"
+#include "options.h"
+
+extern int output_relay_wanted (struct options *);
+extern struct output_handler *output_handler_relay_init (char *, struct options *);
+
+#endif /* GENCACHE_OUTPUT_RELAY_H */
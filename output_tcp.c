@@ -4,26 +4,94 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/types.h>
+#include <linux/errqueue.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <strings.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <zlib.h>
 
 #include "net_tools.h"
+#include "resolver.h"
 #include "output_tools.h"
+#include "output_uring.h"
+#include "message.h"
 #include "log.h"
 
+/* Compression level used for a near empty queue, and the ceiling for a full one */
+#define TCP_LEVEL_MIN		1
+#define TCP_LEVEL_MAX		6
+
+/* Initial size of the compressed output buffer */
+#define TCP_ZBUF_SIZE		65536
+
+/* Milliseconds to wait for zerocopy completions when no user-timeout is set */
+#define TCP_ZEROCOPY_WAIT	30000
+
+/* Zerocopy sends in flight before a batch waits for some of them to complete */
+#define TCP_ZEROCOPY_SENDS	256
+
+/* A message a zerocopy send reads from, kept until the kernel is done with it */
+struct tcp_zc_hold {
+	unsigned int id;
+	char *msg;
+};
+
 #define PRIVATE ((struct priv*) this->priv)
 struct priv {
 	int proto;
+
+	/* Where the current connection goes, from the resolver */
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int       dns_ttl;
+
+	/* Stream compression, one zlib stream per connection */
+	int       compress;
+	int       adapt;	/* Pick the level from the queue depth */
+	int       level;
+	z_stream  stream;
+	char     *zbuf;
+	int       zsize;
+	int       zlen;		/* Compressed bytes of the current batch */
+	int       zsent;
+	char     *zfirst;	/* First message they were made from */
+
+	/* io_uring engine, if asked for */
+	struct output_uring *ring;
+
+	/* Socket options, applied on every new connection */
+	struct net_tuning tuning;
+	int corked;
+
+	/* MSG_ZEROCOPY for batches of at least this many bytes */
+	long zerocopy;
+	int  zc_enabled;	/* Usable on this connection */
+	int  zc_pending;	/* Sends the kernel still holds pages of */
+	unsigned int zc_next;	/* The kernel's number for the next one */
+	struct tcp_zc_hold *zc_held;	/* Oldest first */
+	int  zc_first;
+	int  zc_count;
+	int  zc_size;
 };
 	
-static int output_tcp_connect (struct output_handler *this)
+static int output_tcp_connected (struct output_handler *this)
 {
-	struct sockaddr_in addr;
+	/* The engine waits for room in the socket itself, it wants a blocking one */
+	if (PRIVATE->ring != NULL)
+		fcntl(this->fd, F_SETFL, fcntl(this->fd, F_GETFL, 0) & ~O_NONBLOCK);
 
+	this->state = os_ready;
+	return TRUE;
+}
+
+static int output_tcp_connect (struct output_handler *this)
+{
 	Require(
 		this != NULL &&
 		(
@@ -35,21 +103,43 @@ static int output_tcp_connect (struct output_handler *this)
 	/* If initial connect attempt, create socket */
 	if (this->state == os_disconnected)
 	{
+		/* Never wait for DNS here, an address that's not there yet is just a failed attempt */
+		if (! resolver_lookup(this->res, PRIVATE->dns_ttl, &PRIVATE->addr, &PRIVATE->addrlen))
+		{
+			this->err = errno;
+			if (this->err == EAGAIN)
+				CustomLog(__FILE__, __LINE__, info, "Address of %s isn't known yet", this->res);
+			else
+				SysErr(this->err, "While resolving outgoing tcp connection");
+			this->state = os_error;
+			return FALSE;
+		}
+
 		Log2(info, "Creating new socket", "[TCP output handler]");
-		this->fd = net_create_socket (PRIVATE->proto, this->type);
+		this->fd = net_create_socket (PRIVATE->addr.ss_family, PRIVATE->proto, this->type);
+		net_tune_socket(this->fd, &PRIVATE->tuning);
+
+		/* Connect in the background, and never block on a full socket */
+		SysFatal(fcntl(this->fd, F_SETFL, fcntl(this->fd, F_GETFL, 0) | O_NONBLOCK) == -1, errno, "On setting O_NONBLOCK on outgoing tcp connection");
+		PRIVATE->corked = FALSE;
+
+		/* Zerocopy has to be allowed on the socket first */
+		PRIVATE->zc_enabled = FALSE;
+		PRIVATE->zc_pending = 0;
+		PRIVATE->zc_next    = 0;
+		if (PRIVATE->zerocopy > 0)
+		{
+			PRIVATE->zc_enabled = TRUE;
+			if (setsockopt(this->fd, SOL_SOCKET, SO_ZEROCOPY, &PRIVATE->zc_enabled, sizeof(int)) == -1)
+			{
+				SysErr(errno, "On setting socket option SO_ZEROCOPY, sending plainly");
+				PRIVATE->zc_enabled = FALSE;
+			}
+		}
 	}
 	
-	/* Resolve address */
-	if (!net_get_socketaddr(&addr, this->res))
-	{
-		this->err = errno;
-		SysErr(this->err, "While trying to make outgoing tcp connection");
-		this->state = os_error;
-		return FALSE;
-	}
-
 	/* Try to connect */
-	if (connect(this->fd, &addr, sizeof(struct sockaddr_in)) == -1)
+	if (connect(this->fd, (struct sockaddr*) &PRIVATE->addr, PRIVATE->addrlen) == -1)
 	{
 		this->err = errno;
 		switch(this->err)
@@ -57,8 +147,7 @@ static int output_tcp_connect (struct output_handler *this)
 			/* Connection is established */
 			case EISCONN:
 //				shutdown(this->fd, 0);
-				this->state = os_ready;
-				return TRUE;
+				return output_tcp_connected(this);
 			
 			/* Temporary failure */
 			case EAGAIN:
@@ -76,31 +165,168 @@ static int output_tcp_connect (struct output_handler *this)
 	}
 
 	/* All went well, we're connected */
-	this->state = os_ready;
+	return output_tcp_connected(this);
+}
+
+static void output_tcp_zerocopy_hold (struct output_handler *this, char *msg)
+{
+	struct tcp_zc_hold *held;
+	int i, size;
+
+	if (PRIVATE->zc_count == PRIVATE->zc_size)
+	{
+		size = MAX(PRIVATE->zc_size * 2, 64);
+		held = (struct tcp_zc_hold*) malloc (size * sizeof(struct tcp_zc_hold));
+		SysFatal(held == NULL, errno, "While growing zerocopy references");
+		for (i = 0; i < PRIVATE->zc_count; i++)
+			held[i] = PRIVATE->zc_held[(PRIVATE->zc_first + i) % PRIVATE->zc_size];
+
+		free(PRIVATE->zc_held);
+		PRIVATE->zc_held  = held;
+		PRIVATE->zc_size  = size;
+		PRIVATE->zc_first = 0;
+	}
+
+	/* The message stays around until the send's completion comes in */
+	message_ref(msg, 1);
+	held = &PRIVATE->zc_held[(PRIVATE->zc_first + PRIVATE->zc_count) % PRIVATE->zc_size];
+	held->id  = PRIVATE->zc_next;
+	held->msg = msg;
+	PRIVATE->zc_count++;
+}
+
+static void output_tcp_zerocopy_release (struct output_handler *this, unsigned int upto)
+{
+	/* Completions come in order, so everything up to the end of a range is done */
+	while (PRIVATE->zc_count > 0 && (int) (PRIVATE->zc_held[PRIVATE->zc_first].id - upto) <= 0)
+	{
+		message_free(PRIVATE->zc_held[PRIVATE->zc_first].msg);
+		PRIVATE->zc_first = (PRIVATE->zc_first + 1) % PRIVATE->zc_size;
+		PRIVATE->zc_count--;
+	}
+}
+
+static int output_tcp_zerocopy_reap (struct output_handler *this, int most)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) * 8];
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	struct pollfd pfd;
+	long long until;
+	long wait;
+
+	/* Takes the completions that are in, and waits for more while over most sends are in flight */
+	until = output_now() + (PRIVATE->tuning.user_timeout > 0 ? PRIVATE->tuning.user_timeout : TCP_ZEROCOPY_WAIT);
+	while (PRIVATE->zc_pending > 0)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(this->fd, &msg, MSG_ERRQUEUE) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+			{
+				this->err = errno;
+				SysErr(this->err, "While reading zerocopy completions");
+				return FALSE;
+			}
+			if (PRIVATE->zc_pending <= most)
+				return TRUE;
+
+			/* Completions show up as POLLERR, a connection that's gone won't bring any */
+			pfd.fd     = this->fd;
+			pfd.events = 0;
+			if ((wait = output_slice(until)) == 0)
+			{
+				Log2(warning, "No zerocopy completions in time, reconnecting", "[TCP output handler]");
+				this->err = ETIMEDOUT;
+				return FALSE;
+			}
+			if (poll(&pfd, 1, wait) == 1 && (pfd.revents & (POLLHUP|POLLNVAL)))
+			{
+				Log2(warning, "Connection gone while waiting for zerocopy completions", "[TCP output handler]");
+				this->err = EPIPE;
+				return FALSE;
+			}
+			continue;
+		}
+
+		/* Every notification covers a range of sends */
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			if (! (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) && ! (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			serr = (struct sock_extended_err*) CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			PRIVATE->zc_pending -= serr->ee_data - serr->ee_info + 1;
+			output_tcp_zerocopy_release(this, serr->ee_data);
+
+			/* The kernel copied anyway (loopback does), so plain sends are cheaper */
+			if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && PRIVATE->zc_enabled)
+			{
+				CustomLog(__FILE__, __LINE__, info, "Zerocopy sends to %s get copied, sending plainly", this->res);
+				PRIVATE->zc_enabled = FALSE;
+			}
+		}
+	}
+
 	return TRUE;
 }
 
 static int output_tcp_disconnect (struct output_handler *this)
 {
+	struct linger linger;
+
 	Require(
 		this != NULL &&
 		(
 			this->state == os_ready			||
+			this->state == os_sending		||
 			this->state == os_connecting	||
 			this->state == os_error			
 		)
 	);
 
+	/* Zerocopy sends still in flight get to complete. If they don't, they're
+	 * dropped with a reset, the messages they point at go after the close */
+	if (this->fd != -1 && PRIVATE->zc_pending > 0 && (this->state == os_error || ! output_tcp_zerocopy_reap(this, 0)))
+	{
+		linger.l_onoff  = 1;
+		linger.l_linger = 0;
+		setsockopt(this->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+	}
+	PRIVATE->zc_pending = 0;
+
+	/* Let queued writes settle, what didn't make it goes again on the next connection */
+	if (PRIVATE->ring != NULL)
+		output_uring_resume(PRIVATE->ring);
+
+	/* The next connection starts with a fresh compressed stream */
+	if (PRIVATE->compress)
+	{
+		deflateReset(&PRIVATE->stream);
+		PRIVATE->zlen = 0;
+	}
+
 	this->state = os_disconnected;
-	if (close(this->fd))
+	if (this->fd != -1 && close(this->fd))
 	{
 		this->fd = -1;
 		this->err = errno;
+		output_tcp_zerocopy_release(this, PRIVATE->zc_next - 1);
 		SysErr(this->err, "While closing outgoing tcp connection");
 		return FALSE;
 	}
 	
 	this->fd = -1;
+	output_tcp_zerocopy_release(this, PRIVATE->zc_next - 1);
 	return TRUE;
 }
 
@@ -112,9 +338,324 @@ static int output_tcp_timeout (struct output_handler *this)
 	return FALSE;
 }
 
-struct output_handler *output_handler_tcp_init (char *res)
+static void output_tcp_adapt_level (struct output_handler *this, int queued)
+{
+	int level, bits;
+
+	/* A deep queue means the link is the bottleneck, so spend CPU to save bytes */
+	for (bits = 0; queued > 1; queued >>= 1)
+		bits++;
+	level = MIN(TCP_LEVEL_MAX, TCP_LEVEL_MIN + bits / 2);
+
+	if (level == PRIVATE->level)
+		return;
+
+	/* The stream was flushed, but zlib may still close the current block */
+	PRIVATE->stream.next_in   = NULL;
+	PRIVATE->stream.avail_in  = 0;
+	PRIVATE->stream.next_out  = (Bytef*) PRIVATE->zbuf;
+	PRIVATE->stream.avail_out = PRIVATE->zsize;
+	if (deflateParams(&PRIVATE->stream, level, Z_DEFAULT_STRATEGY) == Z_OK)
+	{
+		CustomLog(__FILE__, __LINE__, info, "Compression level %d for %s", level, this->res);
+		PRIVATE->level = level;
+	}
+	PRIVATE->zlen = PRIVATE->zsize - PRIVATE->stream.avail_out;
+}
+
+static void output_tcp_deflate (struct output_handler *this, char *data, int len, int flush)
+{
+	PRIVATE->stream.next_in  = (Bytef*) data;
+	PRIVATE->stream.avail_in = len;
+
+	do
+	{
+		/* Make room for more output */
+		if (PRIVATE->zlen == PRIVATE->zsize)
+		{
+			PRIVATE->zsize *= 2;
+			PRIVATE->zbuf = (char*) realloc (PRIVATE->zbuf, PRIVATE->zsize);
+			SysFatal(PRIVATE->zbuf == NULL, errno, "While growing compression buffer");
+		}
+
+		PRIVATE->stream.next_out  = (Bytef*) PRIVATE->zbuf + PRIVATE->zlen;
+		PRIVATE->stream.avail_out = PRIVATE->zsize - PRIVATE->zlen;
+		deflate(&PRIVATE->stream, flush);
+		PRIVATE->zlen = PRIVATE->zsize - PRIVATE->stream.avail_out;
+	}
+	while (PRIVATE->stream.avail_out == 0);
+}
+
+static int output_tcp_writev_zerocopy (struct output_handler *this, struct output_batch *batch)
+{
+	struct iovec iov[IOV_MAX];
+	struct msghdr msg;
+	ssize_t sent;
+	int i, n, first, replayed;
+
+	/* Check if we're in a valid state */
+	Require(
+		this->state == os_ready   ||
+		this->state == os_sending
+	);
+
+	errno = 0;
+	replayed = FALSE;
+	while (batch->done < batch->count)
+	{
+		/* Don't let the kernel hold on to more than so many sends */
+		if (! output_tcp_zerocopy_reap(this, TCP_ZEROCOPY_SENDS - 1))
+		{
+			this->state = os_error;
+			return FALSE;
+		}
+
+		/* Gather as much of the remaining messages as we can in one go */
+		for (i = batch->done, n = 0; i < batch->count && n < IOV_MAX; i++, n++)
+		{
+			iov[n].iov_base = batch->msgs[i];
+			iov[n].iov_len  = batch->lens[i];
+		}
+		iov[0].iov_base  = (char*) iov[0].iov_base + batch->offset;
+		iov[0].iov_len  -= batch->offset;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov    = iov;
+		msg.msg_iovlen = n;
+
+		/* The kernel sends straight from the messages, and tells us when it's done with them */
+		sent = sendmsg(this->fd, &msg, MSG_ZEROCOPY);
+		if (sent <= 0)
+			break;
+
+		/* Which are kept until then. Journal records can't be, they're only
+		 * around until the batch is done, so for those the batch waits */
+		first = batch->done;
+		output_batch_advance(batch, sent);
+		for (i = first; i < batch->done || (i == batch->done && batch->offset > 0); i++)
+		{
+			if (message_replayed(batch->msgs[i]))
+				replayed = TRUE;
+			else
+				output_tcp_zerocopy_hold(this, batch->msgs[i]);
+		}
+
+		PRIVATE->zc_next++;
+		PRIVATE->zc_pending++;
+		this->state = os_sending;
+	}
+
+	this->err = errno;
+	if (batch->done == batch->count)
+		this->err = 0;
+
+	switch (this->err)
+	{
+		case 0:
+		case EINTR:
+		case EAGAIN:
+		case ENOBUFS:
+			/* Out of option memory, the sends in flight have to complete first */
+			if ((replayed || this->err == ENOBUFS) && ! output_tcp_zerocopy_reap(this, 0))
+			{
+				this->state = os_error;
+				return FALSE;
+			}
+
+			if (batch->done == batch->count)
+			{
+				this->state = os_ready;
+				return TRUE;
+			}
+
+			this->state = os_sending;
+			return FALSE;
+
+		default:
+			SysErr(this->err, "[output_tcp.c:output_tcp_writev_zerocopy] While trying to write");
+			this->state = os_error;
+			return FALSE;
+	}
+}
+
+static int output_tcp_writev_compressed (struct output_handler *this, struct output_batch *batch)
+{
+	ssize_t sent;
+	int i;
+
+	/* Check if we're in a valid state */
+	Require(
+		this->state == os_ready   ||
+		this->state == os_sending
+	);
+
+	/* Compressed bytes of another batch can't be taken back, start over */
+	if (PRIVATE->zlen > 0 && PRIVATE->zfirst != batch->msgs[batch->done])
+	{
+		Log2(warning, "Batch changed halfway a compressed send, reconnecting", "[TCP output handler]");
+		this->state = os_error;
+		return FALSE;
+	}
+
+	/* Compress the rest of the batch as a whole, flushed at the end */
+	if (PRIVATE->zlen == 0)
+	{
+		if (PRIVATE->adapt)
+			output_tcp_adapt_level(this, batch->count - batch->done);
+
+		for (i = batch->done; i < batch->count; i++)
+			output_tcp_deflate(this, batch->msgs[i], batch->lens[i], Z_NO_FLUSH);
+		output_tcp_deflate(this, NULL, 0, Z_SYNC_FLUSH);
+
+		PRIVATE->zsent  = 0;
+		PRIVATE->zfirst = batch->msgs[batch->done];
+		batch->offset   = 0;
+	}
+
+	/* Send what's left of it */
+	errno = 0;
+	while (PRIVATE->zsent < PRIVATE->zlen)
+	{
+		sent = write(this->fd, PRIVATE->zbuf + PRIVATE->zsent, PRIVATE->zlen - PRIVATE->zsent);
+		if (sent <= 0)
+			break;
+
+		PRIVATE->zsent += sent;
+		this->state = os_sending;
+	}
+
+	/* The batch only counts once all of it went out */
+	if (PRIVATE->zsent == PRIVATE->zlen)
+	{
+		PRIVATE->zlen = 0;
+		batch->done   = batch->count;
+		this->state   = os_ready;
+		return TRUE;
+	}
+
+	/* Check what errno says */
+	this->err = errno;
+	switch (this->err)
+	{
+		case 0:
+		case EINTR:
+		case EAGAIN:
+			this->state = os_sending;
+			return FALSE;
+
+		default:
+			SysErr(this->err, "[output_tcp.c:output_tcp_writev] While trying to write");
+			this->state = os_error;
+			return FALSE;
+	}
+}
+
+static int output_tcp_writev (struct output_handler *this, struct output_batch *batch)
+{
+	long len;
+	int i, ret;
+
+	/* The engine takes the whole batch, completions come in later */
+	if (PRIVATE->ring != NULL)
+	{
+		if (output_uring_write(PRIVATE->ring, this->fd, batch, NULL, FALSE))
+		{
+			this->state = os_ready;
+			return TRUE;
+		}
+
+		this->err = output_uring_error(PRIVATE->ring);
+		SysErr(this->err, "[output_tcp.c:output_tcp_writev] While trying to write");
+		this->state = os_error;
+		return FALSE;
+	}
+
+	/* Only send full segments until the batch is written */
+	if (PRIVATE->tuning.batching == net_batching_cork && ! PRIVATE->corked)
+		PRIVATE->corked = net_set_cork(this->fd, TRUE);
+
+	/* Zerocopy only pays off for big batches */
+	len = -batch->offset;
+	for (i = batch->done; i < batch->count && PRIVATE->zc_enabled; i++)
+		len += batch->lens[i];
+
+	/* Messages of earlier zerocopy sends are let go as their completions come in */
+	if (PRIVATE->zc_pending > 0 && ! output_tcp_zerocopy_reap(this, INT_MAX))
+	{
+		this->state = os_error;
+		return FALSE;
+	}
+
+	if (PRIVATE->compress)
+		ret = output_tcp_writev_compressed(this, batch);
+	else if (PRIVATE->zc_enabled && len >= PRIVATE->zerocopy)
+		ret = output_tcp_writev_zerocopy(this, batch);
+	else
+		ret = output_handler_common_writev(this, batch);
+
+	/* Batch is out, let the tail of it go */
+	if (ret && PRIVATE->corked)
+		PRIVATE->corked = ! net_set_cork(this->fd, FALSE);
+
+	return ret;
+}
+
+static int output_tcp_write (struct output_handler *this, char *str, int strlen, int *todo)
+{
+	struct output_batch batch;
+
+	/* A single message is just a tiny batch */
+	batch.msgs   = &str;
+	batch.lens   = &strlen;
+	batch.count  = 1;
+	batch.done   = 0;
+	batch.offset = strlen - *todo;
+
+	if (this->writev(this, &batch))
+	{
+		*todo = 0;
+		return TRUE;
+	}
+
+	*todo = strlen - batch.offset;
+	return FALSE;
+}
+
+static int output_tcp_flush (struct output_handler *this)
+{
+	/* Everything queued in the engine has to go out */
+	if (this->fd == -1)
+		return FALSE;
+
+	return output_uring_drain(PRIVATE->ring);
+}
+
+static int output_tcp_cleanup (struct output_handler *this)
+{
+	/* Send what's still queued, then disconnect while the private data is still around */
+	if (PRIVATE->ring != NULL && this->state == os_ready)
+		output_uring_drain(PRIVATE->ring);
+	if (this->state != os_disconnected)
+		this->disconnect(this);
+
+	/* Free private data */
+	output_uring_cleanup(PRIVATE->ring);
+	free(PRIVATE->zc_held);
+	if (PRIVATE->compress)
+	{
+		deflateEnd(&PRIVATE->stream);
+		free(PRIVATE->zbuf);
+	}
+	free(this->priv);
+	this->priv = NULL;
+
+	return output_handler_common_cleanup(this);
+}
+
+struct output_handler *output_handler_tcp_init (char *res, struct options *opts)
 {
 	struct output_handler *this = output_handler_common_init("tcp", res, -1);
+	char *compress, *level;
 	
 	/* Allocate private data part */
 	struct priv *private = (struct priv*) malloc (sizeof(struct priv));
@@ -123,9 +664,84 @@ struct output_handler *output_handler_tcp_init (char *res)
 
 	PRIVATE->proto = net_get_protocol(this->type);
 
+	/* Check if the stream should be compressed */
+	compress = options_get(opts, "compress", "none");
+	if (strcasecmp(compress, "zlib") == 0)
+		PRIVATE->compress = TRUE;
+	else if (strcasecmp(compress, "none") == 0)
+		PRIVATE->compress = FALSE;
+	else
+	{
+		fprintf(stderr, "Unknown compression: %s\n", compress);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Fixed level, or one that follows the queue depth */
+	level = options_get(opts, "compress-level", "auto");
+	PRIVATE->adapt = (strcasecmp(level, "auto") == 0);
+	PRIVATE->level = PRIVATE->adapt ? TCP_LEVEL_MIN : options_get_long(opts, "compress-level", 0);
+	if (PRIVATE->level < 0 || PRIVATE->level > 9)
+	{
+		fprintf(stderr, "Compression level should be auto or 0-9: %s\n", level);
+		exit(EXIT_FAILURE);
+	}
+
+	if (PRIVATE->compress)
+	{
+		memset(&PRIVATE->stream, 0, sizeof(z_stream));
+		Fatal(deflateInit(&PRIVATE->stream, PRIVATE->level) != Z_OK, "deflateInit failed", "[TCP output handler]");
+
+		PRIVATE->zsize = TCP_ZBUF_SIZE;
+		PRIVATE->zlen  = 0;
+		PRIVATE->zbuf  = (char*) malloc (PRIVATE->zsize);
+		SysFatal(PRIVATE->zbuf == NULL, errno, "While creating compression buffer");
+	}
+
+	/* Reconnect schedule, name resolution and socket tuning */
+	output_backoff_init(this, opts);
+	PRIVATE->dns_ttl = options_get_long(opts, "dns-ttl", RESOLVER_DEFAULT_TTL);
+	net_tuning_init(&PRIVATE->tuning, opts);
+	PRIVATE->zerocopy   = options_get_long(opts, "zerocopy", 0);
+	PRIVATE->zc_enabled = FALSE;
+	PRIVATE->zc_pending = 0;
+	PRIVATE->zc_next    = 0;
+	PRIVATE->zc_held    = NULL;
+	PRIVATE->zc_first   = 0;
+	PRIVATE->zc_count   = 0;
+	PRIVATE->zc_size    = 0;
+	PRIVATE->corked     = FALSE;
+	if (PRIVATE->zerocopy < 0)
+	{
+		fprintf(stderr, "Invalid zerocopy threshold for %s\n", res);
+		exit(EXIT_FAILURE);
+	}
+	if (PRIVATE->zerocopy > 0 && PRIVATE->compress)
+	{
+		fprintf(stderr, "zerocopy can't be combined with compress=zlib\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* The engine writes what it's given, compressed streams go the plain way */
+	PRIVATE->ring = NULL;
+	if (output_uring_wanted(opts))
+	{
+		if (PRIVATE->compress || PRIVATE->zerocopy > 0 || PRIVATE->tuning.batching == net_batching_cork)
+		{
+			fprintf(stderr, "engine=uring can't be combined with compress=zlib, zerocopy or batching=cork\n");
+			exit(EXIT_FAILURE);
+		}
+		PRIVATE->ring = output_uring_init(opts, TRUE);
+	}
+
 	this->connect    = output_tcp_connect;
 	this->disconnect = output_tcp_disconnect;
 	this->timeout    = output_tcp_timeout;
+	this->write      = output_tcp_write;
+	this->writev     = output_tcp_writev;
+	this->cleanup    = output_tcp_cleanup;
+
+	if (PRIVATE->ring != NULL)
+		this->flush = output_tcp_flush;
 
 	return this;
 }
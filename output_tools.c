@@ -4,7 +4,9 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <strings.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
@@ -79,6 +81,184 @@ int output_handler_common_write (struct output_handler *this, char *str, int str
 }
 
 
+void output_batch_advance (struct output_batch *batch, size_t sent)
+{
+	size_t left;
+
+	/* Walk over the messages that were (partially) sent */
+	while (sent > 0 && batch->done < batch->count)
+	{
+		left = batch->lens[batch->done] - batch->offset;
+		if (sent < left)
+		{
+			/* Message was sent partially */
+			batch->offset += sent;
+			return;
+		}
+
+		/* Message was sent completely */
+		sent -= left;
+		batch->done++;
+		batch->offset = 0;
+	}
+}
+
+
+void output_batch_compact (struct output_batch *batch, const char *delivered, char **msgs, int *lens)
+{
+	int i, j;
+
+	/* Stable partition, delivered messages first and in order */
+	for (i = 0, j = 0; i < batch->count; i++)
+	{
+		if (delivered[i])
+		{
+			msgs[j] = batch->msgs[i];
+			lens[j] = batch->lens[i];
+			j++;
+		}
+	}
+	batch->done   = j;
+	batch->offset = 0;
+
+	/* Followed by the rest, also in order */
+	for (i = 0; i < batch->count; i++)
+	{
+		if (! delivered[i])
+		{
+			msgs[j] = batch->msgs[i];
+			lens[j] = batch->lens[i];
+			j++;
+		}
+	}
+
+	memcpy(batch->msgs, msgs, batch->count * sizeof(char*));
+	memcpy(batch->lens, lens, batch->count * sizeof(int));
+}
+
+
+unsigned int output_key_hash (const char *msg, int len, int field)
+{
+	const char *start, *end, *stop;
+	unsigned int hash;
+	int n;
+
+	/* Find the requested whitespace separated field, if any */
+	start = msg;
+	end   = msg + len;
+	for (n = 1; field > 0; n++)
+	{
+		while (start < end && (*start == ' ' || *start == '\t'))
+			start++;
+
+		/* Field not present, fall back to the whole line */
+		if (start == end || *start == '\n')
+		{
+			start = msg;
+			break;
+		}
+
+		for (stop = start; stop < end && *stop != ' ' && *stop != '\t' && *stop != '\n'; stop++)
+			;
+
+		if (n == field)
+		{
+			end = stop;
+			break;
+		}
+
+		start = stop;
+	}
+
+	/* FNV-1a */
+	for (hash = 2166136261u; start < end; start++)
+	{
+		hash ^= (unsigned char) *start;
+		hash *= 16777619u;
+	}
+
+	/* Spread similar keys over the whole range (murmur3 finalizer) */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+
+int output_handler_common_writev (struct output_handler *this, struct output_batch *batch)
+{
+	struct iovec iov[IOV_MAX];
+	ssize_t sent;
+	int i, n;
+	
+	/* Check if we're in a valid state */
+	Require(
+		this->state == os_ready   ||
+		this->state == os_sending
+	);
+
+	/* Try to send (what's left of) the batch */
+	errno = 0;
+	sent  = 0;
+	while (batch->done < batch->count)
+	{
+		/* Gather as much of the remaining messages as we can in one go */
+		for (i = batch->done, n = 0; i < batch->count && n < IOV_MAX; i++, n++)
+		{
+			iov[n].iov_base = batch->msgs[i];
+			iov[n].iov_len  = batch->lens[i];
+		}
+		iov[0].iov_base  = (char*) iov[0].iov_base + batch->offset;
+		iov[0].iov_len  -= batch->offset;
+
+		sent = writev(this->fd, iov, n);
+		if (sent <= 0)
+			break;
+
+		/* It appears something was sent */
+		output_batch_advance(batch, sent);
+		this->state = os_sending;
+	}
+
+	/* Check if we're done with the batch */
+	if (batch->done == batch->count)
+	{
+		/* We're done sending */
+		this->state = os_ready;
+		return TRUE;
+	}
+
+	/* Check what errno says */
+	this->err = errno;
+	switch (this->err)
+	{
+		/* Check if this error is recoverable */
+		case 0:
+			Log2(warning, "SUCCES?? on writev", "[output_tools.c]{writev}");
+			this->state = os_sending;
+			return FALSE;
+		case EINTR:
+		case EAGAIN:
+			Log2(warning, "EAGAIN on writev", "[output_tools.c]{writev}");
+			this->state = os_sending;
+			return FALSE;
+		case EPIPE:
+			Log2(warning, "EPIPE on writev", "[output_tools.c]{writev}");
+			this->state = os_error;
+			return FALSE;
+		
+		/* Otherwise goto the error state */
+		default:
+			SysErr(this->err, "[output_tools.c:output_handler_common_writev] While trying to write");
+			this->state = os_error;
+			return FALSE;
+	}
+}
+
+
 int output_handler_common_do_nothing (struct output_handler *this)
 {
 	/* Print a message for logging purposes */
@@ -89,6 +269,13 @@ int output_handler_common_do_nothing (struct output_handler *this)
 }
 
 
+int output_handler_common_flush (struct output_handler *this)
+{
+	/* Whatever was written is as confirmed as it will ever be */
+	return TRUE;
+}
+
+
 int output_handler_common_cleanup (struct output_handler *this)
 {
 	/* Disconnect if needed */
@@ -120,11 +307,19 @@ struct output_handler *output_handler_common_init  (char *type, char *res, int f
 	this->res       = res;
 	this->type      = type;
 	this->priv      = NULL;
+
+	/* Default reconnect schedule, outputs that connect take it from their options */
+	output_backoff_init(this, NULL);
 	
 	this->connect    = NULL;
 	this->disconnect = NULL;
 	this->timeout    = output_handler_common_do_nothing;
 	this->write      = output_handler_common_write;
+	this->writev     = output_handler_common_writev;
+	this->deliver    = NULL;
+	this->flush      = output_handler_common_flush;
+	this->pending    = NULL;
+	this->reclaim    = NULL;
 	this->cleanup    = output_handler_common_cleanup;
 
 	return this;
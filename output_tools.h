@@ -1,12 +1,21 @@
 #ifndef OUTPUT_TOOLS_H
 #define OUTPUT_TOOLS_H
 
+#include <sys/types.h>
+
 #include "output.h"
 
 extern int output_handler_common_write   (struct output_handler*, char *msg, int msglen, int *done);
+extern int output_handler_common_writev  (struct output_handler*, struct output_batch*);
+extern int output_handler_common_flush   (struct output_handler*);
 extern int output_handler_common_cleanup (struct output_handler *);
 extern int output_handler_common_nothing (struct output_handler*);
 
 extern struct output_handler *output_handler_common_init  (char *type, char *res, int fd);
 
+extern void output_batch_advance (struct output_batch*, size_t sent);
+extern void output_batch_compact (struct output_batch*, const char *delivered, char **msgs, int *lens);
+
+extern unsigned int output_key_hash (const char *msg, int len, int field);
+
 #endif /* OUTPUT_TOOLS_H */
@@ -31,7 +31,7 @@ static int output_udp_cleanup (struct output_handler *this)
 	return 0;
 }
 
-struct output_handler *output_handler_udp_init (char *res)
+struct output_handler *output_handler_udp_init (char *res, struct options *opts)
 {
 	struct output_handler *retval = output_handler_common_init("file", res, -1);
 	
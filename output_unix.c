@@ -1,44 +1,264 @@
+#include "defines.h"
 #include "output_unix.h"
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stddef.h>
 #include <strings.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 
 #include "output_tools.h"
+#include "deadletter.h"
 #include "log.h"
 
+/* Maximum number of datagrams handed to sendmmsg at once */
+#define UNIX_MMSG_MAX	256
+
+#define PRIVATE ((struct priv*) this->priv)
+struct priv {
+	int socktype;	/* SOCK_DGRAM or SOCK_STREAM, 0 while unknown */
+	struct deadletter *dead;	/* Where datagrams go that are too large */
+};
+
+static int connect_to_named_socket (const char *filename, int socktype)
+{
+	struct sockaddr_un name;
+	int sock, err;
+	size_t size;
+
+	/* Create the socket. */
+	sock = socket (PF_LOCAL, socktype, 0);
+	if (sock < 0)
+		return -1;
+
+	/* Connect to the named socket. */
+	name.sun_family = AF_LOCAL;
+	strncpy (name.sun_path, filename, sizeof (name.sun_path));
+	name.sun_path[sizeof (name.sun_path) - 1] = '\0';
+
+	size = (offsetof (struct sockaddr_un, sun_path) + strlen (name.sun_path) + 1);
+
+	if (connect(sock, (struct sockaddr *) &name, size) == -1)
+	{
+		err = errno;
+		close(sock);
+		errno = err;
+		return -1;
+	}
+
+	return sock;
+}
+
 static int output_unix_connect (struct output_handler *this)
 {
-	return 0;
+	Require(
+		this != NULL &&
+		this->state == os_disconnected &&
+		this->fd == -1
+	);
+
+	/* Try the socket type that worked before, datagram first otherwise */
+	this->fd = connect_to_named_socket(this->res, PRIVATE->socktype ? PRIVATE->socktype : SOCK_DGRAM);
+	if (this->fd == -1 && errno == EPROTOTYPE)
+	{
+		/* The peer is of the other kind */
+		PRIVATE->socktype = (PRIVATE->socktype == SOCK_STREAM ? SOCK_DGRAM : SOCK_STREAM);
+		this->fd = connect_to_named_socket(this->res, PRIVATE->socktype);
+	}
+	else if (this->fd != -1 && PRIVATE->socktype == 0)
+	{
+		PRIVATE->socktype = SOCK_DGRAM;
+	}
+
+	/* Check if connect succeeded */
+	if (this->fd == -1)
+	{
+		/* Peer not (yet) there, it could be (re)created any moment */
+		this->err = errno;
+		SysErr(this->err, "While trying to connect to unix socket");
+		this->state = os_error;
+		return FALSE;
+	}
+
+	Log2(info, PRIVATE->socktype == SOCK_DGRAM ? "Connected to datagram socket" : "Connected to stream socket", "[UNIX output handler]");
+
+	/* All went well, we're connected */
+	this->state = os_ready;
+	return TRUE;
 }
 
 static int output_unix_disconnect (struct output_handler *this)
 {
-	return 0;
+	Require(
+		this != NULL &&
+		this->state != os_disconnected
+	);
+
+	this->state = os_disconnected;
+	if (this->fd != -1 && close(this->fd))
+	{
+		this->fd = -1;
+		this->err = errno;
+		SysErr(this->err, "While closing unix socket");
+		return FALSE;
+	}
+
+	this->fd = -1;
+	return TRUE;
 }
 
-static int output_unix_write (struct output_handler *this, char *str, int strlen, int*send)
+static int output_unix_write (struct output_handler *this, char *str, int strlen, int *todo)
 {
-	return 0;
+	struct output_batch batch;
+
+	/* A single message is just a tiny batch */
+	batch.msgs   = &str;
+	batch.lens   = &strlen;
+	batch.count  = 1;
+	batch.done   = 0;
+	batch.offset = strlen - *todo;
+
+	if (this->writev(this, &batch))
+	{
+		*todo = 0;
+		return TRUE;
+	}
+
+	*todo = strlen - batch.offset;
+	return FALSE;
+}
+
+static int output_unix_writev (struct output_handler *this, struct output_batch *batch)
+{
+	struct mmsghdr hdrs[UNIX_MMSG_MAX];
+	struct iovec iov[UNIX_MMSG_MAX];
+	struct timespec pause;
+	int i, n, sent;
+
+	/* Stream sockets are served by the common writev path */
+	if (PRIVATE->socktype == SOCK_STREAM)
+		return output_handler_common_writev(this, batch);
+
+	/* Check if we're in a valid state */
+	Require(
+		this->state == os_ready   ||
+		this->state == os_sending
+	);
+
+	/* Datagrams are sent whole, each message is one datagram */
+	batch->offset = 0;
+
+	errno = 0;
+	while (batch->done < batch->count)
+	{
+		/* Gather as many datagrams as we can in one go */
+		memset(hdrs, 0, sizeof(hdrs));
+		for (i = batch->done, n = 0; i < batch->count && n < UNIX_MMSG_MAX; i++, n++)
+		{
+			/* The trailing newline is a genbuf detail, not part of the datagram */
+			iov[n].iov_base = batch->msgs[i];
+			iov[n].iov_len  = batch->lens[i] - (batch->msgs[i][batch->lens[i] - 1] == '\n');
+			hdrs[n].msg_hdr.msg_iov    = &iov[n];
+			hdrs[n].msg_hdr.msg_iovlen = 1;
+		}
+
+		sent = sendmmsg(this->fd, hdrs, n, MSG_DONTWAIT);
+		if (sent <= 0)
+		{
+			/* Skip datagrams that can never be sent */
+			if (sent == -1 && errno == EMSGSIZE)
+			{
+				deadletter_write(PRIVATE->dead, "too large for a datagram", batch->msgs[batch->done], batch->lens[batch->done]);
+				batch->done++;
+				errno = 0;
+				continue;
+			}
+
+			break;
+		}
+
+		batch->done += sent;
+		this->state = os_sending;
+	}
+
+	/* Check if we're done with the batch */
+	if (batch->done == batch->count)
+	{
+		this->state = os_ready;
+		return TRUE;
+	}
+
+	/* Check what errno says */
+	this->err = errno;
+	switch (this->err)
+	{
+		/* Receiver is lagging, that's backpressure rather than loss */
+		case ENOBUFS:
+			/* Not reported by select, so take a short breath */
+			pause.tv_sec  = 0;
+			pause.tv_nsec = 1000000;
+			nanosleep(&pause, NULL);
+		case 0:
+		case EINTR:
+		case EAGAIN:
+			Log2(debug, "Datagram socket is full", "[UNIX output handler]");
+			this->state = os_sending;
+			return FALSE;
+
+		/* Peer socket went away or was recreated, reconnect */
+		case ECONNREFUSED:
+		case ENOTCONN:
+		case ENOENT:
+		case EPIPE:
+			Log2(warning, "Peer socket is gone, reconnecting", "[UNIX output handler]");
+			this->state = os_error;
+			return FALSE;
+
+		/* Otherwise goto the error state */
+		default:
+			SysErr(this->err, "[output_unix.c:output_unix_writev] While trying to send");
+			this->state = os_error;
+			return FALSE;
+	}
 }
 
 static int output_unix_cleanup (struct output_handler *this)
 {
-	return 0;
+	/* Free private data */
+	deadletter_cleanup(PRIVATE->dead);
+	free(this->priv);
+	this->priv = NULL;
+
+	return output_handler_common_cleanup(this);
 }
 
-struct output_handler *output_handler_unix_init (char *res)
+struct output_handler *output_handler_unix_init (char *res, struct options *opts)
 {
-	struct output_handler *retval = output_handler_common_init("file", res, -1);
-	
-	retval->connect    = output_unix_connect;
-	retval->disconnect = output_unix_disconnect;
-	retval->write      = output_unix_write;
-	retval->cleanup    = output_unix_cleanup;
-
-	return retval;
+	struct output_handler *this = output_handler_common_init("unix", res, -1);
+
+	/* Allocate private data part */
+	struct priv *private = (struct priv*) malloc (sizeof(struct priv));
+	SysFatal(private == NULL, errno, "While creating UNIX output private data");
+	this->priv       = private;
+
+	PRIVATE->socktype = 0;
+	PRIVATE->dead     = deadletter_init(res, opts);
+
+	/* A restarted peer gets a fast retry, a dead one is left alone */
+	output_backoff_init(this, opts);
+
+	this->connect    = output_unix_connect;
+	this->disconnect = output_unix_disconnect;
+	this->write      = output_unix_write;
+	this->writev     = output_unix_writev;
+	this->cleanup    = output_unix_cleanup;
+
+	return this;
 }
@@ -2,7 +2,8 @@
 #define GENCACHE_OUTPUT_UNIX_H
 
 #include "output.h"
+#include "options.h"
 
-extern struct output_handler *output_handler_unix_init (char *);
+extern struct output_handler *output_handler_unix_init (char *, struct options *);
 
 #endif /* GENCACHE_OUTPUT_UNIX_H */
@@ -0,0 +1,417 @@
+#include "defines.h"
+#include "output_uring.h"
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "output_tools.h"
+#include "log.h"
+
+enum slot_state {
+	slot_free,
+	slot_queued,		/* Filled, waiting to be submitted */
+	slot_inflight		/* Submitted, waiting for completion */
+};
+
+struct uring_slot {
+	enum slot_state state;
+	char *buf;
+	int   len;
+	int   done;		/* Bytes written so far */
+	off_t offset;		/* File offset of buf, unused for streams */
+	int   datasync;		/* fdatasync once written */
+	int   synced;
+	int   ops;		/* Submitted operations not completed yet */
+};
+
+struct output_uring {
+	int fd;			/* The ring */
+	int target;		/* What we write to */
+	int stream;
+	int fixed;		/* Buffers are registered */
+	int err;
+
+	/* Submission queue */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_entries;
+	int      to_submit;
+
+	/* Completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void  *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+
+	/* Buffers, used in order */
+	struct uring_slot *slots;
+	int slot_count;
+	int slot_size;
+	int head;
+	int used;
+	int inflight;
+	char *memory;
+};
+
+int output_uring_wanted (struct options *opts)
+{
+	char *engine = options_get(opts, "engine", "write");
+
+	if (strcasecmp(engine, "uring") == 0)
+		return TRUE;
+	else if (strcasecmp(engine, "write") == 0)
+		return FALSE;
+
+	fprintf(stderr, "Unknown engine: %s\n", engine);
+	exit(EXIT_FAILURE);
+}
+
+static struct io_uring_sqe *uring_get_sqe (struct output_uring *this)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail, index;
+
+	/* We're the only producer, the kernel moves the head */
+	tail = *this->sq_tail;
+	if (tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) >= this->sq_entries)
+		return NULL;
+
+	index = tail & *this->sq_mask;
+	sqe = &this->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	this->sq_array[index] = index;
+
+	__atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	this->to_submit++;
+	return sqe;
+}
+
+static int uring_enter (struct output_uring *this, int wait)
+{
+	int ret;
+
+	do
+	{
+		ret = syscall(SYS_io_uring_enter, this->fd, this->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	}
+	while (ret == -1 && errno == EINTR);
+
+	if (ret == -1)
+	{
+		SysErr(errno, "While entering io_uring");
+		return FALSE;
+	}
+
+	this->to_submit -= MIN(ret, this->to_submit);
+	return TRUE;
+}
+
+static void uring_submit (struct output_uring *this)
+{
+	struct io_uring_sqe *sqe;
+	struct uring_slot *slot;
+	int i, n;
+
+	for (i = 0; i < this->used; i++)
+	{
+		n = (this->head + i) % this->slot_count;
+		slot = &this->slots[n];
+		if (slot->state == slot_inflight)
+			continue;
+
+		/* Streams have one write out at a time, syncs wait for earlier writes */
+		if ((this->stream || slot->datasync) && this->inflight > 0)
+			break;
+
+		/* Room for a write and a sync */
+		if (*this->sq_tail - __atomic_load_n(this->sq_head, __ATOMIC_ACQUIRE) + 2 > this->sq_entries)
+			break;
+
+		slot->ops = 0;
+		if (slot->done < slot->len)
+		{
+			sqe = uring_get_sqe(this);
+			sqe->opcode    = this->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+			sqe->fd        = this->target;
+			sqe->addr      = (unsigned long) (slot->buf + slot->done);
+			sqe->len       = slot->len - slot->done;
+			sqe->off       = this->stream ? (__u64) -1 : slot->offset + slot->done;
+			sqe->buf_index = this->fixed ? n : 0;
+			sqe->user_data = n * 2;
+
+			/* The sync only goes when the write went through completely */
+			if (slot->datasync && ! slot->synced)
+				sqe->flags |= IOSQE_IO_LINK;
+			slot->ops++;
+		}
+
+		if (slot->datasync && ! slot->synced)
+		{
+			sqe = uring_get_sqe(this);
+			sqe->opcode      = IORING_OP_FSYNC;
+			sqe->fd          = this->target;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			sqe->user_data   = n * 2 + 1;
+			slot->ops++;
+		}
+
+		slot->state = slot_inflight;
+		this->inflight++;
+
+		if (this->stream || slot->datasync)
+			break;
+	}
+
+	if (this->to_submit > 0)
+		uring_enter(this, 0);
+}
+
+static void uring_complete (struct output_uring *this, struct io_uring_cqe *cqe)
+{
+	struct uring_slot *slot = &this->slots[cqe->user_data / 2];
+	int sync = cqe->user_data % 2;
+
+	/* Pipes and the like can't be synced, that's fine */
+	if (cqe->res >= 0 || (sync && (cqe->res == -EINVAL || cqe->res == -EROFS)))
+	{
+		if (sync)
+			slot->synced = TRUE;
+		else
+			slot->done += cqe->res;
+	}
+	else if (cqe->res != -ECANCELED && cqe->res != -EINTR && cqe->res != -EAGAIN)
+	{
+		/* Real trouble, the slot stays for another try */
+		this->err = -cqe->res;
+		SysErr(this->err, sync ? "While syncing through io_uring" : "While writing through io_uring");
+	}
+
+	if (--slot->ops > 0)
+		return;
+	this->inflight--;
+
+	/* Done, or short and queued again for the rest */
+	if (slot->done == slot->len && (! slot->datasync || slot->synced))
+		slot->state = slot_free;
+	else
+		slot->state = slot_queued;
+
+	/* Hand back buffers in order */
+	while (this->used > 0 && this->slots[this->head].state == slot_free)
+	{
+		this->head = (this->head + 1) % this->slot_count;
+		this->used--;
+	}
+}
+
+static int uring_reap (struct output_uring *this, int wait)
+{
+	unsigned head, tail;
+
+	if (wait && this->inflight > 0 && ! uring_enter(this, 1))
+		return FALSE;
+
+	head = *this->cq_head;
+	tail = __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++)
+		uring_complete(this, &this->cqes[head & *this->cq_mask]);
+	__atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+
+	return this->err == 0;
+}
+
+int output_uring_write (struct output_uring *this, int fd, struct output_batch *batch, off_t *offset, int datasync)
+{
+	struct uring_slot *slot;
+	int i, pos, chunk;
+
+	this->target = fd;
+
+	/* Collect what finished in the mean time */
+	if (! uring_reap(this, FALSE))
+		return FALSE;
+
+	while (batch->done < batch->count)
+	{
+		/* All buffers busy, wait for one */
+		if (this->used == this->slot_count)
+		{
+			uring_submit(this);
+			if (! uring_reap(this, TRUE))
+				return FALSE;
+			continue;
+		}
+
+		/* Copy as much of the batch as fits, we own it from here on */
+		slot = &this->slots[(this->head + this->used) % this->slot_count];
+		slot->len = 0;
+		pos = batch->offset;
+		for (i = batch->done; i < batch->count && slot->len < this->slot_size; i++)
+		{
+			chunk = MIN(batch->lens[i] - pos, this->slot_size - slot->len);
+			memcpy(slot->buf + slot->len, batch->msgs[i] + pos, chunk);
+			slot->len += chunk;
+			pos = 0;
+		}
+		output_batch_advance(batch, slot->len);
+
+		slot->done     = 0;
+		slot->offset   = (offset != NULL ? *offset : 0);
+		slot->datasync = (datasync && batch->done == batch->count);
+		slot->synced   = FALSE;
+		slot->state    = slot_queued;
+		this->used++;
+
+		if (offset != NULL)
+			*offset += slot->len;
+	}
+
+	uring_submit(this);
+	return TRUE;
+}
+
+int output_uring_drain (struct output_uring *this)
+{
+	/* Keep going until everything is written, or it fails */
+	while (this->used > 0 && this->err == 0)
+	{
+		uring_submit(this);
+		if (! uring_reap(this, TRUE))
+			break;
+	}
+
+	return this->err == 0 && this->used == 0;
+}
+
+void output_uring_resume (struct output_uring *this)
+{
+	int i;
+
+	/* Let what's in flight finish, it may still fail */
+	while (this->inflight > 0)
+		uring_reap(this, TRUE);
+
+	/* Whatever is left goes again, from the start of its buffer */
+	for (i = 0; i < this->used; i++)
+	{
+		if (this->stream)
+			this->slots[(this->head + i) % this->slot_count].done = 0;
+	}
+
+	this->err = 0;
+}
+
+int output_uring_error (struct output_uring *this)
+{
+	return this->err;
+}
+
+void output_uring_cleanup (struct output_uring *this)
+{
+	if (this == NULL)
+		return;
+
+	while (this->inflight > 0 && uring_reap(this, TRUE))
+		;
+
+	munmap(this->sqes, this->sqes_size);
+	if (this->cq_ring != this->sq_ring)
+		munmap(this->cq_ring, this->cq_ring_size);
+	munmap(this->sq_ring, this->sq_ring_size);
+	close(this->fd);
+
+	free(this->memory);
+	free(this->slots);
+	free(this);
+}
+
+struct output_uring *output_uring_init (struct options *opts, int stream)
+{
+	struct io_uring_params params;
+	struct output_uring *this;
+	struct iovec *iov;
+	int i;
+
+	this = (struct output_uring*) calloc (1, sizeof(struct output_uring));
+	SysFatal(this == NULL, errno, "While creating io_uring engine");
+
+	this->stream     = stream;
+	this->slot_count = options_get_long(opts, "uring-depth", 8);
+	this->slot_size  = options_get_long(opts, "uring-buffer", 256 * 1024);
+	if (this->slot_count < 1 || this->slot_size < 1)
+	{
+		fprintf(stderr, "Invalid uring-depth or uring-buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* A write and a sync for every buffer */
+	memset(&params, 0, sizeof(params));
+	this->fd = syscall(SYS_io_uring_setup, this->slot_count * 2, &params);
+	if (this->fd == -1)
+	{
+		SysErr(errno, "io_uring is not available, using plain writes");
+		free(this);
+		return NULL;
+	}
+
+	/* Map the rings */
+	this->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	this->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		this->sq_ring_size = this->cq_ring_size = MAX(this->sq_ring_size, this->cq_ring_size);
+
+	this->sq_ring = mmap(NULL, this->sq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, this->fd, IORING_OFF_SQ_RING);
+	SysFatal(this->sq_ring == MAP_FAILED, errno, "While mapping io_uring submission queue");
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		this->cq_ring = this->sq_ring;
+	else
+	{
+		this->cq_ring = mmap(NULL, this->cq_ring_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, this->fd, IORING_OFF_CQ_RING);
+		SysFatal(this->cq_ring == MAP_FAILED, errno, "While mapping io_uring completion queue");
+	}
+
+	this->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	this->sqes = mmap(NULL, this->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, this->fd, IORING_OFF_SQES);
+	SysFatal(this->sqes == MAP_FAILED, errno, "While mapping io_uring submission entries");
+
+	this->sq_head    = (unsigned*) ((char*) this->sq_ring + params.sq_off.head);
+	this->sq_tail    = (unsigned*) ((char*) this->sq_ring + params.sq_off.tail);
+	this->sq_mask    = (unsigned*) ((char*) this->sq_ring + params.sq_off.ring_mask);
+	this->sq_array   = (unsigned*) ((char*) this->sq_ring + params.sq_off.array);
+	this->sq_entries = params.sq_entries;
+	this->cq_head    = (unsigned*) ((char*) this->cq_ring + params.cq_off.head);
+	this->cq_tail    = (unsigned*) ((char*) this->cq_ring + params.cq_off.tail);
+	this->cq_mask    = (unsigned*) ((char*) this->cq_ring + params.cq_off.ring_mask);
+	this->cqes       = (struct io_uring_cqe*) ((char*) this->cq_ring + params.cq_off.cqes);
+
+	/* The buffers, registered with the kernel if it lets us */
+	this->slots  = (struct uring_slot*) calloc (this->slot_count, sizeof(struct uring_slot));
+	this->memory = (char*) malloc ((size_t) this->slot_count * this->slot_size);
+	iov = (struct iovec*) malloc (this->slot_count * sizeof(struct iovec));
+	SysFatal(this->slots == NULL || this->memory == NULL || iov == NULL, errno, "While creating io_uring buffers");
+
+	for (i = 0; i < this->slot_count; i++)
+	{
+		this->slots[i].buf = this->memory + (size_t) i * this->slot_size;
+		iov[i].iov_base    = this->slots[i].buf;
+		iov[i].iov_len     = this->slot_size;
+	}
+
+	this->fixed = (syscall(SYS_io_uring_register, this->fd, IORING_REGISTER_BUFFERS, iov, this->slot_count) == 0);
+	if (! this->fixed)
+		SysErr(errno, "Can't register io_uring buffers, using unregistered ones");
+	free(iov);
+
+	return this;
+}
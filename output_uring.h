@@ -0,0 +1,32 @@
+#ifndef GENCACHE_OUTPUT_URING_H
+#define GENCACHE_OUTPUT_URING_H
+
+#include <sys/types.h>
+
+#include "output.h"
+#include "options.h"
+
+/** io_uring write engine
+ *
+ * A drop-in for the write()/writev() path of the file and tcp outputs,
+ * selected with -O engine=uring. Batches are copied into a handful of
+ * registered buffers and submitted without waiting for them, so several
+ * batches can be in flight while the logger fetches the next one. Files
+ * are written at explicit offsets, so their writes may complete in any
+ * order; streams have one write in flight at a time to keep them ordered.
+ *
+ * Writes that fail stay queued. After a reconnect they are sent again,
+ * from the start of their buffer.
+ */
+struct output_uring;
+
+extern int  output_uring_wanted  (struct options *);
+extern struct output_uring *output_uring_init (struct options *, int stream);
+
+extern int  output_uring_write   (struct output_uring *, int fd, struct output_batch *, off_t *offset, int datasync);
+extern int  output_uring_drain   (struct output_uring *);
+extern void output_uring_resume  (struct output_uring *);
+extern int  output_uring_error   (struct output_uring *);
+extern void output_uring_cleanup (struct output_uring *);
+
+#endif /* GENCACHE_OUTPUT_URING_H */
@@ -0,0 +1,165 @@
+#include "defines.h"
+#include "ratelimit.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include "log.h"
+#include "output.h"
+
+/* Longest nap while throttled, so new limits are picked up quickly */
+#define RATELIMIT_MAX_NAP	100000
+
+static double ratelimit_burst (long rate, long burst)
+{
+	return burst > 0 ? burst : rate;
+}
+
+static void ratelimit_refill (struct ratelimit *this)
+{
+	struct timespec now;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - this->refilled.tv_sec) + (now.tv_nsec - this->refilled.tv_nsec) / 1e9;
+	this->refilled = now;
+
+	this->byte_tokens = MIN(ratelimit_burst(this->byte_rate, this->byte_burst), this->byte_tokens + this->byte_rate * elapsed);
+	this->msg_tokens  = MIN(ratelimit_burst(this->msg_rate,  this->msg_burst),  this->msg_tokens  + this->msg_rate  * elapsed);
+}
+
+char *ratelimit_set (struct ratelimit *this, struct options *opts, int strict)
+{
+	static char *names[] = { "byte-rate", "byte-burst", "msg-rate", "msg-burst" };
+	long values[4];
+	char *value;
+	int i;
+
+	/* Check all of them before changing anything */
+	pthread_mutex_lock(&this->mutex);
+	values[0] = this->byte_rate;
+	values[1] = this->byte_burst;
+	values[2] = this->msg_rate;
+	values[3] = this->msg_burst;
+	pthread_mutex_unlock(&this->mutex);
+
+	for (i = 0; i < 4; i++)
+	{
+		value = options_get(opts, names[i], NULL);
+		if (value != NULL && (! options_parse_long(value, &values[i]) || values[i] < 0))
+			return names[i];
+	}
+
+	/* Options that are not ours are a mistake if they were meant for us only */
+	if (strict && options_unused(opts) != NULL)
+		return options_unused(opts);
+
+	pthread_mutex_lock(&this->mutex);
+	ratelimit_refill(this);
+	this->byte_rate  = values[0];
+	this->byte_burst = values[1];
+	this->msg_rate   = values[2];
+	this->msg_burst  = values[3];
+
+	/* Unlimited buckets don't keep debts */
+	if (this->byte_rate == 0)
+		this->byte_tokens = 0;
+	if (this->msg_rate == 0)
+		this->msg_tokens = 0;
+	pthread_mutex_unlock(&this->mutex);
+
+	return NULL;
+}
+
+int ratelimit_batch (struct ratelimit *this, int max)
+{
+	int burst;
+
+	/* A batch bigger than the message burst would only go out in lumps */
+	pthread_mutex_lock(&this->mutex);
+	burst = (this->msg_rate > 0 ? ratelimit_burst(this->msg_rate, this->msg_burst) : max);
+	pthread_mutex_unlock(&this->mutex);
+
+	return MAX(1, MIN(burst, max));
+}
+
+void ratelimit_take (struct ratelimit *this, int msgs, long bytes)
+{
+	struct timespec start, now, nap;
+	double wait;
+
+	pthread_mutex_lock(&this->mutex);
+	ratelimit_refill(this);
+
+	if (this->byte_rate > 0)
+		this->byte_tokens -= bytes;
+	if (this->msg_rate > 0)
+		this->msg_tokens -= msgs;
+
+	/* Pay off the debt, the limits may change while we wait, a shutdown deadline doesn't */
+	start = this->refilled;
+	while ((this->byte_tokens < 0 || this->msg_tokens < 0) && ! output_expired())
+	{
+		wait = 0;
+		if (this->byte_tokens < 0 && this->byte_rate > 0)
+			wait = MAX(wait, -this->byte_tokens / this->byte_rate);
+		if (this->msg_tokens < 0 && this->msg_rate > 0)
+			wait = MAX(wait, -this->msg_tokens / this->msg_rate);
+		pthread_mutex_unlock(&this->mutex);
+
+		wait = MIN(wait * 1e6, RATELIMIT_MAX_NAP) + 1;
+		nap.tv_sec  = 0;
+		nap.tv_nsec = (long) wait * 1000;
+		nanosleep(&nap, NULL);
+
+		pthread_mutex_lock(&this->mutex);
+		ratelimit_refill(this);
+	}
+
+	now = this->refilled;
+	this->throttled += (now.tv_sec - start.tv_sec) * 1000000LL + (now.tv_nsec - start.tv_nsec) / 1000;
+	pthread_mutex_unlock(&this->mutex);
+}
+
+int ratelimit_describe (struct ratelimit *this, char *buf, int size)
+{
+	int len;
+
+	pthread_mutex_lock(&this->mutex);
+	len = snprintf(buf, size, "byte-rate=%ld byte-burst=%ld msg-rate=%ld msg-burst=%ld throttled-ms=%lld",
+		this->byte_rate, this->byte_burst, this->msg_rate, this->msg_burst, this->throttled / 1000);
+	pthread_mutex_unlock(&this->mutex);
+
+	return len;
+}
+
+void ratelimit_cleanup (struct ratelimit *this)
+{
+	pthread_mutex_destroy(&this->mutex);
+	free(this);
+}
+
+struct ratelimit *ratelimit_init (struct options *opts)
+{
+	struct ratelimit *this;
+	char *bad;
+
+	this = (struct ratelimit*) calloc (1, sizeof(struct ratelimit));
+	SysFatal(this == NULL, errno, "While creating rate limit");
+
+	pthread_mutex_init(&this->mutex, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &this->refilled);
+
+	if ((bad = ratelimit_set(this, opts, FALSE)) != NULL)
+	{
+		fprintf(stderr, "Invalid value for option %s: %s\n", bad, options_get(opts, bad, ""));
+		exit(EXIT_FAILURE);
+	}
+
+	/* Start with a full bucket */
+	this->byte_tokens = ratelimit_burst(this->byte_rate, this->byte_burst);
+	this->msg_tokens  = ratelimit_burst(this->msg_rate, this->msg_burst);
+
+	return this;
+}
@@ -0,0 +1,37 @@
+#ifndef GENCACHE_RATELIMIT_H
+#define GENCACHE_RATELIMIT_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "options.h"
+
+/** Token bucket rate limit of a destination
+ *
+ * Two buckets, one for bytes and one for messages, each refilled at its
+ * rate and holding at most its burst. Delivery takes what it sends from
+ * both, running into debt if needed, and waits until the debt is paid
+ * off. A rate of zero means unlimited. Limits can be changed while the
+ * logger is running, the time spent waiting is kept for the metrics.
+ */
+struct ratelimit {
+	pthread_mutex_t mutex;
+
+	/* A burst of zero is a second worth of the rate */
+	long   byte_rate, byte_burst;
+	long   msg_rate,  msg_burst;
+	double byte_tokens, msg_tokens;
+	struct timespec refilled;
+
+	long long throttled;	/* Microseconds spent waiting */
+};
+
+extern struct ratelimit *ratelimit_init (struct options *opts);
+
+extern char *ratelimit_set      (struct ratelimit *, struct options *opts, int strict);
+extern int   ratelimit_batch    (struct ratelimit *, int max);
+extern void  ratelimit_take     (struct ratelimit *, int msgs, long bytes);
+extern int   ratelimit_describe (struct ratelimit *, char *buf, int size);
+extern void  ratelimit_cleanup  (struct ratelimit *);
+
+#endif /* GENCACHE_RATELIMIT_H */
@@ -13,9 +13,11 @@
 #include <pthread.h>
 
 #include "buffer.h"
+#include "message.h"
 #include "log.h"
 
 #define HANDLERS_STEPPING	8
+#define PENDING_STEPPING	1024
 
 static void reader_add_source (struct reader *this, struct input_handler *handler)
 {
@@ -34,6 +36,7 @@ static void reader_add_source (struct reader *this, struct input_handler *handle
 			
 			this->handlers[this->handler_count].handler = handler;
 			this->handlers[this->handler_count].fd      = handler->getfd(handler);
+			this->handlers[this->handler_count].id      = ++this->next_id;
 
 			CustomLog(__FILE__, __LINE__, error, "add_source(handler=%p, [type=%s, res=%s, fd=%d])", handler, handler->type, handler->res, this->handlers[this->handler_count].fd);
 
@@ -89,10 +92,114 @@ static void remove_handler (struct reader *this, int index)
 	pthread_testcancel();
 }
 
+static void reader_push (struct reader *this, char *data)
+{
+	int i;
+
+	/* One reference for every destination's buffer */
+	message_ref(data, this->buffer_count - 1);
+	
+	for (i = 0; i < this->buffer_count; i++)
+		this->buffers[i]->push(this->buffers[i], data);
+}
+
+static void reader_truncate (struct reader *this)
+{
+	long long done;
+	time_t now;
+	int i, oldstate;
+
+	/* Once a second is plenty, it only costs a replay of what's still in it */
+	now = time(NULL);
+	if (this->wal == NULL || now == this->wal_trimmed)
+		return;
+	this->wal_trimmed = now;
+
+	/* Whatever every destination is done with */
+	done = this->buffers[0]->progress(this->buffers[0]);
+	for (i = 1; i < this->buffer_count; i++)
+		done = MIN(done, this->buffers[i]->progress(this->buffers[i]));
+
+	if (done > this->wal_released)
+	{
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+		journal_release(this->wal, done);
+		journal_trim(this->wal);
+		pthread_setcancelstate(oldstate, NULL);
+		this->wal_released = done;
+	}
+}
+
+static void reader_commit (struct reader *this)
+{
+	int oldstate;
+
+	if (this->pending_next == this->pending_count)
+		return;
+
+	/* Everything reported since the last commit goes to disk in one go */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	if (! journal_flush(this->wal))
+	{
+		Log2(error, "Write-ahead log failed, queueing messages without it", "Reader");
+	}
+	pthread_setcancelstate(oldstate, NULL);
+
+	/* Only then are they queued */
+	while (this->pending_next < this->pending_count)
+		reader_push(this, this->pending[this->pending_next++]);
+
+	this->pending_count = 0;
+	this->pending_next  = 0;
+
+	reader_truncate(this);
+}
+
+static void reader_replay (struct reader *this)
+{
+	char *msg, *copy;
+	int oldstate, len;
+	long count;
+
+	/* What earlier runs didn't get out goes first */
+	count = 0;
+	while (TRUE)
+	{
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+		copy = NULL;
+		if ((msg = journal_peek(this->wal)) != NULL)
+		{
+			len  = strlen(msg);
+			copy = message_alloc(len + 1);
+			SysFatal(copy == NULL, errno, "While replaying the write-ahead log");
+			memcpy(copy, msg, len + 1);
+			message_set_seq(copy, journal_advance(this->wal));
+		}
+		pthread_setcancelstate(oldstate, NULL);
+
+		if (copy == NULL)
+			break;
+
+		reader_push(this, copy);
+		count++;
+	}
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	journal_stop_reading(this->wal);
+	pthread_setcancelstate(oldstate, NULL);
+
+	if (count > 0)
+		CustomLog(__FILE__, __LINE__, warning, "Replayed %ld messages from the write-ahead log", count);
+}
+
 static void reader_run (struct reader *this)
 {
+	struct timeval timeout;
 	int i, n, fd, count, active, status;
 
+	if (this->wal != NULL)
+		reader_replay(this);
+
 rerun:
 	do
 	{
@@ -109,7 +216,11 @@ rerun:
 				
 				/* Got message, push it on the queue */
 				Log(debug, "I'm trying to cope with something here");
+				this->current_source = this->handlers[i].id;
 				status = handler->read(handler, this);
+
+				/* Queue what it reported, if it didn't already */
+				reader_commit(this);
 				
 				switch (status)
 				{
@@ -144,9 +255,14 @@ rerun:
 		if (this->handler_count == 0)
 			return;
 
+		/* The write-ahead log is truncated while idle as well */
+		reader_truncate(this);
+		timeout.tv_sec  = 1;
+		timeout.tv_usec = 0;
+
 		Log(debug, "Calling select()");
 	}
-	while ((active = select(n+1, &this->fds, NULL, NULL, NULL)) != -1);
+	while ((active = select(n+1, &this->fds, NULL, NULL, this->wal != NULL ? &timeout : NULL)) != -1);
 
 	if (errno == EBADF)
 	{
@@ -176,11 +292,61 @@ rerun:
 	SysErr(errno, "Select failed");
 }
 
+static void reader_add_buffer (struct reader *this, struct buffer *buffer)
+{
+	void *tmp;
+
+	Require(buffer != NULL);
+
+	tmp = realloc(this->buffers, (this->buffer_count + 1) * sizeof(struct buffer*));
+	SysFatal(tmp == NULL, errno, "[Reader] Realloc for more buffers failed");
+
+	this->buffers = (struct buffer**) tmp;
+	this->buffers[this->buffer_count] = buffer;
+	this->buffer_count++;
+}
+
+static void reader_set_wal (struct reader *this, struct journal *wal)
+{
+	Require(wal != NULL && this->wal == NULL);
+
+	this->wal = wal;
+}
+
 static void reader_report_data (struct reader *this, char *data)
 {
+	int oldstate;
+	void *tmp;
+
 	Require(data != NULL);
-	
-	this->buffer->push(this->buffer, data);
+
+	/* Remember where it came from */
+	message_set_source(data, this->current_source);
+
+	if (this->wal == NULL)
+	{
+		reader_push(this, data);
+		return;
+	}
+
+	/* Written ahead, it's queued on the next commit */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+	if (! journal_append(this->wal, data, strlen(data)))
+	{
+		Log2(error, "Write-ahead log refused a message, queueing it without", "Reader");
+	}
+	message_set_seq(data, journal_written(this->wal));
+
+	if (this->pending_count == this->pending_alloc)
+	{
+		tmp = realloc(this->pending, (this->pending_alloc + PENDING_STEPPING) * sizeof(char*));
+		SysFatal(tmp == NULL, errno, "[Reader] Realloc for pending messages failed");
+
+		this->pending = (char**) tmp;
+		this->pending_alloc += PENDING_STEPPING;
+	}
+	this->pending[this->pending_count++] = data;
+	pthread_setcancelstate(oldstate, NULL);
 }
 
 static void reader_cleanup (struct reader *this)
@@ -193,18 +359,28 @@ static void reader_cleanup (struct reader *this)
 		this->handlers[i].handler->cleanup(this->handlers[i].handler);
 	}
 
-	/* Add the finished symbol to the buffer */
-	this->buffer->push(this->buffer, NULL);
+	/* Whatever was reported still goes, it's in the write-ahead log already */
+	if (this->wal != NULL)
+		reader_commit(this);
+	free(this->pending);
+
+	/* Add the finished symbol to the buffers */
+	for (i = 0; i < this->buffer_count; i++)
+		this->buffers[i]->push(this->buffers[i], NULL);
 
 	/* Cleanup the handlers_list */
 	if (this->handlers != NULL)
 		free(this->handlers);
+
+	/* The buffers themselves are cleaned up by their owner */
+	if (this->buffers != NULL)
+		free(this->buffers);
 	
 	/* Cleanup ourselves */
 	free(this);
 }
 
-struct reader *reader_init(struct buffer *buffer)
+struct reader *reader_init()
 {
 	struct reader *retval = (struct reader*) malloc (sizeof(struct reader));
 
@@ -213,13 +389,26 @@ struct reader *reader_init(struct buffer *buffer)
 	retval->handler_count  = 0;
 	retval->handlers_alloc = 0;
 	retval->handlers       = NULL;
-	retval->buffer         = buffer;
+	retval->buffer_count   = 0;
+	retval->buffers        = NULL;
+	retval->next_id        = 0;
+	retval->current_source = 0;
+	retval->wal            = NULL;
+	retval->pending        = NULL;
+	retval->pending_count  = 0;
+	retval->pending_next   = 0;
+	retval->pending_alloc  = 0;
+	retval->wal_released   = 0;
+	retval->wal_trimmed    = 0;
 
 	FD_ZERO(&retval->fds);
 
 	retval->add_source  = reader_add_source;
+	retval->add_buffer  = reader_add_buffer;
+	retval->set_wal     = reader_set_wal;
 	retval->run         = reader_run;
 	retval->report_data = reader_report_data;
+	retval->commit      = reader_commit;
 	retval->cleanup     = reader_cleanup;
 
 	return retval;
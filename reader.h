@@ -3,8 +3,10 @@
 
 #include "input.h"
 #include "buffer.h"
+#include "journal.h"
 
 #include <sys/types.h>
+#include <time.h>
 
 struct reader {
 	int handler_count;
@@ -12,15 +14,35 @@ struct reader {
 	
 	struct handler_list {
 		int  fd;
+		int  id;
 		struct input_handler *handler;
 	} *handlers;
 
+	/* Source identification for messages */
+	int next_id;
+	int current_source;
+
 	fd_set fds;
-	struct buffer *buffer;
+
+	/* Every destination has its own buffer */
+	int buffer_count;
+	struct buffer **buffers;
+
+	/* Optional write-ahead log, messages are queued once they're in it */
+	struct journal *wal;
+	char **pending;
+	int    pending_count;
+	int    pending_next;
+	int    pending_alloc;
+	long long wal_released;
+	time_t    wal_trimmed;
 
 	void (*add_source)  (struct reader*, struct input_handler*);
+	void (*add_buffer)  (struct reader*, struct buffer*);
+	void (*set_wal)     (struct reader*, struct journal*);
 	void (*run)         (struct reader*);
 	void (*report_data) (struct reader*, char*);
+	void (*commit)      (struct reader*);
 
 	void (*cleanup) (struct reader*);
 };
@@ -0,0 +1,33 @@
+#ifndef GENCACHE_RELAY_H
+#define GENCACHE_RELAY_H
+
+/** Acknowledged relay protocol between two genbufs
+ *
+ * The sender frames every batch as a header followed by the lines of the
+ * batch. All header fields are 32 bit, in network byte order:
+ *
+ *   magic   RELAY_FRAME_MAGIC
+ *   seq     sequence number of the frame, one up for every frame
+ *   count   number of lines in the payload
+ *   length  payload bytes following the header
+ *
+ * The receiver answers with cumulative acks, an ack for a sequence number
+ * confirms that frame and all frames before it:
+ *
+ *   magic   RELAY_ACK_MAGIC
+ *   seq     last frame that was taken in
+ *
+ * Unacknowledged frames are sent again, in order, after a reconnect. So a
+ * frame can arrive twice, but it never gets lost.
+ */
+
+#define RELAY_FRAME_MAGIC	0x47425246	/* "GBRF" */
+#define RELAY_ACK_MAGIC		0x47425241	/* "GBRA" */
+
+#define RELAY_HEADER_SIZE	16
+#define RELAY_ACK_SIZE		8
+
+/* Anything bigger is taken as a corrupt stream */
+#define RELAY_MAX_PAYLOAD	(64 * 1024 * 1024)
+
+#endif /* GENCACHE_RELAY_H */
@@ -0,0 +1,202 @@
+#include "defines.h"
+#include "resolver.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "log.h"
+
+/* Seconds before a name that didn't resolve is tried again */
+#define RESOLVER_RETRY		5
+
+struct resolver_entry {
+	char *res;
+	char *host;		/* NULL for the local host */
+	char *port;
+
+	struct sockaddr_storage *addrs;
+	socklen_t *lens;
+	int count;
+	int next;		/* Address handed out next */
+
+	int    pending;		/* Waiting for the resolver thread */
+	int    error;		/* Last lookup failed */
+	int    ttl;
+	time_t expires;
+
+	struct resolver_entry *next_entry;
+};
+
+static pthread_mutex_t resolver_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  resolver_cond  = PTHREAD_COND_INITIALIZER;
+static pthread_once_t  resolver_once  = PTHREAD_ONCE_INIT;
+static struct resolver_entry *resolver_cache = NULL;
+
+static void resolver_store (struct resolver_entry *entry, struct addrinfo *result)
+{
+	struct addrinfo *ai;
+	int n;
+
+	for (n = 0, ai = result; ai != NULL; ai = ai->ai_next)
+		n++;
+
+	free(entry->addrs);
+	free(entry->lens);
+	entry->addrs = (struct sockaddr_storage*) calloc (n, sizeof(struct sockaddr_storage));
+	entry->lens  = (socklen_t*) calloc (n, sizeof(socklen_t));
+	SysFatal(entry->addrs == NULL || entry->lens == NULL, errno, "While caching resolved addresses");
+
+	for (n = 0, ai = result; ai != NULL; ai = ai->ai_next, n++)
+	{
+		memcpy(&entry->addrs[n], ai->ai_addr, ai->ai_addrlen);
+		entry->lens[n] = ai->ai_addrlen;
+	}
+
+	entry->count = n;
+	entry->next  = 0;
+}
+
+static int resolver_getaddrinfo (const char *host, const char *port, int flags, struct addrinfo **result)
+{
+	struct addrinfo hints;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = flags | AI_NUMERICSERV;
+
+	return getaddrinfo(host, port, &hints, result);
+}
+
+static void *resolver_run (void *arg)
+{
+	struct resolver_entry *entry;
+	struct addrinfo *result;
+	char *host, *port;
+	int ret;
+
+	pthread_mutex_lock(&resolver_mutex);
+	while (TRUE)
+	{
+		/* Wait for a name to look up */
+		for (entry = resolver_cache; entry != NULL && ! entry->pending; entry = entry->next_entry)
+			;
+		if (entry == NULL)
+		{
+			pthread_cond_wait(&resolver_cond, &resolver_mutex);
+			continue;
+		}
+
+		/* Entries are never freed, but the lookup runs unlocked */
+		host = entry->host;
+		port = entry->port;
+		pthread_mutex_unlock(&resolver_mutex);
+
+		ret = resolver_getaddrinfo(host, port, 0, &result);
+		if (ret != 0)
+			CustomLog(__FILE__, __LINE__, error, "Can't resolve %s: %s", entry->res, gai_strerror(ret));
+
+		pthread_mutex_lock(&resolver_mutex);
+		if (ret == 0)
+		{
+			resolver_store(entry, result);
+			freeaddrinfo(result);
+		}
+
+		/* A failed refresh keeps the old addresses around */
+		entry->error   = (ret != 0);
+		entry->expires = time(NULL) + (ret == 0 ? entry->ttl : RESOLVER_RETRY);
+		entry->pending = FALSE;
+	}
+
+	return NULL;
+}
+
+static void resolver_start ()
+{
+	pthread_t thread;
+
+	SysFatal(pthread_create(&thread, NULL, resolver_run, NULL), errno, "On resolver thread start");
+	pthread_detach(thread);
+}
+
+static struct resolver_entry *resolver_entry_init (const char *res)
+{
+	struct resolver_entry *entry;
+	struct addrinfo *result;
+	const char *colon;
+
+	entry = (struct resolver_entry*) calloc (1, sizeof(struct resolver_entry));
+	SysFatal(entry == NULL, errno, "While creating resolver cache entry");
+
+	/* [v6addr]:port, host:port or port */
+	colon = strrchr(res, ':');
+	if (res[0] == '[' && colon != NULL && colon > res && colon[-1] == ']')
+		entry->host = strndup(res + 1, colon - res - 2);
+	else if (colon != NULL)
+		entry->host = strndup(res, colon - res);
+
+	entry->res  = strdup(res);
+	entry->port = strdup(colon != NULL ? colon + 1 : res);
+	SysFatal(entry->res == NULL || entry->port == NULL || (colon != NULL && entry->host == NULL), errno, "While creating resolver cache entry");
+
+	/* Addresses don't need the resolver thread, and never expire */
+	if (resolver_getaddrinfo(entry->host, entry->port, AI_NUMERICHOST, &result) == 0)
+	{
+		resolver_store(entry, result);
+		freeaddrinfo(result);
+		entry->expires = LONG_MAX;
+	}
+
+	return entry;
+}
+
+int resolver_lookup (const char *res, int ttl, struct sockaddr_storage *addr, socklen_t *len)
+{
+	struct resolver_entry *entry;
+
+	pthread_once(&resolver_once, resolver_start);
+
+	pthread_mutex_lock(&resolver_mutex);
+	for (entry = resolver_cache; entry != NULL && strcmp(entry->res, res) != 0; entry = entry->next_entry)
+		;
+
+	if (entry == NULL)
+	{
+		entry = resolver_entry_init(res);
+		entry->next_entry = resolver_cache;
+		resolver_cache = entry;
+	}
+	entry->ttl = ttl;
+
+	/* Expired or never resolved, have it looked up */
+	if (! entry->pending && time(NULL) >= entry->expires)
+	{
+		entry->pending = TRUE;
+		pthread_cond_signal(&resolver_cond);
+	}
+
+	/* Stale addresses are better than none while the refresh runs */
+	if (entry->count == 0)
+	{
+		errno = (entry->error ? EHOSTUNREACH : EAGAIN);
+		pthread_mutex_unlock(&resolver_mutex);
+		return FALSE;
+	}
+
+	*len = entry->lens[entry->next];
+	memcpy(addr, &entry->addrs[entry->next], *len);
+	entry->next = (entry->next + 1) % entry->count;
+	pthread_mutex_unlock(&resolver_mutex);
+
+	return TRUE;
+}
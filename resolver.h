@@ -0,0 +1,22 @@
+#ifndef GENCACHE_RESOLVER_H
+#define GENCACHE_RESOLVER_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/** Cached, asynchronous name resolution
+ *
+ * Resources (host:port, [v6addr]:port or just a port for the local host)
+ * are resolved with getaddrinfo on a thread of their own, so connecting
+ * never waits for DNS. Results are cached for ttl seconds, and served a
+ * little longer while a refresh is in progress. Every lookup hands out
+ * the next address of the set, IPv4 and IPv6 alike.
+ *
+ * A lookup that has no address yet fails with EAGAIN, one whose name
+ * doesn't resolve with EHOSTUNREACH.
+ */
+#define RESOLVER_DEFAULT_TTL	60
+
+extern int resolver_lookup (const char *res, int ttl, struct sockaddr_storage *addr, socklen_t *len);
+
+#endif /* GENCACHE_RESOLVER_H */
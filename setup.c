@@ -12,11 +12,15 @@
 #include "output_udp.h"
 #include "output_unix.h"
 #include "output_file.h"
+#include "output_pool.h"
+#include "output_parallel.h"
+#include "output_relay.h"
+#include "output_failover.h"
 
 #include "log.h"
 
 struct input_handler*
-	create_input_handler (enum io_types type, char *res)
+	create_input_handler (enum io_types type, char *res, struct options *opts)
 {
 	struct input_handler *retval = NULL;
 	
@@ -27,19 +31,19 @@ struct input_handler*
 	switch (type)
 	{
 		case type_file:
-			retval = input_handler_file_init(res);
+			retval = input_handler_file_init(res, opts);
 			break;
 
 		case type_unix:
-			retval = input_handler_unix_init(res);
+			retval = input_handler_unix_init(res, opts);
 			break;
 
 		case type_udp:
-			retval = input_handler_udp_init(res);
+			retval = input_handler_udp_init(res, opts);
 			break;
 
 		case type_tcp:
-			retval = input_handler_tcp_init(res);
+			retval = input_handler_tcp_init(res, opts);
 			break;
 
 		default:
@@ -59,7 +63,7 @@ struct input_handler*
 }
 
 struct output_handler*
-	create_output_handler (enum io_types type, char *res)
+	create_output_handler (enum io_types type, char *res, struct options *opts)
 {
 	struct output_handler *retval = NULL;
 	
@@ -70,19 +74,33 @@ struct output_handler*
 	switch (type)
 	{
 		case type_file:
-			retval = output_handler_file_init(res);
+			retval = output_handler_file_init(res, opts);
 			break;
 
 		case type_unix:
-			retval = output_handler_unix_init(res);
+			retval = output_handler_unix_init(res, opts);
 			break;
 
 		case type_udp:
-			retval = output_handler_udp_init(res);
+			retval = output_handler_udp_init(res, opts);
 			break;
 
 		case type_tcp:
-			retval = output_handler_tcp_init(res);
+			/* Several connections to the same collector need a sender each */
+			if (options_get_long(opts, "connections", 1) > 1)
+				retval = output_handler_parallel_init(res, opts);
+			else if (output_relay_wanted(opts))
+				retval = output_handler_relay_init(res, opts);
+			else
+				retval = output_handler_tcp_init(res, opts);
+			break;
+
+		case type_pool:
+			retval = output_handler_pool_init(res, opts);
+			break;
+
+		case type_failover:
+			retval = output_handler_failover_init(res, opts);
 			break;
 
 		default:
@@ -96,6 +114,8 @@ struct output_handler*
 		retval->disconnect != NULL &&
 		retval->timeout    != NULL &&
 		retval->write      != NULL &&
+		retval->writev     != NULL &&
+		retval->flush      != NULL &&
 		retval->cleanup    != NULL
 	);
 
@@ -4,8 +4,9 @@
 #include "types.h"
 #include "input.h"
 #include "output.h"
+#include "options.h"
 
-extern struct  input_handler  *create_input_handler (enum io_types type, char *res);
-extern struct output_handler *create_output_handler (enum io_types type, char *res);
+extern struct  input_handler  *create_input_handler (enum io_types type, char *res, struct options *opts);
+extern struct output_handler *create_output_handler (enum io_types type, char *res, struct options *opts);
 
 #endif /* GENCACHE_SETUP_H */
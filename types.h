@@ -7,6 +7,8 @@ enum io_types {
 	type_tcp,
 	type_unix,
 	type_file,
+	type_pool,
+	type_failover,
 	type_unknown
 };
 
@@ -0,0 +1,566 @@
+#include "defines.h"
+#include "upgrade.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "input_tcp_connection.h"
+#include "input_tools.h"
+#include "message.h"
+#include "log.h"
+
+/* Bytes of a queue snapshot written in one go */
+#define UPGRADE_WRITE_SIZE	(1024 * 1024)
+
+/* Messages taken from a queue at once */
+#define UPGRADE_BATCH_SIZE	1024
+
+enum upgrade_what {
+	upgrade_socket_fd,	/* A source's socket */
+	upgrade_sockets_done,
+	upgrade_ready,		/* The new process is set up */
+	upgrade_connection,	/* A plain TCP connection, followed by its partial line */
+	upgrade_queue_fd,	/* Snapshot of a destination's queue */
+	upgrade_all_done
+};
+
+struct upgrade_header {
+	int  what;
+	int  index;	/* Destination of a queue */
+	int  len;	/* Bytes following the header */
+	char type[16];
+	char res[256];
+};
+
+/* A message in a queue snapshot, followed by its bytes */
+struct upgrade_record {
+	int len;
+	int source;
+};
+
+/* Sockets of the sources, our own to hand over or the ones taken over */
+struct upgrade_source {
+	char type[16];
+	char res[256];
+	int  fd;
+};
+
+static int channel = -1;
+static pid_t child = -1;
+
+static struct upgrade_source *sources = NULL;
+static int source_count = 0;
+
+static int upgrade_send (struct upgrade_header *header, int fd, const char *data)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int sent;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base   = header;
+	iov.iov_len    = sizeof(struct upgrade_header);
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+
+	/* The socket rides along with the header */
+	if (fd != -1)
+	{
+		memset(control, 0, sizeof(control));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+
+	if (sendmsg(channel, &msg, MSG_NOSIGNAL) != sizeof(struct upgrade_header))
+	{
+		SysErr(errno, "While handing over to the new process");
+		return FALSE;
+	}
+
+	for (sent = 0; sent < header->len; )
+	{
+		int n = send(channel, data + sent, header->len - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+		{
+			SysErr(errno, "While handing over to the new process");
+			return FALSE;
+		}
+		sent += n;
+	}
+
+	return TRUE;
+}
+
+static int upgrade_recv (struct upgrade_header *header, int *fd, char *data, int size)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int got, n;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base       = header;
+	iov.iov_len        = sizeof(struct upgrade_header);
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control;
+	msg.msg_controllen = sizeof(control);
+
+	*fd = -1;
+	if (recvmsg(channel, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(struct upgrade_header))
+		return FALSE;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (header->len < 0 || header->len > size)
+		return FALSE;
+
+	for (got = 0; got < header->len; got += n)
+	{
+		if ((n = recv(channel, data + got, header->len - got, 0)) <= 0)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void upgrade_abort ()
+{
+	/* The new process goes once it sees the channel close, or we help it */
+	close(channel);
+	channel = -1;
+
+	if (child != -1)
+	{
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+		child = -1;
+	}
+}
+
+static void upgrade_add_source (char *type, char *res, int fd)
+{
+	sources = (struct upgrade_source*) realloc (sources, (source_count + 1) * sizeof(struct upgrade_source));
+	SysFatal(sources == NULL, errno, "While noting sockets of sources");
+
+	memset(&sources[source_count], 0, sizeof(struct upgrade_source));
+	strncpy(sources[source_count].type, type, sizeof(sources[source_count].type) - 1);
+	strncpy(sources[source_count].res,  res,  sizeof(sources[source_count].res) - 1);
+	sources[source_count].fd = fd;
+	source_count++;
+}
+
+void upgrade_sources (struct reader *rd)
+{
+	struct input_handler *handler;
+	int i;
+
+	/* Only listening sockets, connections come and go */
+	for (i = 0; i < rd->handler_count; i++)
+	{
+		handler = rd->handlers[i].handler;
+		if (strcmp(handler->type, "tcp-server") == 0 ||
+		    strcmp(handler->type, "udp")        == 0 ||
+		    strcmp(handler->type, "unix")       == 0)
+			upgrade_add_source(handler->type, handler->res, rd->handlers[i].fd);
+	}
+}
+
+static char *upgrade_binary ()
+{
+	static char path[4096];
+	char *deleted;
+	int len;
+
+	/* The binary we run from, or the one that replaced it */
+	if ((len = readlink("/proc/self/exe", path, sizeof(path) - 1)) == -1)
+		return NULL;
+	path[len] = '\0';
+
+	if ((deleted = strstr(path, " (deleted)")) != NULL && deleted[10] == '\0')
+		*deleted = '\0';
+
+	return path;
+}
+
+int upgrade_start (char **argv)
+{
+	struct upgrade_header header;
+	extern char **environ;
+	char **envp, *binary, var[64];
+	struct pollfd pfd;
+	int fds[2], i, n, fd, maxfd;
+
+	Log(error, "Upgrading, starting the new process");
+
+	/* Everything for the new process is ready before the fork */
+	for (n = 0; environ[n] != NULL; n++)
+		;
+	envp = (char**) malloc ((n + 2) * sizeof(char*));
+	SysFatal(envp == NULL, errno, "While preparing the upgrade");
+	for (i = 0, n = 0; environ[i] != NULL; i++)
+		if (strncmp(environ[i], UPGRADE_ENV "=", strlen(UPGRADE_ENV) + 1) != 0)
+			envp[n++] = environ[i];
+	snprintf(var, sizeof(var), "%s=%d", UPGRADE_ENV, STDERR_FILENO + 1);
+	envp[n++] = var;
+	envp[n]   = NULL;
+
+	maxfd = sysconf(_SC_OPEN_MAX);
+	if ((binary = upgrade_binary()) == NULL)
+	{
+		SysErr(errno, "While looking for the binary");
+		free(envp);
+		return FALSE;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+	{
+		SysErr(errno, "While creating the upgrade channel");
+		free(envp);
+		return FALSE;
+	}
+
+	if ((child = fork()) == 0)
+	{
+		/* Only the channel goes along, no socket should stay open in here */
+		if (fds[1] == STDERR_FILENO + 1)
+			fcntl(fds[1], F_SETFD, 0);
+		else
+			dup2(fds[1], STDERR_FILENO + 1);
+		for (fd = STDERR_FILENO + 2; fd < maxfd; fd++)
+			close(fd);
+
+		execve(binary, argv, envp);
+		_exit(127);
+	}
+
+	free(envp);
+	close(fds[1]);
+	channel = fds[0];
+
+	if (child == -1)
+	{
+		SysErr(errno, "While starting the new process");
+		upgrade_abort();
+		return FALSE;
+	}
+
+	/* The sockets of the sources, the new process sets up with them */
+	for (i = 0; i < source_count; i++)
+	{
+		memset(&header, 0, sizeof(header));
+		header.what = upgrade_socket_fd;
+		memcpy(header.type, sources[i].type, sizeof(header.type));
+		memcpy(header.res,  sources[i].res,  sizeof(header.res));
+		if (! upgrade_send(&header, sources[i].fd, NULL))
+		{
+			upgrade_abort();
+			return FALSE;
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.what = upgrade_sockets_done;
+	if (! upgrade_send(&header, -1, NULL))
+	{
+		upgrade_abort();
+		return FALSE;
+	}
+
+	/* Wait for it to be ready, we keep serving if it doesn't make it */
+	pfd.fd     = channel;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, UPGRADE_TIMEOUT) != 1 || ! upgrade_recv(&header, &fd, NULL, 0) || header.what != upgrade_ready)
+	{
+		fprintf(stderr, "Upgrade failed, the new process didn't get ready\n");
+		upgrade_abort();
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void upgrade_connections (struct reader *rd)
+{
+	struct upgrade_header header;
+	struct ih_common_priv *priv;
+	struct input_handler *handler;
+	char *partial;
+	int i, count;
+
+	if (channel == -1)
+		return;
+
+	partial = (char*) malloc (GENCACHE_MAX_MSG_SIZE);
+	SysFatal(partial == NULL, errno, "While handing over connections");
+
+	/* Plain connections carry nothing but lines, they go as they are */
+	for (i = 0, count = 0; i < rd->handler_count; i++)
+	{
+		handler = rd->handlers[i].handler;
+		if (strcmp(handler->type, "tcp-conn") != 0)
+			continue;
+
+		priv = (struct ih_common_priv*) handler->priv;
+
+		memset(&header, 0, sizeof(header));
+		header.what = upgrade_connection;
+		header.len  = input_buffer_copy(priv->inbuf, partial);
+		if (! upgrade_send(&header, rd->handlers[i].fd, partial))
+			break;
+		count++;
+	}
+
+	free(partial);
+	CustomLog(__FILE__, __LINE__, error, "Handed over %d connections", count);
+}
+
+long upgrade_queue (int index, struct buffer *buffer)
+{
+	struct upgrade_header header;
+	struct upgrade_record record;
+	char *msgs[UPGRADE_BATCH_SIZE];
+	char *out;
+	long total;
+	int fd, i, count, used, len;
+
+	if (channel == -1)
+		return 0;
+
+	if ((fd = memfd_create("genbuf-queue", MFD_CLOEXEC)) == -1)
+	{
+		SysErr(errno, "While creating queue snapshot");
+		return 0;
+	}
+
+	out = (char*) malloc (UPGRADE_WRITE_SIZE);
+	SysFatal(out == NULL, errno, "While creating queue snapshot");
+
+	/* Up to the end of input marker, if it's still there */
+	total = 0;
+	used  = 0;
+	while (buffer->size(buffer) > 0 && (count = buffer->pop_batch(buffer, msgs, UPGRADE_BATCH_SIZE)) > 0)
+	{
+		for (i = 0; i < count; i++)
+		{
+			len = strlen(msgs[i]);
+			if (used + sizeof(record) + len > UPGRADE_WRITE_SIZE)
+			{
+				SysFatal(write(fd, out, used) != used, errno, "While writing queue snapshot");
+				used = 0;
+			}
+
+			record.len    = len;
+			record.source = message_source(msgs[i]);
+			memcpy(out + used, &record, sizeof(record));
+			used += sizeof(record);
+
+			/* Bigger than the buffer, it goes by itself */
+			if (len > UPGRADE_WRITE_SIZE - sizeof(record))
+			{
+				SysFatal(write(fd, out, used) != used || write(fd, msgs[i], len) != len, errno, "While writing queue snapshot");
+				used = 0;
+			}
+			else
+			{
+				memcpy(out + used, msgs[i], len);
+				used += len;
+			}
+
+			message_free(msgs[i]);
+			total++;
+		}
+	}
+	SysFatal(used > 0 && write(fd, out, used) != used, errno, "While writing queue snapshot");
+	free(out);
+
+	memset(&header, 0, sizeof(header));
+	header.what  = upgrade_queue_fd;
+	header.index = index;
+	if (! upgrade_send(&header, fd, NULL))
+		total = 0;
+
+	close(fd);
+	return total;
+}
+
+void upgrade_done ()
+{
+	struct upgrade_header header;
+
+	if (channel == -1)
+		return;
+
+	memset(&header, 0, sizeof(header));
+	header.what = upgrade_all_done;
+	upgrade_send(&header, -1, NULL);
+
+	close(channel);
+	channel = -1;
+}
+
+int upgrade_init ()
+{
+	struct upgrade_header header;
+	char *value;
+	int fd;
+
+	if ((value = getenv(UPGRADE_ENV)) == NULL)
+		return FALSE;
+
+	channel = atoi(value);
+	unsetenv(UPGRADE_ENV);
+	SysFatal(fcntl(channel, F_SETFD, FD_CLOEXEC) == -1, errno, "On the upgrade channel");
+
+	/* The sockets of the old process, until it says that was all */
+	while (TRUE)
+	{
+		Fatal(! upgrade_recv(&header, &fd, NULL, 0), "Lost the old process", "Upgrade");
+		if (header.what == upgrade_sockets_done)
+			break;
+		if (header.what != upgrade_socket_fd || fd == -1)
+			continue;
+
+		header.type[sizeof(header.type) - 1] = '\0';
+		header.res[sizeof(header.res) - 1]   = '\0';
+		upgrade_add_source(header.type, header.res, fd);
+	}
+
+	return TRUE;
+}
+
+int upgrade_socket (char *type, char *res)
+{
+	int i, fd;
+
+	for (i = 0; i < source_count; i++)
+	{
+		if (sources[i].fd == -1 || strcmp(sources[i].type, type) != 0 || strcmp(sources[i].res, res) != 0)
+			continue;
+
+		fd = sources[i].fd;
+		sources[i].fd = -1;
+		return fd;
+	}
+
+	return -1;
+}
+
+static void upgrade_load (int fd, struct buffer *buffer)
+{
+	struct upgrade_record record;
+	struct stat st;
+	char *map, *pos, *msg;
+	long count;
+
+	SysFatal(fstat(fd, &st) == -1, errno, "On queue snapshot");
+	if (st.st_size == 0)
+		return;
+
+	map = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	SysFatal(map == MAP_FAILED, errno, "While reading queue snapshot");
+
+	/* In the order they were queued, ahead of anything read since */
+	for (pos = map, count = 0; pos + sizeof(record) <= map + st.st_size; pos += record.len, count++)
+	{
+		memcpy(&record, pos, sizeof(record));
+		pos += sizeof(record);
+		Fatal(record.len < 0 || pos + record.len > map + st.st_size, "Corrupt queue snapshot", "Upgrade");
+
+		msg = message_alloc(record.len + 1);
+		SysFatal(msg == NULL, errno, "While taking over queued messages");
+		memcpy(msg, pos, record.len);
+		msg[record.len] = '\0';
+		message_set_source(msg, record.source);
+		buffer->push(buffer, msg);
+	}
+
+	munmap(map, st.st_size);
+	CustomLog(__FILE__, __LINE__, error, "Took over %ld queued messages", count);
+}
+
+void upgrade_finish (struct reader *rd, struct buffer **buffers, int count)
+{
+	struct upgrade_header header;
+	struct input_handler *handler;
+	struct ih_common_priv *priv;
+	char *partial;
+	int i, fd;
+
+	/* Sources that went from the command line in the mean time */
+	for (i = 0; i < source_count; i++)
+	{
+		if (sources[i].fd != -1)
+		{
+			CustomLog(__FILE__, __LINE__, warning, "Closing %s source %s, it's no longer configured", sources[i].type, sources[i].res);
+			close(sources[i].fd);
+		}
+	}
+	free(sources);
+	sources = NULL;
+	source_count = 0;
+
+	memset(&header, 0, sizeof(header));
+	header.what = upgrade_ready;
+	Fatal(! upgrade_send(&header, -1, NULL), "Lost the old process", "Upgrade");
+
+	partial = (char*) malloc (GENCACHE_MAX_MSG_SIZE);
+	SysFatal(partial == NULL, errno, "While taking over connections");
+
+	/* Connections and queues, until the old process is done */
+	while (upgrade_recv(&header, &fd, partial, GENCACHE_MAX_MSG_SIZE) && header.what != upgrade_all_done)
+	{
+		if (fd == -1)
+			continue;
+
+		switch (header.what)
+		{
+			case upgrade_connection:
+				/* Picks up with the partial line the old process read */
+				handler = input_handler_tcp_connection_init("<slave>", fd, FALSE, FALSE);
+				priv = (struct ih_common_priv*) handler->priv;
+				memcpy(priv->inbuf->current, partial, header.len);
+				input_buffer_update(priv->inbuf, header.len);
+				rd->add_source(rd, handler);
+				break;
+
+			case upgrade_queue_fd:
+				if (header.index < count)
+					upgrade_load(fd, buffers[header.index]);
+				close(fd);
+				break;
+
+			default:
+				close(fd);
+		}
+	}
+
+	if (header.what != upgrade_all_done)
+		fprintf(stderr, "Lost the old process during the upgrade, going on with what was handed over\n");
+
+	free(partial);
+	close(channel);
+	channel = -1;
+}
@@ -0,0 +1,51 @@
+#ifndef GENCACHE_UPGRADE_H
+#define GENCACHE_UPGRADE_H
+
+#include "reader.h"
+#include "buffer.h"
+
+/** Live upgrade
+ *
+ * On SIGUSR2 genbuf starts its binary again, with the same arguments, and
+ * hands over to it without refusing a connection or losing a message.
+ * The two talk over a unix socket pair, the new process finds its end in
+ * the GENBUF_UPGRADE_FD environment variable. Sockets go along with
+ * SCM_RIGHTS.
+ *
+ *   1. The old process sends the sockets of its tcp, udp and unix sources.
+ *      The new one sets up with those instead of binding its own, and
+ *      reports it's ready. Until then the old process keeps serving, and
+ *      if the new one fails it just goes on.
+ *   2. The old process stops reading. The sockets stay open, whatever
+ *      comes in meanwhile waits in the kernel for the new process.
+ *   3. It sends its plain TCP connections, each with the partial line it
+ *      read from it. Compressed and relay connections have stream state
+ *      that can't move, they're closed. Their peers reconnect, and relay
+ *      peers send again what wasn't acknowledged.
+ *   4. Its destinations stop where they are. What's still queued for each
+ *      is written to a memfd, which is sent as well. Backlogs stay on disk
+ *      and are closed before the new process opens them.
+ *   5. The new process queues those messages ahead of anything new, takes
+ *      over the connections and starts serving. The old one exits.
+ *
+ * A write-ahead log can only be open in one process, so there's no upgrade
+ * with one.
+ */
+#define UPGRADE_ENV	"GENBUF_UPGRADE_FD"
+
+/* Milliseconds the new process gets to get ready */
+#define UPGRADE_TIMEOUT	30000
+
+/* The old process */
+extern void upgrade_sources     (struct reader *rd);	/* Note the sockets of the sources, before reading starts */
+extern int  upgrade_start       (char **argv);	/* Start the new process, TRUE once it's ready to take over */
+extern void upgrade_connections (struct reader *rd);	/* Hand over connections, once reading stopped */
+extern long upgrade_queue       (int index, struct buffer *buffer);	/* Hand over what a destination has queued */
+extern void upgrade_done        ();	/* That was all, the new process takes it from here */
+
+/* The new process */
+extern int  upgrade_init   ();	/* Take the sockets of the old process, TRUE when upgrading */
+extern int  upgrade_socket (char *type, char *res);	/* Socket of the old process for a source, or -1 */
+extern void upgrade_finish (struct reader *rd, struct buffer **buffers, int count);	/* Take over connections and queues */
+
+#endif /* GENCACHE_UPGRADE_H */